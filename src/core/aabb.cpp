@@ -48,4 +48,47 @@ AABB surrounding(AABB box0, AABB box1) {
     return AABB(small, big);
 }
 
+AABB surrounding(AABB box, const vec3& p) {
+    vec3 small(ffmin(box.min().x, p.x),
+               ffmin(box.min().y, p.y),
+               ffmin(box.min().z, p.z));
+    vec3 big  (ffmax(box.max().x, p.x),
+               ffmax(box.max().y, p.y),
+               ffmax(box.max().z, p.z));
+    return AABB(small, big);
+}
+
+AABB intersection(AABB box0, AABB box1) {
+    vec3 small(ffmax(box0.min().x, box1.min().x),
+               ffmax(box0.min().y, box1.min().y),
+               ffmax(box0.min().z, box1.min().z));
+    vec3 big  (ffmin(box0.max().x, box1.max().x),
+               ffmin(box0.max().y, box1.max().y),
+               ffmin(box0.max().z, box1.max().z));
+    return AABB(small, big);
+}
+
+AABB transform_bounds(const AABB& box, const mat4& m) {
+    vec3 min(infinity, infinity, infinity);
+    vec3 max(-infinity, -infinity, -infinity);
+
+    for(int i=0; i<2; i++) {            // 0: min.x, 1: max.x
+        for(int j=0; j<2; j++) {        // 0: min.y, 1: max.y
+            for(int k=0; k<2; k++) {    // 0: min.z, 1: max.z
+                auto x = (1-i)*box.min().x + i*box.max().x;
+                auto y = (1-j)*box.min().y + j*box.max().y;
+                auto z = (1-k)*box.min().z + k*box.max().z;
+                
+                vec3 tr_corner = mat4::point_mul(m, vec3(x, y, z));
+                for(int l=0; l<3; l++) {
+                    min[l] = fmin(min[l], tr_corner[l]);
+                    max[l] = fmax(max[l], tr_corner[l]);
+                }
+            } 
+        }
+    }
+
+    return AABB(min, max);
+}
+
 }
\ No newline at end of file
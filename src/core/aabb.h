@@ -1,6 +1,7 @@
 #pragma once
 
 #include "ray.h"
+#include "mat4.h"
 
 namespace mypt {
 
@@ -14,7 +15,9 @@ struct AABB {
 
     bool intersect(const Ray& r, Float t_min, Float t_max) const;
     
-    Float surface_area() {
+    vec3 centroid() const { return 0.5 * (_min + _max); }
+
+    Float surface_area() const {
         Float dx = _max.x - _min.x;
         Float dy = _max.y - _min.y;
         Float dz = _max.z - _min.z;
@@ -35,5 +38,10 @@ private:
 };
 
 AABB surrounding(AABB box0, AABB box1);
+AABB surrounding(AABB box, const vec3& p);
+// Overlapping region of two boxes. It is inverted (min > max) when they are disjoint.
+AABB intersection(AABB box0, AABB box1);
+// Bounding box of the eight corners of `box` transformed by `m`.
+AABB transform_bounds(const AABB& box, const mat4& m);
 
 }
\ No newline at end of file
@@ -0,0 +1,38 @@
+#include "alias_table.h"
+#include "util.h"
+
+namespace mypt {
+
+/** Bins under the average weight are filled up by the excess of bins over it, one pair at a
+ *  time, so that all bins end with the same total probability 1/n. */
+AliasTable::AliasTable(const std::vector<Float>& weights) : bins(weights.size()) {
+    for(auto w : weights)
+        sum += w;
+    Assert(sum > 0, "Weights of an alias table must have a positive sum\n");
+
+    const int n = static_cast<int>(weights.size());
+    std::vector<Float> scaled(n);
+    std::vector<int> under, over;
+    for(int i=0; i<n; i++) {
+        bins[i].pmf = weights[i] / sum;
+        bins[i].alias = i;
+        scaled[i] = bins[i].pmf * n;
+        (scaled[i] < 1 ? under : over).push_back(i);
+    }
+    while(!under.empty() && !over.empty()) {
+        const int u = under.back(), o = over.back();
+        under.pop_back();
+        bins[u].q = scaled[u];
+        bins[u].alias = o;
+        scaled[o] -= 1 - scaled[u];
+        if(scaled[o] < 1) {
+            over.pop_back();
+            under.push_back(o);
+        }
+    }
+    // Bins left in either list are full up to rounding errors.
+    for(int i : under) bins[i].q = 1;
+    for(int i : over)  bins[i].q = 1;
+}
+
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "math_util.h"
+#include <algorithm>
+#include <vector>
+
+namespace mypt {
+
+/** \brief Discrete distribution over indices proportional to given weights, sampled in O(1)
+ *  by the alias method (Vose 1991). Each bin keeps its own index with probability `q`,
+ *  and otherwise gives its `alias`, so a sample costs one lookup for one random number. */
+class AliasTable {
+public:
+    AliasTable() = default;
+    /// \brief `weights` must be non-negative with a positive sum.
+    explicit AliasTable(const std::vector<Float>& weights);
+
+    /// \brief Index drawn with `u` in [0, 1), and its probability in `pmf`.
+    int sample(Float u, Float& pmf) const {
+        const int n = static_cast<int>(bins.size());
+        const Float x = u * n;
+        const int i = std::min(static_cast<int>(x), n - 1);
+        const int index = x - i < bins[i].q ? i : bins[i].alias;
+        pmf = bins[index].pmf;
+        return index;
+    }
+    Float pmf(int index) const { return bins[index].pmf; }
+    // Sum of the weights, which normalizes them into `pmf`.
+    Float total() const { return sum; }
+
+    size_t size() const { return bins.size(); }
+    bool empty() const { return bins.empty(); }
+
+private:
+    struct Bin {
+        Float q;        // Probability of keeping the own index
+        Float pmf;      // Probability of the own index
+        int alias;
+    };
+    std::vector<Bin> bins;
+    Float sum = 0;
+};
+
+}
@@ -1,4 +1,10 @@
 #include "bvh.h"
+#include "mesh_primitive.h"
+#include "../shape/triangle.h"
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 namespace mypt {
 
@@ -11,6 +17,7 @@ BVHNode::BVHNode(std::vector<std::shared_ptr<Primitive>>& p, int start, int end,
                                     : box_z_compare;
 
     int primitive_span = end - start;
+    split_axis = axis;
 
     // Create leaf node with primitives
     if (primitive_span == 1) {
@@ -32,7 +39,11 @@ BVHNode::BVHNode(std::vector<std::shared_ptr<Primitive>>& p, int start, int end,
             right = std::make_shared<BVHNode>(p, mid, end, axis, splitMethod);
             break;
         }
-        case SplitMethod::SAH: {
+        case SplitMethod::SAH:
+        case SplitMethod::BINNED_SAH:
+        case SplitMethod::LBVH:
+        case SplitMethod::HLBVH:
+        case SplitMethod::SBVH: {
             int splitIndex = 1;
             Float bestCost = std::numeric_limits<Float>::infinity();
             int bestAxis = 0;
@@ -67,6 +78,7 @@ BVHNode::BVHNode(std::vector<std::shared_ptr<Primitive>>& p, int start, int end,
                 }
             }
             
+            split_axis = bestAxis;
             left = std::make_shared<BVHNode>(p, start, splitIndex, bestAxis, splitMethod);
             right = std::make_shared<BVHNode>(p, splitIndex, end, bestAxis, splitMethod);
             break;
@@ -84,13 +96,28 @@ BVHNode::BVHNode(std::vector<std::shared_ptr<Primitive>>& p, int start, int end,
 // ----------------------------------------------------------------------------
 bool BVHNode::intersect(const Ray& r, Float t_min, Float t_max, SurfaceInteraction& si) const 
 {
+    STAT_ADD(nodes, 1);
+    STAT_ADD(box_tests, 1);
     if(!box.intersect(r, t_min, t_max))
         return false;
     
-    bool hit_left = left->intersect(r, t_min, t_max, si);
-    bool hit_right = right->intersect(r, t_min, hit_left ? si.t : t_max, si);
+    // Visit the child on the side the ray comes from first, so that the far one is culled by closer t_max.
+    const auto& first = r.direction()[split_axis] < 0 ? right : left;
+    const auto& second = r.direction()[split_axis] < 0 ? left : right;
+    bool hit_first = first->intersect(r, t_min, t_max, si);
+    bool hit_second = second->intersect(r, t_min, hit_first ? si.t : t_max, si);
 
-    return hit_left | hit_right;
+    return hit_first | hit_second;
+}
+
+// ----------------------------------------------------------------------------
+bool BVHNode::occluded(const Ray& r, Float t_min, Float t_max) const 
+{
+    STAT_ADD(nodes, 1);
+    STAT_ADD(box_tests, 1);
+    if(!box.intersect(r, t_min, t_max))
+        return false;
+    return left->occluded(r, t_min, t_max) || right->occluded(r, t_min, t_max);
 }
 
 // ----------------------------------------------------------------------------
@@ -99,4 +126,562 @@ AABB BVHNode::bounding() const
     return box;
 }
 
+// ----------------------------------------------------------------------------
+Float BVHNode::sah_cost(Float traversal_cost, Float intersect_cost) const
+{
+    Float root_area = box.surface_area();
+    if(root_area <= 0) 
+        return 0;
+    return area_weighted_cost(traversal_cost, intersect_cost) / root_area;
+}
+
+Float BVHNode::area_weighted_cost(Float traversal_cost, Float intersect_cost) const
+{
+    const Float area = box.surface_area();
+    Float cost = traversal_cost * area;
+    for(const auto& child : { left, right }) {
+        if(child->type() == PrimitiveType::BVHNode)
+            cost += static_cast<const BVHNode&>(*child).area_weighted_cost(traversal_cost, intersect_cost);
+        else
+            cost += intersect_cost * area;
+    }
+    return cost;
+}
+
+// ----------------------------------------------------------------------------
+bool LinearBVH::intersect(const Ray& r, Float t_min, Float t_max, SurfaceInteraction& si) const 
+{
+    if(nodes.empty()) 
+        return false;
+    return motion_bounds.empty() ? intersect_single<false>(r, t_min, t_max, si)
+                                 : intersect_single<true>(r, t_min, t_max, si);
+}
+
+bool LinearBVH::occluded(const Ray& r, Float t_min, Float t_max) const 
+{
+    if(nodes.empty()) 
+        return false;
+    return motion_bounds.empty() ? occluded_single<false>(r, t_min, t_max)
+                                 : occluded_single<true>(r, t_min, t_max);
+}
+
+template <bool Motion>
+bool LinearBVH::intersect_single(const Ray& r, Float t_min, Float t_max, SurfaceInteraction& si) const 
+{
+    // Precompute inverse direction and its sign once per ray.
+    const vec3 o = r.origin();
+    const vec3 inv_dir(1.0 / r.direction().x, 1.0 / r.direction().y, 1.0 / r.direction().z);
+    const int dir_is_neg[3] = { inv_dir.x < 0, inv_dir.y < 0, inv_dir.z < 0 };
+
+    // Box of a node at the time of the ray.
+    auto box = [&](int index) -> LinearBVHNode {
+        return Motion ? motion_bounds[index].at(r.time()) : nodes[index];
+    };
+
+    STAT_ADD(box_tests, 1);
+    if(!box(0).intersect(o, inv_dir, dir_is_neg, t_min, t_max))
+        return false;
+
+    /** Children are tested before they are visited. The far child is pushed with its 
+     *  entry distance, and skipped when popped if a closer hit was found meanwhile. */
+    struct StackEntry { int node; Float t_entry; };
+    StackEntry to_visit[max_depth];
+    int to_visit_offset = 0;
+    int current = 0;
+    bool hit = false;
+    // Closest hit in triangle blocks, whose SurfaceInteraction is filled after traversal.
+    int hit_prim = -1;
+    float hit_u = 0, hit_v = 0;
+
+    while(true) {
+        const LinearBVHNode& node = nodes[current];
+        STAT_ADD(nodes, 1);
+        if(node.n_primitives > 0) {
+            hit |= intersect_leaf(current, r, t_min, t_max, si, hit_prim, hit_u, hit_v);
+        } else {
+            // Near child is the one on the side of the split axis the ray comes from.
+            int near = current + 1, far = node.second_child_offset;
+            if(dir_is_neg[node.axis]) std::swap(near, far);
+
+            Float t_near, t_far;
+            STAT_ADD(box_tests, 2);
+            bool hit_near = box(near).intersect(o, inv_dir, dir_is_neg, t_min, t_max, t_near);
+            bool hit_far = box(far).intersect(o, inv_dir, dir_is_neg, t_min, t_max, t_far);
+            if(hit_near) {
+                if(hit_far) to_visit[to_visit_offset++] = { far, t_far };
+                current = near;
+                continue;
+            }
+            if(hit_far) {
+                current = far;
+                continue;
+            }
+        }
+
+        // Pop the next node which may still contain a closer hit.
+        while(to_visit_offset > 0 && to_visit[to_visit_offset-1].t_entry > t_max)
+            to_visit_offset--;
+        if(to_visit_offset == 0) break;
+        current = to_visit[--to_visit_offset].node;
+    }
+    set_leaf_hit(r, hit_prim, t_max, hit_u, hit_v, si);
+    return hit;
+}
+
+template <bool Motion>
+bool LinearBVH::occluded_single(const Ray& r, Float t_min, Float t_max) const 
+{
+    const vec3 o = r.origin();
+    const vec3 inv_dir(1.0 / r.direction().x, 1.0 / r.direction().y, 1.0 / r.direction().z);
+    const int dir_is_neg[3] = { inv_dir.x < 0, inv_dir.y < 0, inv_dir.z < 0 };
+
+    // Any hit terminates the traversal, so `t_max` never shrinks and children need no ordering.
+    int to_visit[max_depth];
+    int to_visit_offset = 0;
+    int current = 0;
+
+    while(true) {
+        const LinearBVHNode& node = nodes[current];
+        STAT_ADD(nodes, 1);
+        STAT_ADD(box_tests, 1);
+        const bool hit_box = Motion ? motion_bounds[current].at(r.time()).intersect(o, inv_dir, dir_is_neg, t_min, t_max)
+                                    : node.intersect(o, inv_dir, dir_is_neg, t_min, t_max);
+        if(hit_box) {
+            if(node.n_primitives > 0) {
+                if(occluded_leaf(current, r, t_min, t_max))
+                    return true;
+            } else {
+                to_visit[to_visit_offset++] = node.second_child_offset;
+                current = current + 1;
+                continue;
+            }
+        }
+        if(to_visit_offset == 0) break;
+        current = to_visit[--to_visit_offset];
+    }
+    return false;
+}
+
+// ----------------------------------------------------------------------------
+/** Single-precision ray for triangle blocks. */
+struct BlockRay {
+    explicit BlockRay(const Ray& r) {
+        for(int a=0; a<3; a++) {
+            o[a] = static_cast<float>(r.origin()[a]);
+            d[a] = static_cast<float>(r.direction()[a]);
+        }
+    }
+    float o[3], d[3];
+};
+
+// Same rejection of parallel rays as Triangle::hit().
+static constexpr float block_det_eps = 1e-10f;
+
+/** Moller-Trumbore test of all lanes of a block. Returns the mask of lanes hit in [t_min, t_max]. */
+static inline int intersect_block(const TriangleBlock& b, const BlockRay& r, float t_min, float t_max, 
+                                  float (&t)[TriangleBlock::width], float (&u)[TriangleBlock::width], float (&v)[TriangleBlock::width]) 
+{
+#if defined(__SSE2__)
+    const __m128 dx = _mm_set1_ps(r.d[0]), dy = _mm_set1_ps(r.d[1]), dz = _mm_set1_ps(r.d[2]);
+    const __m128 e1x = _mm_load_ps(b.e1[0]), e1y = _mm_load_ps(b.e1[1]), e1z = _mm_load_ps(b.e1[2]);
+    const __m128 e2x = _mm_load_ps(b.e2[0]), e2y = _mm_load_ps(b.e2[1]), e2z = _mm_load_ps(b.e2[2]);
+
+    // alpha = d x e2, det = e1 . alpha
+    const __m128 ax = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+    const __m128 ay = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+    const __m128 az = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+    const __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, ax), _mm_mul_ps(e1y, ay)), _mm_mul_ps(e1z, az));
+    const __m128 inv_det = _mm_div_ps(_mm_set1_ps(1.0f), det);
+
+    const __m128 ovx = _mm_sub_ps(_mm_set1_ps(r.o[0]), _mm_load_ps(b.p0[0]));
+    const __m128 ovy = _mm_sub_ps(_mm_set1_ps(r.o[1]), _mm_load_ps(b.p0[1]));
+    const __m128 ovz = _mm_sub_ps(_mm_set1_ps(r.o[2]), _mm_load_ps(b.p0[2]));
+    const __m128 uu = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ax, ovx), _mm_mul_ps(ay, ovy)), _mm_mul_ps(az, ovz)), inv_det);
+
+    // beta = (o - p0) x e1
+    const __m128 bx = _mm_sub_ps(_mm_mul_ps(ovy, e1z), _mm_mul_ps(ovz, e1y));
+    const __m128 by = _mm_sub_ps(_mm_mul_ps(ovz, e1x), _mm_mul_ps(ovx, e1z));
+    const __m128 bz = _mm_sub_ps(_mm_mul_ps(ovx, e1y), _mm_mul_ps(ovy, e1x));
+    const __m128 vv = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, bx), _mm_mul_ps(dy, by)), _mm_mul_ps(dz, bz)), inv_det);
+    const __m128 tt = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, bx), _mm_mul_ps(e2y, by)), _mm_mul_ps(e2z, bz)), inv_det);
+
+    const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+    const __m128 abs_det = _mm_andnot_ps(_mm_set1_ps(-0.0f), det);
+    __m128 valid = _mm_cmpge_ps(abs_det, _mm_set1_ps(block_det_eps));
+    valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(uu, zero), _mm_cmple_ps(uu, one)));
+    valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(vv, zero), _mm_cmple_ps(_mm_add_ps(uu, vv), one)));
+    valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(tt, _mm_set1_ps(t_min)), _mm_cmple_ps(tt, _mm_set1_ps(t_max))));
+
+    _mm_storeu_ps(t, tt);
+    _mm_storeu_ps(u, uu);
+    _mm_storeu_ps(v, vv);
+    return _mm_movemask_ps(valid);
+#else
+    int mask = 0;
+    for(int i=0; i<TriangleBlock::width; i++) {
+        float ax = r.d[1]*b.e2[2][i] - r.d[2]*b.e2[1][i];
+        float ay = r.d[2]*b.e2[0][i] - r.d[0]*b.e2[2][i];
+        float az = r.d[0]*b.e2[1][i] - r.d[1]*b.e2[0][i];
+        float det = b.e1[0][i]*ax + b.e1[1][i]*ay + b.e1[2][i]*az;
+        float inv_det = 1.0f / det;
+        float ovx = r.o[0] - b.p0[0][i], ovy = r.o[1] - b.p0[1][i], ovz = r.o[2] - b.p0[2][i];
+        u[i] = (ax*ovx + ay*ovy + az*ovz) * inv_det;
+        float bx = ovy*b.e1[2][i] - ovz*b.e1[1][i];
+        float by = ovz*b.e1[0][i] - ovx*b.e1[2][i];
+        float bz = ovx*b.e1[1][i] - ovy*b.e1[0][i];
+        v[i] = (r.d[0]*bx + r.d[1]*by + r.d[2]*bz) * inv_det;
+        t[i] = (b.e2[0][i]*bx + b.e2[1][i]*by + b.e2[2][i]*bz) * inv_det;
+        bool valid = std::fabs(det) >= block_det_eps && u[i] >= 0 && u[i] <= 1 && v[i] >= 0 
+                  && u[i] + v[i] <= 1 && t[i] >= t_min && t[i] <= t_max;
+        mask |= valid << i;
+    }
+    return mask;
+#endif
+}
+
+bool LinearBVH::intersect_blocks(int leaf, const Ray& r, Float t_min, Float& t_max, 
+                                 int& hit_prim, float& hit_u, float& hit_v) const 
+{
+    const BlockRay br(r);
+    const LinearBVHNode& node = nodes[leaf];
+    const int n_blocks = (node.n_primitives + TriangleBlock::width - 1) / TriangleBlock::width;
+    STAT_ADD(prim_tests, node.n_primitives);
+
+    bool hit = false;
+    float t[TriangleBlock::width], u[TriangleBlock::width], v[TriangleBlock::width];
+    for(int k=0; k<n_blocks; k++) {
+        const TriangleBlock& block = blocks[leaf_blocks[leaf] + k];
+        int mask = intersect_block(block, br, static_cast<float>(t_min), static_cast<float>(t_max), t, u, v);
+        for(int i=0; mask; i++, mask >>= 1) {
+            if(!(mask & 1) || t[i] > t_max) continue;
+            STAT_ADD(hits, 1);
+            hit = true;
+            t_max = t[i];
+            hit_prim = block.prim[i];
+            hit_u = u[i];
+            hit_v = v[i];
+        }
+    }
+    return hit;
+}
+
+bool LinearBVH::occluded_blocks(int leaf, const Ray& r, Float t_min, Float t_max) const {
+    const BlockRay br(r);
+    const LinearBVHNode& node = nodes[leaf];
+    const int n_blocks = (node.n_primitives + TriangleBlock::width - 1) / TriangleBlock::width;
+    STAT_ADD(prim_tests, node.n_primitives);
+
+    float t[TriangleBlock::width], u[TriangleBlock::width], v[TriangleBlock::width];
+    for(int k=0; k<n_blocks; k++) {
+        if(intersect_block(blocks[leaf_blocks[leaf] + k], br, static_cast<float>(t_min), static_cast<float>(t_max), t, u, v)) {
+            STAT_ADD(hits, 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool LinearBVH::intersect_leaf(int leaf, const Ray& r, Float t_min, Float& t_max, SurfaceInteraction& si,
+                               int& hit_prim, float& hit_u, float& hit_v) const
+{
+    if(leaf_blocks[leaf] >= 0)
+        return intersect_blocks(leaf, r, t_min, t_max, hit_prim, hit_u, hit_v);
+    const LinearBVHNode& node = nodes[leaf];
+    bool hit = false;
+    for(int i=0; i<node.n_primitives; i++) {
+        if(primitives[node.primitives_offset + i]->intersect(r, t_min, t_max, si)) {
+            hit = true;
+            t_max = si.t;
+            hit_prim = -1;
+        }
+    }
+    return hit;
+}
+
+bool LinearBVH::occluded_leaf(int leaf, const Ray& r, Float t_min, Float t_max) const {
+    if(leaf_blocks[leaf] >= 0)
+        return occluded_blocks(leaf, r, t_min, t_max);
+    const LinearBVHNode& node = nodes[leaf];
+    for(int i=0; i<node.n_primitives; i++) {
+        if(primitives[node.primitives_offset + i]->occluded(r, t_min, t_max))
+            return true;
+    }
+    return false;
+}
+
+/** Normal, texture coordinates and material are fetched only here, for the final hit of a ray. */
+void LinearBVH::set_triangle_hit(const Ray& r, int prim, Float t, float u, float v, SurfaceInteraction& si) const {
+    if(mesh) {
+        mesh->set_hit(r, prim, t, u, v, si);
+        return;
+    }
+    const auto& shape_prim = static_cast<const ShapePrimitive&>(*primitives[prim]);
+    const auto& triangle = static_cast<const Triangle&>(*shape_prim.getShape());
+    si.t = t;
+    si.p = r.at(t);
+    si.set_face_normal(r, normalize(mat4::normal_mul(shape_prim.getTransform()->getInvMatrix(), triangle.normal_at(u, v))));
+    si.uv = triangle.uv_at(u, v);
+    si.mat_ptr = shape_prim.getMaterial();
+    si.prim = &shape_prim;
+}
+
+// ----------------------------------------------------------------------------
+void LinearBVH::setPacketSize(int n) {
+    Assert(n == 0 || n == 4 || n == 8 || n == 16, "Packet size must be 0 (disabled), 4, 8 or 16\n");
+    packet_size = n;
+}
+
+void LinearBVH::intersect_batch(const Ray* rays, int n_rays, Float t_min, Float t_max, 
+                                SurfaceInteraction* si, bool* hits) const
+{
+    for(int i=0; i<n_rays; i+=std::max(packet_size, 1)) {
+        int n = std::min(n_rays - i, std::max(packet_size, 1));
+        switch(packet_size) {
+        case 4:  intersect_packet<4>(rays + i, n, t_min, t_max, si + i, hits + i); break;
+        case 8:  intersect_packet<8>(rays + i, n, t_min, t_max, si + i, hits + i); break;
+        case 16: intersect_packet<16>(rays + i, n, t_min, t_max, si + i, hits + i); break;
+        default: hits[i] = intersect(rays[i], t_min, t_max, si[i]); break;
+        }
+    }
+}
+
+/** Single-precision rays of a packet as SoA, so that one node is tested against
+ *  4 (SSE) or 8 (AVX) lanes per instruction. */
+template <int N>
+struct alignas(32) PacketRays {
+    float o[3][N];
+    float inv_dir[3][N];
+    float t_max[N];
+};
+
+// Node bounds are rounded outward, but the rays are rounded to single precision,
+// so the distance interval is slightly widened to stay conservative (as in WideBVH).
+static constexpr float t_far_scale = 1.0f + 1e-5f;
+
+/** Bit mask of the lanes whose ray hits `node`. All rays share `dir_is_neg`,
+ *  so the near and far planes of each axis are broadcast to every lane. */
+template <int N>
+static inline int packet_hit_mask(const LinearBVHNode& node, const PacketRays<N>& p, const int dir_is_neg[3], float t_min) {
+    int mask = 0, j = 0;
+#if defined(__AVX__)
+    for(; j + 8 <= N; j += 8) {
+        __m256 t0 = _mm256_set1_ps(t_min);
+        __m256 t1 = _mm256_load_ps(p.t_max + j);
+        for(int a=0; a<3; a++) {
+            const __m256 o = _mm256_load_ps(p.o[a] + j);
+            const __m256 inv_dir = _mm256_load_ps(p.inv_dir[a] + j);
+            __m256 t_near = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(node.bounds[dir_is_neg[a]][a]), o), inv_dir);
+            __m256 t_far  = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(node.bounds[1-dir_is_neg[a]][a]), o), inv_dir);
+            t0 = _mm256_max_ps(t0, t_near);
+            t1 = _mm256_min_ps(t1, t_far);
+        }
+        mask |= _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ)) << j;
+    }
+#endif
+#if defined(__SSE2__)
+    for(; j + 4 <= N; j += 4) {
+        __m128 t0 = _mm_set1_ps(t_min);
+        __m128 t1 = _mm_load_ps(p.t_max + j);
+        for(int a=0; a<3; a++) {
+            const __m128 o = _mm_load_ps(p.o[a] + j);
+            const __m128 inv_dir = _mm_load_ps(p.inv_dir[a] + j);
+            __m128 t_near = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.bounds[dir_is_neg[a]][a]), o), inv_dir);
+            __m128 t_far  = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.bounds[1-dir_is_neg[a]][a]), o), inv_dir);
+            t0 = _mm_max_ps(t0, t_near);
+            t1 = _mm_min_ps(t1, t_far);
+        }
+        mask |= _mm_movemask_ps(_mm_cmple_ps(t0, t1)) << j;
+    }
+#endif
+    for(; j < N; j++) {
+        float t0 = t_min, t1 = p.t_max[j];
+        for(int a=0; a<3; a++) {
+            float t_near = (node.bounds[dir_is_neg[a]][a] - p.o[a][j]) * p.inv_dir[a][j];
+            float t_far  = (node.bounds[1-dir_is_neg[a]][a] - p.o[a][j]) * p.inv_dir[a][j];
+            t0 = t_near > t0 ? t_near : t0;
+            t1 = t_far < t1 ? t_far : t1;
+        }
+        mask |= (t0 <= t1) << j;
+    }
+    return mask;
+}
+
+/** Bounds of the origins, reciprocal directions and far distances over the live lanes of a packet. */
+struct PacketInterval {
+    float o_min[3], o_max[3];
+    float inv_min[3], inv_max[3];
+    float t_max;
+};
+
+template <int N>
+static inline void packet_interval(const PacketRays<N>& p, int n_rays, PacketInterval& iv) {
+    for(int a=0; a<3; a++) {
+        iv.o_min[a] = iv.o_max[a] = p.o[a][0];
+        iv.inv_min[a] = iv.inv_max[a] = p.inv_dir[a][0];
+        for(int i=1; i<n_rays; i++) {
+            iv.o_min[a] = std::min(iv.o_min[a], p.o[a][i]);
+            iv.o_max[a] = std::max(iv.o_max[a], p.o[a][i]);
+            iv.inv_min[a] = std::min(iv.inv_min[a], p.inv_dir[a][i]);
+            iv.inv_max[a] = std::max(iv.inv_max[a], p.inv_dir[a][i]);
+        }
+    }
+    iv.t_max = *std::max_element(p.t_max, p.t_max + n_rays);
+}
+
+/** Interval arithmetic test of a whole packet against `node`: the entry distance of every lane
+ *  is at least the lower bound of (near plane - origin) * inv_dir over the intervals, and the 
+ *  exit distance at most the upper bound of the far one, so that no lane can hit the node when 
+ *  these bounds don't overlap. Rounding is monotonic, so this is as conservative as the lanes. */
+static inline bool packet_misses(const LinearBVHNode& node, const PacketInterval& iv, const int dir_is_neg[3], float t_min) {
+    float t0 = t_min, t1 = iv.t_max;
+    for(int a=0; a<3; a++) {
+        // Axis parallel lanes (infinite inv_dir) leave the axis unbounded.
+        if(!std::isfinite(iv.inv_min[a]) || !std::isfinite(iv.inv_max[a]))
+            continue;
+        const float near_lo = node.bounds[dir_is_neg[a]][a] - iv.o_max[a];
+        const float near_hi = node.bounds[dir_is_neg[a]][a] - iv.o_min[a];
+        const float far_lo = node.bounds[1-dir_is_neg[a]][a] - iv.o_max[a];
+        const float far_hi = node.bounds[1-dir_is_neg[a]][a] - iv.o_min[a];
+        t0 = std::max(t0, std::min({ near_lo * iv.inv_min[a], near_lo * iv.inv_max[a], 
+                                     near_hi * iv.inv_min[a], near_hi * iv.inv_max[a] }));
+        t1 = std::min(t1, std::max({ far_lo * iv.inv_min[a], far_lo * iv.inv_max[a], 
+                                     far_hi * iv.inv_min[a], far_hi * iv.inv_max[a] }));
+    }
+    return t0 > t1;
+}
+
+/** Packet traversal. Rays are converted to single precision once per packet, and each node 
+ *  is tested against all lanes with SIMD. The mask of lanes hitting a node is kept with it 
+ *  on the stack, so that its descendants are only tested for these rays and the node is
+ *  culled as soon as no lane is left. Before the lanes, the node is tested once for the whole 
+ *  packet by interval arithmetic, which rejects nodes missed by all rays at the cost of one ray. */
+template <int N>
+void LinearBVH::intersect_packet(const Ray* rays, int n_rays, Float t_min, Float t_max, 
+                                 SurfaceInteraction* si, bool* hits) const
+{
+    PacketRays<N> p;
+    Float ray_t_max[N];
+    for(int i=0; i<N; i++) {
+        // Unused lanes repeat the first ray, and are never active.
+        const Ray& r = rays[i < n_rays ? i : 0];
+        for(int a=0; a<3; a++) {
+            p.o[a][i] = static_cast<float>(r.origin()[a]);
+            p.inv_dir[a][i] = static_cast<float>(1.0 / r.direction()[a]);
+        }
+        ray_t_max[i] = t_max;
+        p.t_max[i] = static_cast<float>(t_max) * t_far_scale;
+        if(i < n_rays) hits[i] = false;
+    }
+    int hit_prim[N];
+    float hit_u[N], hit_v[N];
+    for(int i=0; i<N; i++) hit_prim[i] = -1;
+
+    // Packets whose rays don't share direction signs are traced one by one.
+    int dir_is_neg[3];
+    for(int a=0; a<3; a++) {
+        dir_is_neg[a] = p.inv_dir[a][0] < 0;
+        for(int i=1; i<n_rays; i++) {
+            if((p.inv_dir[a][i] < 0) != dir_is_neg[a]) {
+                for(int j=0; j<n_rays; j++)
+                    hits[j] = intersect(rays[j], t_min, t_max, si[j]);
+                return;
+            }
+        }
+    }
+    if(nodes.empty()) return;
+
+    PacketInterval interval;
+    packet_interval<N>(p, n_rays, interval);
+
+    struct PacketEntry { int node, mask; };
+    PacketEntry to_visit[max_depth];
+    int to_visit_offset = 0;
+    int current = 0, active = (1 << n_rays) - 1;
+    const float t_min_f = static_cast<float>(t_min);
+
+    while(true) {
+        const LinearBVHNode& node = nodes[current];
+        STAT_ADD(nodes, 1);
+        int mask = 0;
+        if(packet_misses(node, interval, dir_is_neg, t_min_f)) {
+            STAT_ADD(box_tests, 1);
+        } else {
+            STAT_ADD(box_tests, 1 + n_rays);
+            mask = active & packet_hit_mask<N>(node, p, dir_is_neg, t_min_f);
+        }
+
+        if(mask) {
+            if(node.n_primitives > 0) {
+                bool shrunk = false;
+                for(int i=0; i<n_rays; i++) {
+                    if(!(mask & (1 << i))) continue;
+                    const Float t_before = ray_t_max[i];
+                    if(intersect_leaf(current, rays[i], t_min, ray_t_max[i], si[i], hit_prim[i], hit_u[i], hit_v[i]))
+                        hits[i] = true;
+                    // Closer hits shrink the interval of the lane for the remaining nodes.
+                    if(ray_t_max[i] < t_before) {
+                        p.t_max[i] = static_cast<float>(ray_t_max[i]) * t_far_scale;
+                        shrunk = true;
+                    }
+                }
+                if(shrunk)
+                    interval.t_max = *std::max_element(p.t_max, p.t_max + n_rays);
+            } else {
+                // All rays share the sign, so the near child is the same for the whole packet.
+                if(dir_is_neg[node.axis]) {
+                    to_visit[to_visit_offset++] = { current + 1, mask };
+                    current = node.second_child_offset;
+                } else {
+                    to_visit[to_visit_offset++] = { node.second_child_offset, mask };
+                    current = current + 1;
+                }
+                active = mask;
+                continue;
+            }
+        }
+        if(to_visit_offset == 0) break;
+        --to_visit_offset;
+        current = to_visit[to_visit_offset].node;
+        active = to_visit[to_visit_offset].mask;
+    }
+    for(int i=0; i<n_rays; i++)
+        set_leaf_hit(rays[i], hit_prim[i], ray_t_max[i], hit_u[i], hit_v[i], si[i]);
+}
+
+// ----------------------------------------------------------------------------
+AABB LinearBVH::bounding() const
+{
+    if(nodes.empty()) 
+        return AABB();
+    const auto& b = nodes[0].bounds;
+    return AABB(vec3(b[0].x, b[0].y, b[0].z), vec3(b[1].x, b[1].y, b[1].z));
+}
+
+// ----------------------------------------------------------------------------
+Float LinearBVH::sah_cost() const
+{
+    if(nodes.empty()) 
+        return 0;
+
+    auto area = [](const LinearBVHNode& node) {
+        Float dx = node.bounds[1].x - node.bounds[0].x;
+        Float dy = node.bounds[1].y - node.bounds[0].y;
+        Float dz = node.bounds[1].z - node.bounds[0].z;
+        return 2 * (dx*dy + dy*dz + dz*dx);
+    };
+
+    Float root_area = area(nodes[0]);
+    if(root_area <= 0) 
+        return 0;
+
+    Float cost = 0;
+    for(const auto& node : nodes) {
+        if(node.n_primitives > 0) 
+            cost += params.intersect_cost * node.n_primitives * area(node);
+        else 
+            cost += params.traversal_cost * area(node);
+    }
+    return cost / root_area;
+}
+
 }
\ No newline at end of file
@@ -1,10 +1,15 @@
 #pragma once
 
 #include <algorithm>
+#include <cstdint>
+#include <functional>
 #include "primitive.h"
+#include "stats.h"
 
 namespace mypt {
 
+class MeshPrimitive;
+
 inline bool box_compare(const std::shared_ptr<Primitive> a, const std::shared_ptr<Primitive> b, int axis) {
     return a->bounding().min()[axis] < b->bounding().min()[axis];
 }
@@ -26,26 +31,245 @@ inline bool box_z_compare(const std::shared_ptr<Primitive> a, const std::shared_
  *  Primitives will be ShapePrimitive in leaf node, and others will be BVH node. */
 class BVHNode : public Primitive {
 public:
-    enum class SplitMethod { MIDDLE, SAH };
+    enum class SplitMethod { MIDDLE, SAH, BINNED_SAH, LBVH, HLBVH, SBVH };
 
     BVHNode(std::vector<std::shared_ptr<Primitive>>& p, 
             int start, int end, int axis=0, 
             SplitMethod splitMethod=SplitMethod::MIDDLE);
 
     bool intersect(const Ray& r, Float tmin, Float tmax, SurfaceInteraction& si) const override;
+    bool occluded(const Ray& r, Float t_min, Float t_max) const override;
     AABB bounding() const override;
 
     PrimitiveType type() const override { return PrimitiveType::BVHNode; }
 
+    /** \brief SAH cost of the tree in the model of LinearBVH::sah_cost(), to compare the builders.
+     *  Both children of a node are tested when it is visited, so primitive children are 
+     *  weighted by the surface area of their parent. */
+    Float sah_cost(Float traversal_cost, Float intersect_cost) const;
+
     std::string to_string() const override {
         return "BVHNode : {}";
     }
 
 private:
+    // Sum of costs weighted by surface area, not yet relative to the root.
+    Float area_weighted_cost(Float traversal_cost, Float intersect_cost) const;
+
     std::shared_ptr<Primitive> left;
     std::shared_ptr<Primitive> right;
     AABB box;
     SplitMethod splitMethod;
+    int split_axis;
+};
+
+// -------------------------------------------------------------------------------------
+/** \brief Configuration of LinearBVH construction.
+ *  Costs are relative, only the ratio between traversal and intersection matters. */
+struct BVHBuildParams {
+    BVHNode::SplitMethod splitMethod = BVHNode::SplitMethod::BINNED_SAH;
+    int max_prims_in_node = 4;
+    int n_bins = 16;                // Number of bins per axis for BINNED_SAH (<= 64)
+    Float traversal_cost = 1.0;     // Cost of visiting an interior node
+    Float intersect_cost = 1.0;     // Cost of a ray-primitive intersection test
+    int morton_bits = 30;           // Length of Morton codes for LBVH/HLBVH (30 or 63)
+    Float sbvh_budget = 0.3;        // Maximum ratio of duplicated references for SBVH
+    int optimize_passes = 0;        // Passes of treelet restructuring after build (0: disabled)
+    Float rebuild_ratio = 1.5;      // LinearBVH::update() rebuilds when refitting grows SAH cost over this ratio
+};
+
+/** \brief Triangles of a leaf in world space, stored as SoA for one SIMD Moller-Trumbore test.
+ *  Edges are precomputed, and lanes without a triangle have zero edges so that they never hit. */
+struct alignas(16) TriangleBlock {
+    static constexpr int width = 4;
+    float p0[3][width];         // [axis][lane]
+    float e1[3][width];         // p1 - p0
+    float e2[3][width];         // p2 - p0
+    int prim[width];            // Index into LinearBVH::primitives, or face of the mesh
+};
+
+/** \brief Per-primitive information used while building LinearBVH. 
+ *  Bounds and centroids are computed once, so the builder never calls 
+ *  `Primitive::bounding()` in its inner loops. */
+struct BVHPrimitiveInfo {
+    BVHPrimitiveInfo() {}
+    BVHPrimitiveInfo(size_t index, const AABB& bounds)
+    : index(index), bounds(bounds), centroid(bounds.centroid()) {}
+
+    size_t index;
+    AABB bounds;
+    vec3 centroid;
+};
+
+/** \brief 32-byte node of LinearBVH. 
+ *  Nodes are stored in depth-first order, so the first child of an interior node 
+ *  always follows its parent and only the offset to the second child is stored.
+ *  Bounds are kept in single precision and rounded outward. */
+struct LinearBVHNode {
+    type3<float> bounds[2];         // [0]: min, [1]: max
+    union {
+        int primitives_offset;      // leaf
+        int second_child_offset;    // interior
+    };
+    uint16_t n_primitives;          // 0 -> interior node
+    uint8_t axis;                   // split axis of interior node
+    uint8_t pad[1];
+
+    /** Slab test of the ray within [t_min, t_max], which also returns the distance where
+     *  the ray enters the box. `inv_dir` and `dir_is_neg` are precomputed once per ray by the traversal. */
+    bool intersect(const vec3& o, const vec3& inv_dir, const int dir_is_neg[3], 
+                   Float t_min, Float t_max, Float& t_entry) const {
+        Float tx0 = (bounds[dir_is_neg[0]].x - o.x) * inv_dir.x;
+        Float tx1 = (bounds[1-dir_is_neg[0]].x - o.x) * inv_dir.x;
+        Float ty0 = (bounds[dir_is_neg[1]].y - o.y) * inv_dir.y;
+        Float ty1 = (bounds[1-dir_is_neg[1]].y - o.y) * inv_dir.y;
+        Float tz0 = (bounds[dir_is_neg[2]].z - o.z) * inv_dir.z;
+        Float tz1 = (bounds[1-dir_is_neg[2]].z - o.z) * inv_dir.z;
+
+        t_entry = ffmax(t_min, ffmax(tx0, ffmax(ty0, tz0)));
+        t_max = ffmin(t_max, ffmin(tx1, ffmin(ty1, tz1)));
+        return t_entry <= t_max;
+    }
+
+    bool intersect(const vec3& o, const vec3& inv_dir, const int dir_is_neg[3], 
+                   Float t_min, Float t_max) const {
+        Float t_entry;
+        return intersect(o, inv_dir, dir_is_neg, t_min, t_max, t_entry);
+    }
+};
+static_assert(sizeof(LinearBVHNode) == 32, "LinearBVHNode must be 32 bytes");
+
+/** \brief Bounds of a LinearBVH node at shutter open (time 0) and close (time 1).
+ *  Primitives move linearly over the shutter, so the box interpolated between them at 
+ *  the time of a ray encloses the node at that time, and is much tighter than the union. */
+struct MotionBounds {
+    type3<float> bounds[2][2];      // [time][min/max]
+
+    /** Interpolated box in the layout of LinearBVHNode, to be tested by its `intersect`.
+     *  It is widened by a few ulps to cover the rounding error of interpolation. */
+    LinearBVHNode at(Float time) const {
+        constexpr float pad = 1.0f / (1 << 22);
+        LinearBVHNode node;
+        const float t = static_cast<float>(time);
+        for(int a=0; a<3; a++) {
+            float lo = bounds[0][0][a] * (1.0f - t) + bounds[1][0][a] * t;
+            float hi = bounds[0][1][a] * (1.0f - t) + bounds[1][1][a] * t;
+            node.bounds[0][a] = lo - std::fabs(lo) * pad;
+            node.bounds[1][a] = hi + std::fabs(hi) * pad;
+        }
+        return node;
+    }
+};
+
+/** \brief Pointer-free BVH whose nodes are stored in one contiguous array.
+ *  Traversal is iterative over a fixed-size stack instead of recursive virtual calls. */
+class LinearBVH final : public Primitive {
+public:
+    LinearBVH(const std::vector<std::shared_ptr<Primitive>>& p, 
+              const BVHBuildParams& params=BVHBuildParams());
+    /** BVH over the triangles of `mesh` referred to by face index, without any primitive object.
+     *  All leaves are triangle blocks, and hits are filled by `MeshPrimitive::set_hit`. */
+    LinearBVH(const MeshPrimitive& mesh, const BVHBuildParams& params=BVHBuildParams());
+
+    bool intersect(const Ray& r, Float t_min, Float t_max, SurfaceInteraction& si) const override;
+    bool occluded(const Ray& r, Float t_min, Float t_max) const override;
+    /** Rays are traced in packets of `packet_size` when they share direction signs, 
+     *  otherwise one by one. */
+    void intersect_batch(const Ray* rays, int n_rays, Float t_min, Float t_max, 
+                         SurfaceInteraction* si, bool* hits) const override;
+    AABB bounding() const override;
+
+    PrimitiveType type() const override { return PrimitiveType::LinearBVH; }
+
+    /** \brief SAH cost of the whole tree with the cost constants used to build it. 
+     *  Each node contributes its cost weighted by surface area relative to the root. */
+    Float sah_cost() const;
+    size_t num_nodes() const { return nodes.size(); }
+    size_t node_bytes() const { return nodes.size() * sizeof(LinearBVHNode); }
+    size_t block_bytes() const { return blocks.size() * sizeof(TriangleBlock) + leaf_blocks.size() * sizeof(int); }
+    // Primitives, or faces of the mesh, referred to by leaves (SBVH may duplicate them).
+    size_t num_references() const { return mesh ? mesh_faces.size() : primitives.size(); }
+    bool is_mesh() const { return mesh != nullptr; }
+
+    /** \brief Restructure treelets of up to 7 leaves into their SAH-optimal topology
+     *  bottom-up (Karras and Aila 2013). Each pass runs subtrees in parallel. */
+    void optimize(int n_passes);
+
+    /** Update node bounds bottom-up from the current primitive bounds, keeping the topology.
+     *  Primitives must have updated their bounds beforehand. Returns the SAH cost after refitting. */
+    Float refit();
+    /** Refit, or rebuild from scratch when the SAH cost exceeds `rebuild_ratio` times 
+     *  the cost right after the last build. Returns true if rebuilt. */
+    bool update();
+
+    // 0 disables packet traversal, otherwise 4, 8 or 16.
+    void setPacketSize(int n);
+    int getPacketSize() const { return packet_size; }
+
+    const std::vector<LinearBVHNode>& getNodes() const { return nodes; }
+    /** Tests of the primitives of leaf node `leaf`, which also trace the leaves of BVHs collapsed 
+     *  from this one with its triangle blocks. The closest hit in blocks is kept in `hit_prim`, 
+     *  `hit_u` and `hit_v` (`hit_prim` is -1 for other primitives, which fill `si` themselves),
+     *  and `set_leaf_hit` fills `si` for it after traversal. */
+    bool intersect_leaf(int leaf, const Ray& r, Float t_min, Float& t_max, SurfaceInteraction& si,
+                        int& hit_prim, float& hit_u, float& hit_v) const;
+    bool occluded_leaf(int leaf, const Ray& r, Float t_min, Float t_max) const;
+    void set_leaf_hit(const Ray& r, int hit_prim, Float t, float u, float v, SurfaceInteraction& si) const {
+        if(hit_prim >= 0) set_triangle_hit(r, hit_prim, t, u, v, si);
+    }
+    const std::vector<std::shared_ptr<Primitive>>& getPrimitives() const { return primitives; }
+
+    std::string to_string() const override {
+        std::ostringstream oss;
+        oss << "LinearBVH : {" << std::endl;
+        oss << "\t" << (mesh ? "Triangles" : "Primitives") << " : " << num_references() << "," << std::endl;
+        oss << "\tNodes : " << nodes.size() << "," << std::endl;
+        oss << "\tSAH cost : " << sah_cost() << std::endl;
+        oss << "}";
+        return oss.str();
+    }
+
+    // Maximum depth of the tree, which is also the size of traversal stack.
+    static constexpr int max_depth = 64;
+private:
+    // Clipped bounds of the i-th primitive inside a box, for spatial splits of SBVH.
+    using ClipFunction = std::function<AABB(size_t, const AABB&)>;
+
+    void build(const std::vector<std::shared_ptr<Primitive>>& p);
+    void build_mesh();
+    // Build nodes over primitives with the given bounds, and return the primitive of each leaf reference.
+    std::vector<size_t> build_nodes(const std::vector<AABB>& prim_bounds, const ClipFunction& clip);
+    // Optimize if enabled, then precompute leaf data and the reference SAH cost.
+    void finish_build();
+    // Precompute TriangleBlocks of leaves whose primitives are all triangles.
+    void build_triangle_blocks();
+    /** Test triangle blocks of a leaf, and keep the closest hit in `hit_prim`, `hit_u` and `hit_v`.
+     *  SurfaceInteraction is only filled for the final hit by `set_triangle_hit`. */
+    bool intersect_blocks(int leaf, const Ray& r, Float t_min, Float& t_max, int& hit_prim, float& hit_u, float& hit_v) const;
+    bool occluded_blocks(int leaf, const Ray& r, Float t_min, Float t_max) const;
+    void set_triangle_hit(const Ray& r, int prim, Float t, float u, float v, SurfaceInteraction& si) const;
+    // Compute `motion_bounds` bottom-up if any primitive moves, otherwise leave it empty.
+    void build_motion_bounds();
+    /** Single-ray traversals. With `Motion`, boxes are interpolated by ray time from 
+     *  `motion_bounds`, otherwise the union bounds of nodes are tested. */
+    template <bool Motion>
+    bool intersect_single(const Ray& r, Float t_min, Float t_max, SurfaceInteraction& si) const;
+    template <bool Motion>
+    bool occluded_single(const Ray& r, Float t_min, Float t_max) const;
+    template <int N>
+    void intersect_packet(const Ray* rays, int n_rays, Float t_min, Float t_max, 
+                          SurfaceInteraction* si, bool* hits) const;
+
+    std::vector<std::shared_ptr<Primitive>> primitives;
+    std::vector<LinearBVHNode> nodes;
+    BVHBuildParams params;
+    int packet_size = 8;
+    Float built_sah_cost = 0;       // Reference for the quality of refitted trees
+    std::vector<TriangleBlock> blocks;
+    std::vector<int> leaf_blocks;   // First block of each leaf node, -1 if the leaf is not made of triangles
+    std::vector<MotionBounds> motion_bounds;    // Per node, empty when nothing moves
+    const MeshPrimitive* mesh = nullptr;        // Owner of the BVH built over its triangles
+    std::vector<int> mesh_faces;                // Face of each leaf reference, only for meshes
 };
 
 }
\ No newline at end of file
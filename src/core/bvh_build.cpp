@@ -0,0 +1,1450 @@
+#include "bvh.h"
+#include "mesh_primitive.h"
+#include "../shape/triangle.h"
+#include <functional>
+#include <omp.h>
+
+/** Construction of LinearBVH.
+ *
+ * The build runs in four phases:
+ *  1. Bounds and centroids of all primitives are computed in parallel.
+ *     LBVH/HLBVH additionally sort primitives by Morton code here.
+ *  2. Large top-level partitions are split with parallel binning/partitioning
+ *     until they are small enough to become independent subtrees.
+ *  3. Subtrees are built in parallel, each into its own node array.
+ *  4. Top-level nodes and subtrees are flattened into one depth-first array.
+ *
+ * Every decision depends only on partition sizes, never on the number of threads,
+ * so the resulting tree is identical regardless of thread count. */
+
+namespace mypt {
+
+// Partitions larger than this are binned and partitioned in parallel.
+static constexpr int parallel_threshold = 1 << 16;
+// Number of primitives processed by one parallel chunk.
+static constexpr int parallel_chunk_size = 1 << 14;
+
+static int num_chunks(int n) {
+    return n >= parallel_threshold ? (n + parallel_chunk_size - 1) / parallel_chunk_size : 1;
+}
+
+static void chunk_range(int start, int end, int n_chunks, int c, int& s, int& e) {
+    int n = end - start;
+    s = start + static_cast<int>(static_cast<int64_t>(n) * c / n_chunks);
+    e = start + static_cast<int>(static_cast<int64_t>(n) * (c+1) / n_chunks);
+}
+
+// ----------------------------------------------------------------------------
+// Round Float bounds outward to single precision, so that the node box always
+// contains the original one.
+static float round_down(Float v) {
+    float f = static_cast<float>(v);
+    return static_cast<Float>(f) > v ? std::nextafter(f, -std::numeric_limits<float>::infinity()) : f;
+}
+
+static float round_up(Float v) {
+    float f = static_cast<float>(v);
+    return static_cast<Float>(f) < v ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+}
+
+static void set_node_bounds(LinearBVHNode& node, const AABB& box) {
+    node.bounds[0] = type3<float>(round_down(box.min().x), round_down(box.min().y), round_down(box.min().z));
+    node.bounds[1] = type3<float>(round_up(box.max().x), round_up(box.max().y), round_up(box.max().z));
+}
+
+// ----------------------------------------------------------------------------
+static void compute_bounds(const std::vector<BVHPrimitiveInfo>& info, int start, int end,
+                           AABB& bounds, AABB& centroid_bounds)
+{
+    auto reduce = [&info](int s, int e, AABB& b, AABB& cb) {
+        b = info[s].bounds;
+        cb = AABB(info[s].centroid, info[s].centroid);
+        for(int i=s+1; i<e; i++) {
+            b = surrounding(b, info[i].bounds);
+            cb = surrounding(cb, info[i].centroid);
+        }
+    };
+
+    int n_chunks = num_chunks(end - start);
+    if(n_chunks == 1) {
+        reduce(start, end, bounds, centroid_bounds);
+        return;
+    }
+
+    std::vector<AABB> chunk_bounds(n_chunks), chunk_centroid_bounds(n_chunks);
+    #pragma omp parallel for
+    for(int c=0; c<n_chunks; c++) {
+        int s, e;
+        chunk_range(start, end, n_chunks, c, s, e);
+        reduce(s, e, chunk_bounds[c], chunk_centroid_bounds[c]);
+    }
+    bounds = chunk_bounds[0];
+    centroid_bounds = chunk_centroid_bounds[0];
+    for(int c=1; c<n_chunks; c++) {
+        bounds = surrounding(bounds, chunk_bounds[c]);
+        centroid_bounds = surrounding(centroid_bounds, chunk_centroid_bounds[c]);
+    }
+}
+
+// ----------------------------------------------------------------------------
+/** Partition [start, end) by `pred`. Large ranges are partitioned in parallel
+ *  with a stable scatter, so the order does not depend on the number of threads. */
+template <typename Predicate>
+static int partition_prims(std::vector<BVHPrimitiveInfo>& info, int start, int end, Predicate pred)
+{
+    int n_chunks = num_chunks(end - start);
+    if(n_chunks == 1) {
+        auto it = std::partition(info.begin() + start, info.begin() + end, pred);
+        return static_cast<int>(it - info.begin());
+    }
+
+    std::vector<int> left_count(n_chunks, 0), right_count(n_chunks, 0);
+    #pragma omp parallel for
+    for(int c=0; c<n_chunks; c++) {
+        int s, e;
+        chunk_range(start, end, n_chunks, c, s, e);
+        for(int i=s; i<e; i++)
+            pred(info[i]) ? left_count[c]++ : right_count[c]++;
+    }
+
+    int n_left = 0;
+    for(int c=0; c<n_chunks; c++) n_left += left_count[c];
+    std::vector<int> left_offset(n_chunks), right_offset(n_chunks);
+    for(int c=0, l=0, r=n_left; c<n_chunks; c++) {
+        left_offset[c] = l;
+        right_offset[c] = r;
+        l += left_count[c];
+        r += right_count[c];
+    }
+
+    std::vector<BVHPrimitiveInfo> tmp(end - start);
+    #pragma omp parallel for
+    for(int c=0; c<n_chunks; c++) {
+        int s, e;
+        chunk_range(start, end, n_chunks, c, s, e);
+        int l = left_offset[c], r = right_offset[c];
+        for(int i=s; i<e; i++)
+            tmp[pred(info[i]) ? l++ : r++] = info[i];
+    }
+    std::copy(tmp.begin(), tmp.end(), info.begin() + start);
+    return start + n_left;
+}
+
+// ----------------------------------------------------------------------------
+static bool centroid_less(const BVHPrimitiveInfo& p0, const BVHPrimitiveInfo& p1, int axis) {
+    return p0.centroid[axis] < p1.centroid[axis];
+}
+
+/** Sweep SAH over sorted centroids in each axis.
+ *  Primitives in [start, end) are left sorted along the returned axis. */
+static int sah_split(std::vector<BVHPrimitiveInfo>& info, int start, int end, const AABB& bounds,
+                     const BVHBuildParams& params, int& axis, Float& cost)
+{
+    int n_prims = end - start;
+    std::vector<Float> left_area(n_prims);
+    Float best_cost = infinity;
+    int best_axis = axis, best_split = start + n_prims / 2;
+
+    for(int a=0; a<3; a++) {
+        std::sort(info.begin() + start, info.begin() + end,
+            [a](const BVHPrimitiveInfo& p0, const BVHPrimitiveInfo& p1) { return centroid_less(p0, p1, a); });
+
+        // left_area[i] : surface area of primitives in [start, start+i)
+        AABB box = info[start].bounds;
+        for(int i=1; i<n_prims; i++) {
+            left_area[i] = box.surface_area();
+            box = surrounding(box, info[start+i].bounds);
+        }
+        box = info[end-1].bounds;
+        for(int i=n_prims-1; i>0; i--) {
+            Float cost = left_area[i] * i + box.surface_area() * (n_prims - i);
+            if(cost < best_cost) {
+                best_cost = cost;
+                best_axis = a;
+                best_split = start + i;
+            }
+            box = surrounding(box, info[start+i-1].bounds);
+        }
+    }
+
+    axis = best_axis;
+    if(best_axis != 2) {
+        std::sort(info.begin() + start, info.begin() + end,
+            [best_axis](const BVHPrimitiveInfo& p0, const BVHPrimitiveInfo& p1) { return centroid_less(p0, p1, best_axis); });
+    }
+    cost = params.traversal_cost + params.intersect_cost * best_cost / bounds.surface_area();
+    return best_split;
+}
+
+// ----------------------------------------------------------------------------
+struct BVHBin {
+    int count = 0;
+    AABB bounds;
+};
+
+static constexpr int max_bins = 64;
+
+/** Bin primitives in [s, e) into `bins[axis * max_bins + b]` for every axis. */
+static void fill_bins(const std::vector<BVHPrimitiveInfo>& info, int s, int e,
+                      const vec3& cmin, const vec3& scale, int n_bins, BVHBin* bins)
+{
+    for(int i=s; i<e; i++) {
+        for(int a=0; a<3; a++) {
+            int b = std::min(n_bins - 1, static_cast<int>((info[i].centroid[a] - cmin[a]) * scale[a]));
+            BVHBin& bin = bins[a * max_bins + b];
+            bin.bounds = bin.count == 0 ? info[i].bounds : surrounding(bin.bounds, info[i].bounds);
+            bin.count++;
+        }
+    }
+}
+
+/** Binned SAH : primitives are binned by centroid into `n_bins` buckets
+ *  on each axis and only the bucket boundaries are evaluated as candidates.
+ *  Primitives in [start, end) are partitioned along the returned axis. */
+static int binned_sah_split(std::vector<BVHPrimitiveInfo>& info, int start, int end,
+                            const AABB& bounds, const AABB& centroid_bounds,
+                            const BVHBuildParams& params, int& axis, Float& cost)
+{
+    const int n_bins = std::max(2, std::min(params.n_bins, max_bins));
+    const vec3 cmin = centroid_bounds.min();
+    const vec3 extent = centroid_bounds.max() - centroid_bounds.min();
+    vec3 scale;
+    for(int a=0; a<3; a++)
+        scale[a] = extent[a] > 0 ? n_bins / extent[a] : 0;
+
+    BVHBin bins[3 * max_bins];
+    int n_chunks = num_chunks(end - start);
+    if(n_chunks == 1) {
+        fill_bins(info, start, end, cmin, scale, n_bins, bins);
+    } else {
+        std::vector<BVHBin> chunk_bins(n_chunks * 3 * max_bins);
+        #pragma omp parallel for
+        for(int c=0; c<n_chunks; c++) {
+            int s, e;
+            chunk_range(start, end, n_chunks, c, s, e);
+            fill_bins(info, s, e, cmin, scale, n_bins, &chunk_bins[c * 3 * max_bins]);
+        }
+        for(int c=0; c<n_chunks; c++) {
+            for(int b=0; b<3*max_bins; b++) {
+                const BVHBin& cb = chunk_bins[c * 3 * max_bins + b];
+                if(cb.count == 0) continue;
+                bins[b].bounds = bins[b].count == 0 ? cb.bounds : surrounding(bins[b].bounds, cb.bounds);
+                bins[b].count += cb.count;
+            }
+        }
+    }
+
+    Float best_cost = infinity;
+    int best_axis = -1, best_bin = 0;
+
+    for(int a=0; a<3; a++) {
+        if(extent[a] <= 0) continue;
+        const BVHBin* axis_bins = &bins[a * max_bins];
+
+        // right_area[b], right_count[b] : bins in [b+1, n_bins)
+        Float right_area[max_bins];
+        int right_count[max_bins];
+        AABB box;
+        int count = 0;
+        for(int b=n_bins-1; b>0; b--) {
+            if(axis_bins[b].count > 0) {
+                box = count == 0 ? axis_bins[b].bounds : surrounding(box, axis_bins[b].bounds);
+                count += axis_bins[b].count;
+            }
+            right_area[b-1] = count > 0 ? box.surface_area() : 0;
+            right_count[b-1] = count;
+        }
+
+        count = 0;
+        for(int b=0; b<n_bins-1; b++) {
+            if(axis_bins[b].count > 0) {
+                box = count == 0 ? axis_bins[b].bounds : surrounding(box, axis_bins[b].bounds);
+                count += axis_bins[b].count;
+            }
+            if(count == 0 || right_count[b] == 0) continue;
+            Float c = box.surface_area() * count + right_area[b] * right_count[b];
+            if(c < best_cost) {
+                best_cost = c;
+                best_axis = a;
+                best_bin = b;
+            }
+        }
+    }
+
+    if(best_axis < 0) {
+        // All centroids fall into a single bin, so split at the median instead.
+        int mid = start + (end - start) / 2;
+        std::nth_element(info.begin() + start, info.begin() + mid, info.begin() + end,
+            [axis](const BVHPrimitiveInfo& p0, const BVHPrimitiveInfo& p1) { return centroid_less(p0, p1, axis); });
+        cost = infinity;
+        return mid;
+    }
+
+    axis = best_axis;
+    cost = params.traversal_cost + params.intersect_cost * best_cost / bounds.surface_area();
+    const Float axis_min = cmin[best_axis], axis_scale = scale[best_axis];
+    return partition_prims(info, start, end, [=](const BVHPrimitiveInfo& p) {
+        int b = std::min(n_bins - 1, static_cast<int>((p.centroid[best_axis] - axis_min) * axis_scale));
+        return b <= best_bin;
+    });
+}
+
+// ----------------------------------------------------------------------------
+/** Insert two zero bits between each of the lower 10 (or 21) bits. */
+static uint64_t spread_bits_10(uint64_t x) {
+    x &= 0x3ff;
+    x = (x | (x << 16)) & 0x30000ff;
+    x = (x | (x << 8))  & 0x300f00f;
+    x = (x | (x << 4))  & 0x30c30c3;
+    x = (x | (x << 2))  & 0x9249249;
+    return x;
+}
+
+static uint64_t spread_bits_21(uint64_t x) {
+    x &= 0x1fffff;
+    x = (x | (x << 32)) & 0x1f00000000ffffull;
+    x = (x | (x << 16)) & 0x1f0000ff0000ffull;
+    x = (x | (x << 8))  & 0x100f00f00f00f00full;
+    x = (x | (x << 4))  & 0x10c30c30c30c30c3ull;
+    x = (x | (x << 2))  & 0x1249249249249249ull;
+    return x;
+}
+
+/** Morton code of a point normalized to [0, 1]^3. x occupies bits 3k+2, y 3k+1 and z 3k. */
+static uint64_t morton_code(const vec3& p, int n_bits) {
+    if(n_bits == 30) {
+        const Float scale = 1 << 10;
+        auto q = [scale](Float v) { return static_cast<uint64_t>(clamp(v * scale, 0, scale - 1)); };
+        return (spread_bits_10(q(p.x)) << 2) | (spread_bits_10(q(p.y)) << 1) | spread_bits_10(q(p.z));
+    } else {
+        const Float scale = 1 << 21;
+        auto q = [scale](Float v) { return static_cast<uint64_t>(clamp(v * scale, 0, scale - 1)); };
+        return (spread_bits_21(q(p.x)) << 2) | (spread_bits_21(q(p.y)) << 1) | spread_bits_21(q(p.z));
+    }
+}
+
+struct MortonPrimitive {
+    uint64_t code;
+    int index;
+};
+
+/** Stable LSD radix sort with 8-bit digits. Histograms are built per chunk in parallel
+ *  and scattered in chunk order, so the result does not depend on thread count. */
+static void radix_sort(std::vector<MortonPrimitive>& v, int n_bits) {
+    constexpr int bits_per_pass = 8;
+    constexpr int n_buckets = 1 << bits_per_pass;
+    const int n = static_cast<int>(v.size());
+    const int n_chunks = num_chunks(n);
+
+    std::vector<MortonPrimitive> tmp(n);
+    std::vector<int> offsets(n_chunks * n_buckets);
+    for(int shift=0; shift<n_bits; shift+=bits_per_pass) {
+        std::fill(offsets.begin(), offsets.end(), 0);
+        #pragma omp parallel for if(n_chunks > 1)
+        for(int c=0; c<n_chunks; c++) {
+            int s, e;
+            chunk_range(0, n, n_chunks, c, s, e);
+            for(int i=s; i<e; i++)
+                offsets[c * n_buckets + ((v[i].code >> shift) & (n_buckets - 1))]++;
+        }
+
+        // Exclusive prefix sum in (digit, chunk) order
+        int sum = 0;
+        for(int b=0; b<n_buckets; b++) {
+            for(int c=0; c<n_chunks; c++) {
+                int count = offsets[c * n_buckets + b];
+                offsets[c * n_buckets + b] = sum;
+                sum += count;
+            }
+        }
+
+        #pragma omp parallel for if(n_chunks > 1)
+        for(int c=0; c<n_chunks; c++) {
+            int s, e;
+            chunk_range(0, n, n_chunks, c, s, e);
+            for(int i=s; i<e; i++)
+                tmp[offsets[c * n_buckets + ((v[i].code >> shift) & (n_buckets - 1))]++] = v[i];
+        }
+        std::swap(v, tmp);
+    }
+}
+
+/** Split a range of sorted Morton codes where its highest differing bit changes. */
+static int morton_split(const std::vector<uint64_t>& codes, int start, int end, int& axis) {
+    uint64_t diff = codes[start] ^ codes[end-1];
+    if(diff == 0) 
+        return start + (end - start) / 2;
+
+    int bit = 63 - __builtin_clzll(diff);
+    axis = 2 - bit % 3;
+    const uint64_t mask = 1ull << bit;
+    auto it = std::partition_point(codes.begin() + start, codes.begin() + end, 
+        [mask](uint64_t code) { return (code & mask) == 0; });
+    return static_cast<int>(it - codes.begin());
+}
+
+// ----------------------------------------------------------------------------
+/** State shared by every split during one build. */
+struct BVHBuildContext {
+    BVHBuildParams params;
+    // Morton codes aligned with the primitive info array (LBVH and HLBVH only).
+    std::vector<uint64_t> morton_codes;
+};
+
+/** Sort primitive info by the Morton code of centroids and keep the sorted codes. */
+static void sort_by_morton(std::vector<BVHPrimitiveInfo>& info, BVHBuildContext& ctx) {
+    const int n = static_cast<int>(info.size());
+    const int n_bits = ctx.params.morton_bits;
+
+    AABB bounds, centroid_bounds;
+    compute_bounds(info, 0, n, bounds, centroid_bounds);
+    const vec3 cmin = centroid_bounds.min();
+    const vec3 extent = centroid_bounds.max() - centroid_bounds.min();
+
+    std::vector<MortonPrimitive> morton(n);
+    #pragma omp parallel for
+    for(int i=0; i<n; i++) {
+        vec3 p = info[i].centroid - cmin;
+        for(int a=0; a<3; a++) 
+            p[a] = extent[a] > 0 ? p[a] / extent[a] : 0;
+        morton[i] = { morton_code(p, n_bits), i };
+    }
+    radix_sort(morton, n_bits);
+
+    std::vector<BVHPrimitiveInfo> sorted(n);
+    ctx.morton_codes.resize(n);
+    #pragma omp parallel for
+    for(int i=0; i<n; i++) {
+        sorted[i] = info[morton[i].index];
+        ctx.morton_codes[i] = morton[i].code;
+    }
+    info.swap(sorted);
+}
+
+// ----------------------------------------------------------------------------
+/** Choose the split of [start, end) and partition primitives accordingly.
+ *  Returns -1 when the range should become a leaf. */
+static int find_split(std::vector<BVHPrimitiveInfo>& info, int start, int end, int depth,
+                      const AABB& bounds, const AABB& centroid_bounds,
+                      const BVHBuildContext& ctx, int& axis)
+{
+    const BVHBuildParams& params = ctx.params;
+
+    int n_prims = end - start;
+    if(!ctx.morton_codes.empty()) {
+        // Primitives are already sorted by Morton code, so splitting never reorders them
+        // and needs no bounds. The axis is the one of the highest differing code bit.
+        if(n_prims <= params.max_prims_in_node) 
+            return -1;
+        axis = 0;
+        int mid = morton_split(ctx.morton_codes, start, end, axis);
+        return depth < LinearBVH::max_depth / 2 ? mid : start + n_prims / 2;
+    }
+
+    // Split along the axis with the largest extent of centroids.
+    vec3 extent = centroid_bounds.max() - centroid_bounds.min();
+    axis = (extent.x > extent.y && extent.x > extent.z) ? 0
+         : (extent.y > extent.z) ? 1 : 2;
+
+    /** Deep nodes are split at the median so that the depth never exceeds
+     *  the traversal stack even with degenerate SAH partitions. */
+    bool use_sah = params.splitMethod != BVHNode::SplitMethod::MIDDLE
+                && depth < LinearBVH::max_depth / 2 && extent[axis] > 0;
+
+    if(n_prims == 1 || (!use_sah && n_prims <= params.max_prims_in_node))
+        return -1;
+
+    int mid = start + n_prims / 2;
+    if(use_sah) {
+        Float split_cost;
+        if(params.splitMethod == BVHNode::SplitMethod::SAH)
+            mid = sah_split(info, start, end, bounds, params, axis, split_cost);
+        else
+            mid = binned_sah_split(info, start, end, bounds, centroid_bounds, params, axis, split_cost);
+
+        // Terminate when intersecting all primitives is cheaper than any split.
+        if(n_prims <= params.max_prims_in_node && split_cost >= params.intersect_cost * n_prims)
+            return -1;
+    } else {
+        std::nth_element(info.begin() + start, info.begin() + mid, info.begin() + end,
+            [axis](const BVHPrimitiveInfo& p0, const BVHPrimitiveInfo& p1) { return centroid_less(p0, p1, axis); });
+    }
+    return mid;
+}
+
+// ----------------------------------------------------------------------------
+/** Build the subtree over [start, end) in depth-first order into `nodes`.
+ *  Leaves refer to `ordered`, which receives the primitive indices. 
+ *  Morton splits only emit the topology, whose bounds are left to `morton_bounds()`. */
+static int recursive_build(std::vector<BVHPrimitiveInfo>& info, int start, int end, int depth,
+                           const BVHBuildContext& ctx,
+                           std::vector<LinearBVHNode>& nodes, std::vector<size_t>& ordered)
+{
+    int node_index = static_cast<int>(nodes.size());
+    nodes.emplace_back();
+
+    AABB bounds, centroid_bounds;
+    if(ctx.morton_codes.empty()) {
+        compute_bounds(info, start, end, bounds, centroid_bounds);
+        set_node_bounds(nodes[node_index], bounds);
+    }
+
+    int axis;
+    int mid = find_split(info, start, end, depth, bounds, centroid_bounds, ctx, axis);
+    if(mid < 0) {
+        nodes[node_index].primitives_offset = static_cast<int>(ordered.size());
+        nodes[node_index].n_primitives = static_cast<uint16_t>(end - start);
+        for(int i=start; i<end; i++)
+            ordered.emplace_back(info[i].index);
+        return node_index;
+    }
+
+    nodes[node_index].n_primitives = 0;
+    nodes[node_index].axis = static_cast<uint8_t>(axis);
+    recursive_build(info, start, mid, depth+1, ctx, nodes, ordered);
+    int second_child = recursive_build(info, mid, end, depth+1, ctx, nodes, ordered);
+    nodes[node_index].second_child_offset = second_child;
+    return node_index;
+}
+
+/** Bounds of a subtree emitted from Morton codes over `info[start, ...)`, in one pass from the 
+ *  leaves to the root. Nodes are in depth-first order, so children always follow their parent,
+ *  and primitives were never reordered, so each leaf refers to a contiguous range of `info`. */
+static void morton_bounds(const std::vector<BVHPrimitiveInfo>& info, int start, std::vector<LinearBVHNode>& nodes) {
+    for(int i=static_cast<int>(nodes.size())-1; i>=0; i--) {
+        LinearBVHNode& node = nodes[i];
+        if(node.n_primitives > 0) {
+            const int s = start + node.primitives_offset;
+            AABB box = info[s].bounds;
+            for(int j=1; j<node.n_primitives; j++)
+                box = surrounding(box, info[s + j].bounds);
+            set_node_bounds(node, box);
+        } else {
+            // Children are already rounded outward, so their union is exact in single precision.
+            const LinearBVHNode& a = nodes[i + 1];
+            const LinearBVHNode& b = nodes[node.second_child_offset];
+            for(int k=0; k<3; k++) {
+                node.bounds[0][k] = std::min(a.bounds[0][k], b.bounds[0][k]);
+                node.bounds[1][k] = std::max(a.bounds[1][k], b.bounds[1][k]);
+            }
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------
+/** Node above the independently built subtrees. */
+struct BVHTopNode {
+    AABB bounds;
+    int axis = 0;
+    int children[2] = { -1, -1 };
+    int subtree = -1;               // >= 0 when this node is the root of a subtree
+};
+
+struct BVHSubtree {
+    int start, end, depth;
+    std::vector<LinearBVHNode> nodes;
+    std::vector<size_t> ordered;
+};
+
+static int build_top_level(std::vector<BVHPrimitiveInfo>& info, int start, int end, int depth,
+                           int subtree_size, const BVHBuildContext& ctx,
+                           std::vector<BVHTopNode>& top_nodes, std::vector<BVHSubtree>& subtrees)
+{
+    int node_index = static_cast<int>(top_nodes.size());
+    top_nodes.emplace_back();
+
+    int mid = -1, axis = 0;
+    if(end - start > subtree_size) {
+        // Morton splits need no bounds, which are united from the subtrees by `top_bounds()`.
+        AABB bounds, centroid_bounds;
+        if(ctx.morton_codes.empty()) {
+            compute_bounds(info, start, end, bounds, centroid_bounds);
+            top_nodes[node_index].bounds = bounds;
+        }
+        mid = find_split(info, start, end, depth, bounds, centroid_bounds, ctx, axis);
+    }
+
+    if(mid < 0) {
+        top_nodes[node_index].subtree = static_cast<int>(subtrees.size());
+        subtrees.push_back({ start, end, depth, {}, {} });
+        return node_index;
+    }
+
+    top_nodes[node_index].axis = axis;
+    int left = build_top_level(info, start, mid, depth+1, subtree_size, ctx, top_nodes, subtrees);
+    int right = build_top_level(info, mid, end, depth+1, subtree_size, ctx, top_nodes, subtrees);
+    top_nodes[node_index].children[0] = left;
+    top_nodes[node_index].children[1] = right;
+    return node_index;
+}
+
+/** Bounds of top-level nodes united bottom-up from the roots of their built subtrees. */
+static AABB top_bounds(int top_index, std::vector<BVHTopNode>& top_nodes, const std::vector<BVHSubtree>& subtrees) {
+    BVHTopNode& top = top_nodes[top_index];
+    if(top.subtree >= 0) {
+        const auto& b = subtrees[top.subtree].nodes[0].bounds;
+        top.bounds = AABB(vec3(b[0].x, b[0].y, b[0].z), vec3(b[1].x, b[1].y, b[1].z));
+    } else {
+        AABB left = top_bounds(top.children[0], top_nodes, subtrees);
+        top.bounds = surrounding(left, top_bounds(top.children[1], top_nodes, subtrees));
+    }
+    return top.bounds;
+}
+
+/** HLBVH : build the top levels with SAH over treelets, each of which holds
+ *  the primitives sharing the highest Morton code bits. */
+static int build_upper_sah(std::vector<BVHPrimitiveInfo>& treelets, int start, int end, int depth,
+                           const BVHBuildContext& ctx,
+                           std::vector<BVHTopNode>& top_nodes, std::vector<BVHSubtree>& subtrees)
+{
+    int node_index = static_cast<int>(top_nodes.size());
+    top_nodes.emplace_back();
+
+    if(end - start == 1) {
+        BVHSubtree& subtree = subtrees[treelets[start].index];
+        subtree.depth = depth;
+        top_nodes[node_index].subtree = static_cast<int>(treelets[start].index);
+        return node_index;
+    }
+
+    AABB bounds, centroid_bounds;
+    compute_bounds(treelets, start, end, bounds, centroid_bounds);
+    top_nodes[node_index].bounds = bounds;
+
+    int axis;
+    int mid = find_split(treelets, start, end, depth, bounds, centroid_bounds, ctx, axis);
+    top_nodes[node_index].axis = axis;
+    int left = build_upper_sah(treelets, start, mid, depth+1, ctx, top_nodes, subtrees);
+    int right = build_upper_sah(treelets, mid, end, depth+1, ctx, top_nodes, subtrees);
+    top_nodes[node_index].children[0] = left;
+    top_nodes[node_index].children[1] = right;
+    return node_index;
+}
+
+static int flatten(int top_index, const std::vector<BVHTopNode>& top_nodes, const std::vector<BVHSubtree>& subtrees,
+                   std::vector<LinearBVHNode>& nodes, std::vector<size_t>& ordered)
+{
+    const BVHTopNode& top = top_nodes[top_index];
+    int node_index = static_cast<int>(nodes.size());
+
+    if(top.subtree >= 0) {
+        const BVHSubtree& subtree = subtrees[top.subtree];
+        int prim_base = static_cast<int>(ordered.size());
+        for(auto node : subtree.nodes) {
+            if(node.n_primitives > 0) node.primitives_offset += prim_base;
+            else                      node.second_child_offset += node_index;
+            nodes.push_back(node);
+        }
+        ordered.insert(ordered.end(), subtree.ordered.begin(), subtree.ordered.end());
+        return node_index;
+    }
+
+    nodes.emplace_back();
+    set_node_bounds(nodes[node_index], top.bounds);
+    nodes[node_index].n_primitives = 0;
+    nodes[node_index].axis = static_cast<uint8_t>(top.axis);
+    flatten(top.children[0], top_nodes, subtrees, nodes, ordered);
+    int second_child = flatten(top.children[1], top_nodes, subtrees, nodes, ordered);
+    nodes[node_index].second_child_offset = second_child;
+    return node_index;
+}
+
+// ----------------------------------------------------------------------------
+/** SBVH (Stich et al. 2009) : in addition to object splits, a node may be split 
+ *  by a plane, clipping the primitives which straddle it into both children. 
+ *  Spatial splits are only tried where object split children overlap, 
+ *  and the total number of references is bounded by `sbvh_budget`. */
+struct SBVHContext {
+    const std::function<AABB(size_t, const AABB&)>* clip;
+    Float root_area;
+    size_t max_refs;
+    size_t n_refs;
+    int n_spatial_splits = 0;
+};
+
+// Spatial splits are tried only when children of object split overlap more than this (relative to root).
+static constexpr Float sbvh_alpha = 1e-5;
+
+struct SpatialSplit {
+    int axis = -1;
+    Float plane;
+    Float cost = infinity;
+    AABB left, right;
+    int n_left, n_right;
+};
+
+struct SpatialBin {
+    AABB bounds;
+    bool empty = true;
+    int entries = 0;
+    int exits = 0;
+};
+
+static bool is_valid(const AABB& box) {
+    return box.min().x <= box.max().x && box.min().y <= box.max().y && box.min().z <= box.max().z;
+}
+
+/** Clip a reference to the half space below (`below` = true) or above `plane` on `axis`. */
+static AABB clip_reference(const BVHPrimitiveInfo& ref, int axis, Float plane, bool below, const SBVHContext& sctx) {
+    vec3 min = ref.bounds.min(), max = ref.bounds.max();
+    if(below) max[axis] = plane;
+    else      min[axis] = plane;
+    return (*sctx.clip)(ref.index, AABB(min, max));
+}
+
+/** Bin references into slabs of the node bounds on each axis and 
+ *  find the plane with the lowest (unnormalized) SAH cost. */
+static SpatialSplit find_spatial_split(const std::vector<BVHPrimitiveInfo>& refs, const AABB& bounds,
+                                       const BVHBuildParams& params, const SBVHContext& sctx)
+{
+    const int n_bins = std::max(2, std::min(params.n_bins, max_bins));
+    const vec3 bmin = bounds.min();
+    const vec3 extent = bounds.max() - bounds.min();
+    SpatialSplit best;
+
+    for(int a=0; a<3; a++) {
+        if(extent[a] <= 0) continue;
+        const Float width = extent[a] / n_bins;
+        auto bin_of = [&](Float v) { return std::max(0, std::min(n_bins - 1, static_cast<int>((v - bmin[a]) / width))); };
+
+        SpatialBin bins[max_bins];
+        for(const auto& ref : refs) {
+            int first = bin_of(ref.bounds.min()[a]);
+            int last = std::max(first, bin_of(ref.bounds.max()[a]));
+            for(int b=first; b<=last; b++) {
+                AABB box = ref.bounds;
+                if(first != last) {
+                    vec3 min = ref.bounds.min(), max = ref.bounds.max();
+                    if(b > first) min[a] = bmin[a] + width * b;
+                    if(b < last)  max[a] = bmin[a] + width * (b + 1);
+                    box = (*sctx.clip)(ref.index, AABB(min, max));
+                    if(!is_valid(box)) continue;
+                }
+                bins[b].bounds = bins[b].empty ? box : surrounding(bins[b].bounds, box);
+                bins[b].empty = false;
+            }
+            bins[first].entries++;
+            bins[last].exits++;
+        }
+
+        // right_box[b], right_count[b] : bins in [b+1, n_bins)
+        AABB right_box[max_bins];
+        int right_count[max_bins];
+        AABB box;
+        bool empty = true;
+        int count = 0;
+        for(int b=n_bins-1; b>0; b--) {
+            if(!bins[b].empty) {
+                box = empty ? bins[b].bounds : surrounding(box, bins[b].bounds);
+                empty = false;
+            }
+            count += bins[b].exits;
+            right_box[b-1] = box;
+            right_count[b-1] = count;
+        }
+
+        empty = true;
+        count = 0;
+        for(int b=0; b<n_bins-1; b++) {
+            if(!bins[b].empty) {
+                box = empty ? bins[b].bounds : surrounding(box, bins[b].bounds);
+                empty = false;
+            }
+            count += bins[b].entries;
+            if(count == 0 || right_count[b] == 0) continue;
+            Float c = box.surface_area() * count + right_box[b].surface_area() * right_count[b];
+            if(c < best.cost) {
+                best.axis = a;
+                best.plane = bmin[a] + width * (b + 1);
+                best.cost = c;
+                best.left = box;
+                best.right = right_box[b];
+                best.n_left = count;
+                best.n_right = right_count[b];
+            }
+        }
+    }
+    return best;
+}
+
+/** Distribute references by the spatial split. A straddling reference is kept 
+ *  on one side only when that is cheaper than duplicating it (reference unsplitting). */
+static void split_references(const std::vector<BVHPrimitiveInfo>& refs, SpatialSplit split, const SBVHContext& sctx,
+                             std::vector<BVHPrimitiveInfo>& left, std::vector<BVHPrimitiveInfo>& right)
+{
+    const int a = split.axis;
+    for(const auto& ref : refs) {
+        if(ref.bounds.max()[a] <= split.plane) {
+            left.push_back(ref);
+        } else if(ref.bounds.min()[a] >= split.plane) {
+            right.push_back(ref);
+        } else {
+            const Float c_split = split.left.surface_area() * split.n_left + split.right.surface_area() * split.n_right;
+            const Float c_left = surrounding(split.left, ref.bounds).surface_area() * split.n_left 
+                               + split.right.surface_area() * (split.n_right - 1);
+            const Float c_right = split.left.surface_area() * (split.n_left - 1) 
+                                + surrounding(split.right, ref.bounds).surface_area() * split.n_right;
+
+            if(c_left < c_split && c_left <= c_right) {
+                left.push_back(ref);
+                split.left = surrounding(split.left, ref.bounds);
+                split.n_right--;
+            } else if(c_right < c_split) {
+                right.push_back(ref);
+                split.right = surrounding(split.right, ref.bounds);
+                split.n_left--;
+            } else {
+                AABB l = clip_reference(ref, a, split.plane, true, sctx);
+                AABB r = clip_reference(ref, a, split.plane, false, sctx);
+                if(is_valid(l)) left.push_back(BVHPrimitiveInfo(ref.index, l));
+                if(is_valid(r)) right.push_back(BVHPrimitiveInfo(ref.index, r));
+            }
+        }
+    }
+}
+
+static int sbvh_build(std::vector<BVHPrimitiveInfo>& refs, int depth, const BVHBuildContext& ctx, SBVHContext& sctx,
+                      std::vector<LinearBVHNode>& nodes, std::vector<size_t>& ordered)
+{
+    const int n = static_cast<int>(refs.size());
+    int node_index = static_cast<int>(nodes.size());
+    nodes.emplace_back();
+
+    AABB bounds, centroid_bounds;
+    compute_bounds(refs, 0, n, bounds, centroid_bounds);
+    set_node_bounds(nodes[node_index], bounds);
+
+    int axis;
+    int mid = find_split(refs, 0, n, depth, bounds, centroid_bounds, ctx, axis);
+    if(mid < 0) {
+        nodes[node_index].primitives_offset = static_cast<int>(ordered.size());
+        nodes[node_index].n_primitives = static_cast<uint16_t>(n);
+        for(const auto& ref : refs)
+            ordered.emplace_back(ref.index);
+        return node_index;
+    }
+
+    std::vector<BVHPrimitiveInfo> left, right;
+    if(depth < LinearBVH::max_depth / 2 && sctx.n_refs < sctx.max_refs) {
+        AABB left_bounds, right_bounds, cb;
+        compute_bounds(refs, 0, mid, left_bounds, cb);
+        compute_bounds(refs, mid, n, right_bounds, cb);
+        AABB overlap = intersection(left_bounds, right_bounds);
+
+        if(is_valid(overlap) && overlap.surface_area() > sbvh_alpha * sctx.root_area) {
+            Float object_cost = left_bounds.surface_area() * mid + right_bounds.surface_area() * (n - mid);
+            SpatialSplit split = find_spatial_split(refs, bounds, ctx.params, sctx);
+            size_t n_duplicates = split.axis < 0 ? 0 : split.n_left + split.n_right - n;
+            if(split.cost < object_cost && sctx.n_refs + n_duplicates <= sctx.max_refs) {
+                split_references(refs, split, sctx, left, right);
+                if(left.empty() || right.empty()) {
+                    // Clipping left one side empty, keep the object split.
+                    left.clear();
+                    right.clear();
+                } else {
+                    axis = split.axis;
+                    sctx.n_refs += left.size() + right.size() - n;
+                    sctx.n_spatial_splits++;
+                }
+            }
+        }
+    }
+    if(left.empty()) {
+        left.assign(refs.begin(), refs.begin() + mid);
+        right.assign(refs.begin() + mid, refs.end());
+    }
+    // Release references of this node before descending.
+    std::vector<BVHPrimitiveInfo>().swap(refs);
+
+    nodes[node_index].n_primitives = 0;
+    nodes[node_index].axis = static_cast<uint8_t>(axis);
+    sbvh_build(left, depth+1, ctx, sctx, nodes, ordered);
+    int second_child = sbvh_build(right, depth+1, ctx, sctx, nodes, ordered);
+    nodes[node_index].second_child_offset = second_child;
+    return node_index;
+}
+
+// ----------------------------------------------------------------------------
+static BVHBuildParams clamp_params(BVHBuildParams params) {
+    params.max_prims_in_node = std::max(1, std::min(params.max_prims_in_node, 255));
+    params.morton_bits = params.morton_bits == 63 ? 63 : 30;
+    return params;
+}
+
+LinearBVH::LinearBVH(const std::vector<std::shared_ptr<Primitive>>& p, const BVHBuildParams& params)
+: params(clamp_params(params))
+{
+    if(p.empty()) return;
+
+    build(p);
+    finish_build();
+}
+
+LinearBVH::LinearBVH(const MeshPrimitive& mesh, const BVHBuildParams& params)
+: params(clamp_params(params)), mesh(&mesh)
+{
+    if(mesh.num_triangles() == 0) return;
+
+    build_mesh();
+    finish_build();
+}
+
+void LinearBVH::finish_build()
+{
+    if(params.optimize_passes > 0)
+        optimize(params.optimize_passes);
+    else
+        build_triangle_blocks();
+    build_motion_bounds();
+    built_sah_cost = sah_cost();
+}
+
+void LinearBVH::build(const std::vector<std::shared_ptr<Primitive>>& p)
+{
+    std::vector<AABB> bounds(p.size());
+    #pragma omp parallel for
+    for(int i=0; i<static_cast<int>(p.size()); i++)
+        bounds[i] = p[i]->bounding();
+
+    std::vector<size_t> ordered = build_nodes(bounds, [&p](size_t i, const AABB& box) { 
+        return p[i]->clipped_bounding(box); 
+    });
+    primitives.resize(ordered.size());
+    #pragma omp parallel for
+    for(int i=0; i<static_cast<int>(ordered.size()); i++)
+        primitives[i] = p[ordered[i]];
+}
+
+void LinearBVH::build_mesh()
+{
+    std::vector<AABB> bounds(mesh->num_triangles());
+    #pragma omp parallel for
+    for(int i=0; i<static_cast<int>(bounds.size()); i++)
+        bounds[i] = mesh->triangle_bounds(i);
+
+    std::vector<size_t> ordered = build_nodes(bounds, [this](size_t i, const AABB& box) { 
+        return mesh->clipped_triangle_bounds(static_cast<int>(i), box); 
+    });
+    mesh_faces.assign(ordered.begin(), ordered.end());
+}
+
+std::vector<size_t> LinearBVH::build_nodes(const std::vector<AABB>& prim_bounds, const ClipFunction& clip)
+{
+    using clock = std::chrono::steady_clock;
+    auto seconds = [](clock::time_point t0, clock::time_point t1) {
+        return std::chrono::duration<double>(t1 - t0).count();
+    };
+    const int n_prims = static_cast<int>(prim_bounds.size());
+
+    // 1. Compute centroids once.
+    auto t0 = clock::now();
+    std::vector<BVHPrimitiveInfo> info(n_prims);
+    #pragma omp parallel for
+    for(int i=0; i<n_prims; i++)
+        info[i] = BVHPrimitiveInfo(i, prim_bounds[i]);
+
+    BVHBuildContext ctx;
+    ctx.params = this->params;
+    const bool is_hlbvh = this->params.splitMethod == BVHNode::SplitMethod::HLBVH;
+    if(is_hlbvh || this->params.splitMethod == BVHNode::SplitMethod::LBVH)
+        sort_by_morton(info, ctx);
+
+    std::vector<size_t> ordered;
+    if(this->params.splitMethod == BVHNode::SplitMethod::SBVH) {
+        // SBVH duplicates references, so it is built serially into one array instead of phases 2-4.
+        SBVHContext sctx;
+        sctx.clip = &clip;
+        sctx.n_refs = info.size();
+        sctx.max_refs = info.size() + static_cast<size_t>(std::max<Float>(0, this->params.sbvh_budget) * info.size());
+        AABB bounds, centroid_bounds;
+        compute_bounds(info, 0, n_prims, bounds, centroid_bounds);
+        sctx.root_area = bounds.surface_area();
+        ordered.reserve(sctx.max_refs);
+        sbvh_build(info, 0, ctx, sctx, nodes, ordered);
+        auto t2 = clock::now();
+
+        size_t n_duplicates = ordered.size() - prim_bounds.size();
+        const size_t ref_bytes = mesh ? sizeof(int) : sizeof(std::shared_ptr<Primitive>);
+        Message("SBVH build: ", seconds(t0, t2), "s, spatial splits: ", sctx.n_spatial_splits,
+                ", references: ", ordered.size(), " (+", n_duplicates, ", ", 100.0 * n_duplicates / prim_bounds.size(), "%)",
+                ", memory: ", (nodes.size() * sizeof(LinearBVHNode) + ordered.size() * ref_bytes) / 1024, 
+                " KB (duplicates: ", n_duplicates * ref_bytes / 1024, " KB)");
+        return ordered;
+    }
+
+    // 2. Split the top levels until partitions are small enough to be built independently.
+    auto t1 = clock::now();
+    std::vector<BVHTopNode> top_nodes;
+    std::vector<BVHSubtree> subtrees;
+    if(is_hlbvh) {
+        // Treelets are runs of primitives sharing the highest 12 bits of their Morton codes.
+        const int shift = ctx.params.morton_bits - 12;
+        const auto& codes = ctx.morton_codes;
+        for(int s=0, e; s<n_prims; s=e) {
+            for(e=s+1; e<n_prims && (codes[e] >> shift) == (codes[s] >> shift); e++) {}
+            subtrees.push_back({ s, e, 0, {}, {} });
+        }
+
+        std::vector<BVHPrimitiveInfo> treelets(subtrees.size());
+        #pragma omp parallel for
+        for(int i=0; i<static_cast<int>(subtrees.size()); i++) {
+            AABB bounds, centroid_bounds;
+            compute_bounds(info, subtrees[i].start, subtrees[i].end, bounds, centroid_bounds);
+            treelets[i] = BVHPrimitiveInfo(i, bounds);
+        }
+
+        BVHBuildContext upper;
+        upper.params = ctx.params;
+        upper.params.splitMethod = BVHNode::SplitMethod::BINNED_SAH;
+        upper.params.max_prims_in_node = 1;
+        build_upper_sah(treelets, 0, static_cast<int>(treelets.size()), 0, upper, top_nodes, subtrees);
+    } else {
+        const int subtree_size = std::max(n_prims / 128, 4096);
+        build_top_level(info, 0, n_prims, 0, subtree_size, ctx, top_nodes, subtrees);
+    }
+
+    // 3. Build subtrees in parallel, largest first.
+    auto t2 = clock::now();
+    std::vector<int> order(subtrees.size());
+    for(size_t i=0; i<order.size(); i++) order[i] = static_cast<int>(i);
+    std::stable_sort(order.begin(), order.end(), [&subtrees](int a, int b) {
+        return subtrees[a].end - subtrees[a].start > subtrees[b].end - subtrees[b].start;
+    });
+    #pragma omp parallel for schedule(dynamic, 1)
+    for(int i=0; i<static_cast<int>(order.size()); i++) {
+        BVHSubtree& subtree = subtrees[order[i]];
+        subtree.nodes.reserve(2 * (subtree.end - subtree.start));
+        recursive_build(info, subtree.start, subtree.end, subtree.depth, ctx, subtree.nodes, subtree.ordered);
+        if(!ctx.morton_codes.empty())
+            morton_bounds(info, subtree.start, subtree.nodes);
+    }
+    // HLBVH has built its top levels from treelet bounds already.
+    if(!ctx.morton_codes.empty() && !is_hlbvh)
+        top_bounds(0, top_nodes, subtrees);
+
+    // 4. Flatten top-level nodes and subtrees into depth-first order.
+    auto t3 = clock::now();
+    ordered.reserve(n_prims);
+    nodes.reserve(top_nodes.size() + [&subtrees]() {
+        size_t n = 0;
+        for(const auto& subtree : subtrees) n += subtree.nodes.size();
+        return n;
+    }());
+    flatten(0, top_nodes, subtrees, nodes, ordered);
+    auto t4 = clock::now();
+
+    Message("BVH build phases [primitive info", ctx.morton_codes.empty() ? "" : " + morton sort", ": ", 
+            seconds(t0, t1), "s, top-level: ", seconds(t1, t2),
+            "s, subtrees (", subtrees.size(), "): ", seconds(t2, t3), "s, flatten: ", seconds(t3, t4), "s]");
+    return ordered;
+}
+
+// ----------------------------------------------------------------------------
+/** Pointer-free binary tree used while restructuring treelets. 
+ *  Node indices are stable, so treelets are rewired in place. */
+struct OptNode {
+    AABB bounds;
+    int children[2] = { -1, -1 };   // -1 : leaf
+    int primitives_offset = 0;
+    int n_primitives = 0;
+    int size = 0;                   // Number of primitives below this node
+    int height = 0;                 // 0 : leaf
+    Float cost = 0;                 // Area-weighted SAH cost of the subtree
+};
+
+struct TreeletOptimizer {
+    std::vector<OptNode> nodes;
+    Float traversal_cost, intersect_cost;
+
+    static constexpr int max_leaves = 7;
+
+    bool is_leaf(int i) const { return nodes[i].children[0] < 0; }
+
+    /** Reform the treelet rooted at `root` when a cheaper topology exists. 
+     *  `depth` is the depth of `root`, so the restructured subtree never exceeds the traversal stack. */
+    void restructure(int root, int depth) {
+        if(is_leaf(root)) return;
+
+        // Subtrees below may have been restructured, so refresh the cost first.
+        OptNode& r = nodes[root];
+        r.cost = traversal_cost * r.bounds.surface_area() + nodes[r.children[0]].cost + nodes[r.children[1]].cost;
+        r.height = 1 + std::max(nodes[r.children[0]].height, nodes[r.children[1]].height);
+
+        // Grow the treelet by opening the treelet leaf with the largest surface area.
+        int leaves[max_leaves], internals[max_leaves - 1];
+        int n_leaves = 2, n_internals = 1;
+        leaves[0] = nodes[root].children[0];
+        leaves[1] = nodes[root].children[1];
+        internals[0] = root;
+        while(n_leaves < max_leaves) {
+            int best = -1;
+            Float best_area = -1;
+            for(int i=0; i<n_leaves; i++) {
+                if(!is_leaf(leaves[i]) && nodes[leaves[i]].bounds.surface_area() > best_area) {
+                    best = i;
+                    best_area = nodes[leaves[i]].bounds.surface_area();
+                }
+            }
+            if(best < 0) break;
+
+            int opened = leaves[best];
+            internals[n_internals++] = opened;
+            leaves[best] = nodes[opened].children[0];
+            leaves[n_leaves++] = nodes[opened].children[1];
+        }
+        if(n_leaves < 3) return;
+
+        // Optimal cost of every subset of treelet leaves. Subsets of `s` are numerically 
+        // smaller than `s`, so iterating in increasing order visits them first.
+        const int n_subsets = 1 << n_leaves;
+        AABB area_box[1 << max_leaves];
+        Float area[1 << max_leaves], opt_cost[1 << max_leaves];
+        int partition[1 << max_leaves], height[1 << max_leaves];
+        for(int s=1; s<n_subsets; s++) {
+            int low = __builtin_ctz(s);
+            if((s & (s - 1)) == 0) {
+                area_box[s] = nodes[leaves[low]].bounds;
+                area[s] = area_box[s].surface_area();
+                opt_cost[s] = nodes[leaves[low]].cost;
+                height[s] = nodes[leaves[low]].height;
+                continue;
+            }
+            area_box[s] = surrounding(area_box[s & (s - 1)], area_box[1 << low]);
+            area[s] = area_box[s].surface_area();
+
+            // Only partitions which keep the lowest leaf on the left are enumerated.
+            Float best = infinity;
+            int best_p = 0;
+            for(int p=(s - 1) & s; p>0; p=(p - 1) & s) {
+                if(!(p & (1 << low))) continue;
+                Float c = opt_cost[p] + opt_cost[s ^ p];
+                if(c < best) {
+                    best = c;
+                    best_p = p;
+                }
+            }
+            opt_cost[s] = traversal_cost * area[s] + best;
+            partition[s] = best_p;
+            height[s] = 1 + std::max(height[best_p], height[s ^ best_p]);
+        }
+
+        const int full = n_subsets - 1;
+        if(opt_cost[full] >= nodes[root].cost * (1 - 1e-6) || depth + height[full] >= LinearBVH::max_depth)
+            return;
+
+        // Rewire internal nodes of the treelet, with `root` staying at the top.
+        int next_internal = 0;
+        std::function<int(int)> rebuild = [&](int s) -> int {
+            if((s & (s - 1)) == 0) 
+                return leaves[__builtin_ctz(s)];
+            int index = internals[next_internal++];
+            OptNode& node = nodes[index];
+            node.children[0] = rebuild(partition[s]);
+            node.children[1] = rebuild(s ^ partition[s]);
+            node.bounds = area_box[s];
+            node.cost = opt_cost[s];
+            node.height = height[s];
+            node.size = nodes[node.children[0]].size + nodes[node.children[1]].size;
+            return index;
+        };
+        rebuild(full);
+    }
+
+    /** Post-order pass, so that treelets below are optimized before their ancestors. */
+    void optimize_subtree(int index, int depth) {
+        if(is_leaf(index)) return;
+        optimize_subtree(nodes[index].children[0], depth + 1);
+        optimize_subtree(nodes[index].children[1], depth + 1);
+        restructure(index, depth);
+    }
+};
+
+static int flatten_optimized(const TreeletOptimizer& opt, int index, std::vector<LinearBVHNode>& nodes) {
+    const OptNode& node = opt.nodes[index];
+    int node_index = static_cast<int>(nodes.size());
+    nodes.emplace_back();
+    set_node_bounds(nodes[node_index], node.bounds);
+
+    if(opt.is_leaf(index)) {
+        nodes[node_index].primitives_offset = node.primitives_offset;
+        nodes[node_index].n_primitives = static_cast<uint16_t>(node.n_primitives);
+        return node_index;
+    }
+
+    // Split axis is where the centroids of children are farthest apart.
+    vec3 d = opt.nodes[node.children[1]].bounds.centroid() - opt.nodes[node.children[0]].bounds.centroid();
+    for(int a=0; a<3; a++) d[a] = std::abs(d[a]);
+    nodes[node_index].axis = static_cast<uint8_t>((d.x > d.y && d.x > d.z) ? 0 : (d.y > d.z) ? 1 : 2);
+    nodes[node_index].n_primitives = 0;
+    flatten_optimized(opt, node.children[0], nodes);
+    int second_child = flatten_optimized(opt, node.children[1], nodes);
+    nodes[node_index].second_child_offset = second_child;
+    return node_index;
+}
+
+void LinearBVH::optimize(int n_passes) {
+    if(nodes.size() < 3) return;
+
+    auto start = std::chrono::steady_clock::now();
+    const Float cost_before = sah_cost();
+
+    TreeletOptimizer opt;
+    opt.traversal_cost = params.traversal_cost;
+    opt.intersect_cost = params.intersect_cost;
+    opt.nodes.resize(nodes.size());
+    // Children follow parents in depth-first order, so a reverse sweep sees children first.
+    for(int i=static_cast<int>(nodes.size())-1; i>=0; i--) {
+        const LinearBVHNode& src = nodes[i];
+        OptNode& node = opt.nodes[i];
+        node.bounds = AABB(vec3(src.bounds[0].x, src.bounds[0].y, src.bounds[0].z), 
+                           vec3(src.bounds[1].x, src.bounds[1].y, src.bounds[1].z));
+        Float area = node.bounds.surface_area();
+        if(src.n_primitives > 0) {
+            node.primitives_offset = src.primitives_offset;
+            node.n_primitives = src.n_primitives;
+            node.size = src.n_primitives;
+            node.cost = params.intersect_cost * src.n_primitives * area;
+        } else {
+            const OptNode& c0 = opt.nodes[i + 1];
+            const OptNode& c1 = opt.nodes[src.second_child_offset];
+            node.children[0] = i + 1;
+            node.children[1] = src.second_child_offset;
+            node.size = c0.size + c1.size;
+            node.height = 1 + std::max(c0.height, c1.height);
+            node.cost = params.traversal_cost * area + c0.cost + c1.cost;
+        }
+    }
+
+    const int subtree_size = std::max(static_cast<int>(num_references()) / 128, 4096);
+    for(int pass=0; pass<n_passes; pass++) {
+        // Subtrees below `subtree_size` are independent and optimized in parallel,
+        // the nodes above them are optimized afterwards in post-order.
+        std::vector<std::pair<int, int>> subtrees, top;
+        std::function<void(int, int)> collect = [&](int index, int depth) {
+            if(opt.is_leaf(index) || opt.nodes[index].size <= subtree_size) {
+                subtrees.emplace_back(index, depth);
+                return;
+            }
+            collect(opt.nodes[index].children[0], depth + 1);
+            collect(opt.nodes[index].children[1], depth + 1);
+            top.emplace_back(index, depth);
+        };
+        collect(0, 0);
+
+        #pragma omp parallel for schedule(dynamic, 1)
+        for(int i=0; i<static_cast<int>(subtrees.size()); i++)
+            opt.optimize_subtree(subtrees[i].first, subtrees[i].second);
+        for(const auto& node : top)
+            opt.restructure(node.first, node.second);
+    }
+
+    nodes.clear();
+    flatten_optimized(opt, 0, nodes);
+    build_triangle_blocks();
+    build_motion_bounds();
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    Message("BVH treelet optimization (", n_passes, " passes): ", elapsed.count(), "s, SAH cost: ", 
+            cost_before, " -> ", sah_cost());
+}
+
+// ----------------------------------------------------------------------------
+/** Nodes are in depth-first order, so the subtree of node `i` is the range [i, subtree_end(i)) 
+ *  and children are always refitted before their parent by a reverse sweep. 
+ *  Large subtrees are refitted in parallel, then the nodes above them serially. */
+Float LinearBVH::refit()
+{
+    if(nodes.empty())
+        return 0;
+
+    auto refit_node = [this](int index) {
+        LinearBVHNode& node = nodes[index];
+        if(node.n_primitives > 0) {
+            auto bounds = [this](int i) {
+                return mesh ? mesh->triangle_bounds(mesh_faces[i]) : primitives[i]->bounding();
+            };
+            AABB box = bounds(node.primitives_offset);
+            for(int i=1; i<node.n_primitives; i++)
+                box = surrounding(box, bounds(node.primitives_offset + i));
+            set_node_bounds(node, box);
+        } else {
+            const LinearBVHNode& c0 = nodes[index + 1];
+            const LinearBVHNode& c1 = nodes[node.second_child_offset];
+            for(int a=0; a<3; a++) {
+                node.bounds[0][a] = std::min(c0.bounds[0][a], c1.bounds[0][a]);
+                node.bounds[1][a] = std::max(c0.bounds[1][a], c1.bounds[1][a]);
+            }
+        }
+    };
+    std::function<int(int)> subtree_end = [&](int index) {
+        return nodes[index].n_primitives > 0 ? index + 1 : subtree_end(nodes[index].second_child_offset);
+    };
+
+    const int subtree_size = std::max(static_cast<int>(nodes.size()) / 128, 4096);
+    std::vector<std::pair<int, int>> subtrees;
+    std::vector<int> top;
+    std::function<void(int)> collect = [&](int index) {
+        int end = subtree_end(index);
+        if(end - index <= subtree_size) {
+            subtrees.emplace_back(index, end);
+            return;
+        }
+        top.push_back(index);
+        collect(index + 1);
+        collect(nodes[index].second_child_offset);
+    };
+    collect(0);
+
+    #pragma omp parallel for schedule(dynamic, 1)
+    for(int i=0; i<static_cast<int>(subtrees.size()); i++) {
+        for(int index=subtrees[i].second-1; index>=subtrees[i].first; index--)
+            refit_node(index);
+    }
+    for(int i=static_cast<int>(top.size())-1; i>=0; i--)
+        refit_node(top[i]);
+
+    // Triangles of leaf blocks are stored in world space, so they follow the new transforms.
+    build_triangle_blocks();
+    build_motion_bounds();
+    return sah_cost();
+}
+
+bool LinearBVH::update()
+{
+    if(num_references() == 0)
+        return false;
+
+    Float cost = refit();
+    if(cost <= built_sah_cost * params.rebuild_ratio) {
+        Message("BVH refit: SAH cost ", built_sah_cost, " -> ", cost);
+        return false;
+    }
+
+    Message("BVH rebuild: SAH cost ", cost, " exceeds ", params.rebuild_ratio, " x ", built_sah_cost);
+    nodes.clear();
+    if(mesh) {
+        build_mesh();
+    } else {
+        // References duplicated by spatial splits are merged before building again.
+        std::vector<std::shared_ptr<Primitive>> p = primitives;
+        if(params.splitMethod == BVHNode::SplitMethod::SBVH) {
+            std::sort(p.begin(), p.end());
+            p.erase(std::unique(p.begin(), p.end()), p.end());
+        }
+        build(p);
+    }
+    finish_build();
+    return true;
+}
+
+// ----------------------------------------------------------------------------
+void LinearBVH::build_triangle_blocks()
+{
+    auto as_triangle = [](const std::shared_ptr<Primitive>& p) -> const Triangle* {
+        if(p->type() != PrimitiveType::ShapePrimitive) return nullptr;
+        // Moving triangles are left to ShapePrimitive, which offsets rays by time.
+        const auto& shape_prim = static_cast<const ShapePrimitive&>(*p);
+        if(shape_prim.isMoving()) return nullptr;
+        return dynamic_cast<const Triangle*>(shape_prim.getShape().get());
+    };
+
+    blocks.clear();
+    leaf_blocks.assign(nodes.size(), -1);
+    for(size_t i=0; i<nodes.size(); i++) {
+        const LinearBVHNode& node = nodes[i];
+        if(node.n_primitives == 0) continue;
+        // Leaves of a mesh BVH are always triangles.
+        bool all_triangles = true;
+        for(int j=0; j<node.n_primitives && all_triangles && !mesh; j++)
+            all_triangles = as_triangle(primitives[node.primitives_offset + j]) != nullptr;
+        if(!all_triangles) continue;
+
+        leaf_blocks[i] = static_cast<int>(blocks.size());
+        blocks.resize(blocks.size() + (node.n_primitives + TriangleBlock::width - 1) / TriangleBlock::width);
+    }
+
+    #pragma omp parallel for schedule(dynamic, 1024)
+    for(int i=0; i<static_cast<int>(nodes.size()); i++) {
+        if(leaf_blocks[i] < 0) continue;
+        const LinearBVHNode& node = nodes[i];
+        for(int j=0; j<(node.n_primitives + TriangleBlock::width - 1) / TriangleBlock::width * TriangleBlock::width; j++) {
+            TriangleBlock& block = blocks[leaf_blocks[i] + j / TriangleBlock::width];
+            const int lane = j % TriangleBlock::width;
+            if(j >= node.n_primitives) {
+                for(int a=0; a<3; a++)
+                    block.p0[a][lane] = block.e1[a][lane] = block.e2[a][lane] = 0;
+                block.prim[lane] = -1;
+                continue;
+            }
+
+            const int index = node.primitives_offset + j;
+            vec3 v[3];
+            if(mesh) {
+                block.prim[lane] = mesh_faces[index];
+                mesh->world_vertices(mesh_faces[index], v);
+            } else {
+                block.prim[lane] = index;
+                const auto& shape_prim = static_cast<const ShapePrimitive&>(*primitives[index]);
+                const mat4 to_world = shape_prim.getTransform()->getMatrix();
+                std::vector<vec3> local = as_triangle(primitives[index])->get_vertices();
+                for(int k=0; k<3; k++) 
+                    v[k] = mat4::point_mul(to_world, local[k]);
+            }
+            for(int a=0; a<3; a++) {
+                block.p0[a][lane] = static_cast<float>(v[0][a]);
+                block.e1[a][lane] = static_cast<float>(v[1][a] - v[0][a]);
+                block.e2[a][lane] = static_cast<float>(v[2][a] - v[0][a]);
+            }
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------
+void LinearBVH::build_motion_bounds()
+{
+    motion_bounds.clear();
+    bool any_moving = false;
+    AABB b0, b1;
+    for(const auto& p : primitives) {
+        if(p->motion_bounding(b0, b1)) {
+            any_moving = true;
+            break;
+        }
+    }
+    if(!any_moving)
+        return;
+
+    // Children follow their parent in depth-first order, so a reverse sweep is bottom-up.
+    motion_bounds.resize(nodes.size());
+    for(int i=static_cast<int>(nodes.size())-1; i>=0; i--) {
+        const LinearBVHNode& node = nodes[i];
+        MotionBounds& mb = motion_bounds[i];
+        if(node.n_primitives > 0) {
+            AABB box[2];
+            for(int j=0; j<node.n_primitives; j++) {
+                const auto& p = primitives[node.primitives_offset + j];
+                if(!p->motion_bounding(b0, b1))
+                    b0 = b1 = p->bounding();
+                box[0] = j == 0 ? b0 : surrounding(box[0], b0);
+                box[1] = j == 0 ? b1 : surrounding(box[1], b1);
+            }
+            for(int t=0; t<2; t++) {
+                LinearBVHNode rounded;
+                set_node_bounds(rounded, box[t]);
+                mb.bounds[t][0] = rounded.bounds[0];
+                mb.bounds[t][1] = rounded.bounds[1];
+            }
+        } else {
+            const MotionBounds& c0 = motion_bounds[i + 1];
+            const MotionBounds& c1 = motion_bounds[node.second_child_offset];
+            for(int t=0; t<2; t++) {
+                for(int a=0; a<3; a++) {
+                    mb.bounds[t][0][a] = std::min(c0.bounds[t][0][a], c1.bounds[t][0][a]);
+                    mb.bounds[t][1][a] = std::max(c0.bounds[t][1][a], c1.bounds[t][1][a]);
+                }
+            }
+        }
+    }
+}
+
+}
@@ -0,0 +1,80 @@
+#include "envmap.h"
+#include "color.h"
+#include "util.h"
+#include "../ext/stb/stb_image.h"
+
+namespace mypt {
+
+// ----------------------------------------------------------------------------
+ImageEnvmap::ImageEnvmap(const std::string& filename, Float intensity, Float rotation)
+: intensity(intensity), rotation(degrees_to_radians(rotation)) {
+    int n_channels;
+    // LDR images are also converted to linear radiance by stb.
+    float* data = stbi_loadf(filename.c_str(), &width, &height, &n_channels, 3);
+    Assert(data, "Environment map '"+filename+"' can't be loaded! Please check file path or format!\n");
+    pixels.resize(static_cast<size_t>(width) * height);
+    for(size_t i=0; i<pixels.size(); i++)
+        pixels[i] = float3(std::max(data[3*i], 0.f), std::max(data[3*i+1], 0.f), std::max(data[3*i+2], 0.f));
+    stbi_image_free(data);
+
+    std::vector<Float> weights(pixels.size());
+    Float sum = 0;
+    for(int y=0; y<height; y++) {
+        const Float sin_theta = std::sin(pi * (y + 0.5) / height);
+        for(int x=0; x<width; x++) {
+            const int i = y * width + x;
+            weights[i] = luminance(pixels[i]) * sin_theta;
+            sum += weights[i];
+        }
+    }
+    if(sum > 0)
+        distribution = AliasTable(weights);
+    Message("ENVMAP: ", filename, " (", width, "x", height, ")");
+}
+
+int ImageEnvmap::pixel(const vec3& dir, Float& u, Float& v) const {
+    const vec3 d = normalize(dir);
+    const Float phi = std::atan2(d.x, -d.z) - rotation;
+    u = phi / (2 * pi) + 0.5;
+    u -= std::floor(u);
+    v = std::acos(clamp(d.y, -1, 1)) / pi;
+    const int x = std::min(static_cast<int>(u * width), width - 1);
+    const int y = std::min(static_cast<int>(v * height), height - 1);
+    return y * width + x;
+}
+
+vec3 ImageEnvmap::eval(const vec3& dir) const {
+    Float u, v;
+    const float3& c = pixels[pixel(dir, u, v)];
+    return vec3(c.x, c.y, c.z) * intensity;
+}
+
+// Pixels of row y cover the solid angle (2 pi / width) * (pi / height) * sin(theta_y).
+Float ImageEnvmap::average_luminance() const {
+    return intensity * distribution.total() * 2 * pi * pi / (width * height) / (4 * pi);
+}
+
+// ----------------------------------------------------------------------------
+/** A pixel is uniform in (u, v), so its density over solid angle is pmf * width * height
+ *  divided by the Jacobian 2 pi^2 sin(theta) of the lat-long mapping. */
+vec3 ImageEnvmap::sample(Float& pdf) const {
+    Float pmf;
+    const int i = distribution.sample(random_float(), pmf);
+    const Float u = (i % width + random_float()) / width;
+    const Float v = (i / width + random_float()) / height;
+    const Float phi = 2 * pi * (u - 0.5) + rotation, theta = pi * v;
+    const Float sin_theta = std::sin(theta);
+    pdf = sin_theta > 0 ? pmf * width * height / (2 * pi * pi * sin_theta) : 0;
+    return vec3(sin_theta * std::sin(phi), std::cos(theta), -sin_theta * std::cos(phi));
+}
+
+Float ImageEnvmap::pdf(const vec3& dir) const {
+    if(distribution.empty())
+        return 0;
+    Float u, v;
+    const int i = pixel(dir, u, v);
+    const Float sin_theta = std::sin(pi * v);
+    return sin_theta > 0 ? distribution.pmf(i) * width * height / (2 * pi * pi * sin_theta) : 0;
+}
+
+}
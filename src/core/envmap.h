@@ -1,20 +1,86 @@
+#pragma once
+
 #include "vec.h"
-#include "image.h"
+#include "aabb.h"
+#include "color.h"
+#include "alias_table.h"
+#include <string>
+#include <vector>
 
 namespace mypt {
 
+/** \brief Radiance arriving from infinitely far away, which is seen by rays escaping the scene.
+ *  Besides being hit by BSDF sampling, it is sampled as a light by next event estimation. */
 class Envmap {
-    virtual vec3 eval() const = 0;
+public:
+    virtual ~Envmap() {}
+    // Radiance arriving from the direction `dir`, which need not be normalized.
+    virtual vec3 eval(const vec3& dir) const = 0;
+    // Unit direction toward the environment, and its density over solid angle in `pdf`.
+    virtual vec3 sample(Float& pdf) const = 0;
+    // Density of `sample()` over solid angle for the direction `dir`.
+    virtual Float pdf(const vec3& dir) const = 0;
+    // True when nothing is emitted, so that the environment is never sampled as a light.
+    virtual bool is_black() const = 0;
+    // Radiance averaged over the sphere of directions, as luminance.
+    virtual Float average_luminance() const = 0;
+
+    // Must be called with the bounds of the scene before `power()`.
+    void preprocess(const AABB& scene_bounds) {
+        scene_radius = 0.5 * (scene_bounds.max() - scene_bounds.min()).length();
+    }
+    /** Power received by the cross section of the bounding sphere of the scene, pi r^2 times
+     *  the irradiance pi L of the average radiance. It weights the environment against the
+     *  other lights in light sampling. */
+    Float power() const { return pi * pi * scene_radius * scene_radius * average_luminance(); }
+
+protected:
+    Float scene_radius = 0;
 };
 
+/** \brief Same radiance from every direction (`background r g b`), sampled uniformly over the sphere. */
 class ConstantEnvmap final : public Envmap {
+public:
+    explicit ConstantEnvmap(const vec3& color) : color(color) {}
+    vec3 eval(const vec3&) const override { return color; }
+    vec3 sample(Float& pdf) const override {
+        pdf = 1 / (4 * pi);
+        return random_unit_vector();
+    }
+    Float pdf(const vec3&) const override { return 1 / (4 * pi); }
+    bool is_black() const override { return color.is_near_zero(); }
+    Float average_luminance() const override { return luminance(color); }
 
 private:
     vec3 color;
 };
 
+/**
+ * \brief Environment of a lat-long (equirectangular) HDR image. Columns cover the azimuth around +y
+ * with the center of the image toward -z, and rows the polar angle from +y at the top.
+ * Radiance is constant over each pixel, and pixels are chosen from an alias table over their
+ * luminance times sin(theta), the solid angle of their row, so the density is proportional
+ * to the radiance and small bright regions such as the sun are found by light sampling.
+ */
 class ImageEnvmap final : public Envmap {
-    ImageEnvmap() {}
+public:
+    /// \brief `rotation` turns the image around +y [degrees].
+    explicit ImageEnvmap(const std::string& filename, Float intensity = 1, Float rotation = 0);
+    vec3 eval(const vec3& dir) const override;
+    vec3 sample(Float& pdf) const override;
+    Float pdf(const vec3& dir) const override;
+    bool is_black() const override { return distribution.empty(); }
+    Float average_luminance() const override;
+
+private:
+    // Pixel of the direction `dir`, and its image coordinates in [0, 1)^2 in `u` and `v`.
+    int pixel(const vec3& dir, Float& u, Float& v) const;
+
+    int width, height;
+    std::vector<float3> pixels;
+    Float intensity;
+    Float rotation;                 // [radians]
+    AliasTable distribution;        // Over pixels, empty when the image is black
 };
 
 }
\ No newline at end of file
@@ -0,0 +1,243 @@
+#include "light_bvh.h"
+#include <algorithm>
+
+namespace mypt {
+
+static Float safe_sqrt(Float x) { return std::sqrt(std::max(x, Float(0))); }
+static Float safe_acos(Float x) { return std::acos(clamp(x, -1, 1)); }
+
+// cos(max(0, a - b)) and sin(max(0, a - b)) from the sines and cosines of angles a and b.
+static Float cos_sub_clamped(Float sin_a, Float cos_a, Float sin_b, Float cos_b) {
+    return cos_a > cos_b ? 1 : cos_a * cos_b + sin_a * sin_b;
+}
+static Float sin_sub_clamped(Float sin_a, Float cos_a, Float sin_b, Float cos_b) {
+    return cos_a > cos_b ? 0 : sin_a * cos_b - cos_a * sin_b;
+}
+
+// ----------------------------------------------------------------------------
+Float LightBounds::importance(const vec3& p, const vec3& n) const {
+    const vec3 pc = bounds.centroid();
+    const Float radius_squared = 0.25 * (bounds.max() - bounds.min()).length_squared();
+    const vec3 wi = p - pc;
+    const Float distance_squared = wi.length_squared();
+    const Float distance = std::sqrt(distance_squared);
+
+    // Angle between `w` and the direction toward `p`, less the spread of normals and of the bounds
+    // seen from `p`, bounds the angle of emission toward `p`.
+    Float cos_theta_w = distance > 0 ? dot(w, wi) / distance : 1;
+    if(two_sided)
+        cos_theta_w = std::abs(cos_theta_w);
+    const Float sin_theta_w = safe_sqrt(1 - cos_theta_w * cos_theta_w);
+    const Float cos_theta_b = distance_squared < radius_squared ? -1 : safe_sqrt(1 - radius_squared / distance_squared);
+    const Float sin_theta_b = safe_sqrt(1 - cos_theta_b * cos_theta_b);
+    const Float sin_theta_o = safe_sqrt(1 - cos_theta_o * cos_theta_o);
+    const Float cos_theta_x = cos_sub_clamped(sin_theta_w, cos_theta_w, sin_theta_o, cos_theta_o);
+    const Float sin_theta_x = sin_sub_clamped(sin_theta_w, cos_theta_w, sin_theta_o, cos_theta_o);
+    const Float cos_theta_p = cos_sub_clamped(sin_theta_x, cos_theta_x, sin_theta_b, cos_theta_b);
+    if(cos_theta_p <= cos_theta_e)
+        return 0;
+
+    // The distance is clamped as in pbrt-v4, so that points inside large bounds don't blow up.
+    Float importance = phi * cos_theta_p / std::max(distance_squared, std::sqrt(radius_squared));
+    if(n.length_squared() > 0 && distance > 0) {
+        const Float cos_theta_i = std::abs(dot(wi, n)) / (distance * n.length());
+        const Float sin_theta_i = safe_sqrt(1 - cos_theta_i * cos_theta_i);
+        importance *= cos_sub_clamped(sin_theta_i, cos_theta_i, sin_theta_b, cos_theta_b);
+    }
+    return std::max(importance, Float(0));
+}
+
+// ----------------------------------------------------------------------------
+/** Smallest cone enclosing both cones (`wa`, theta_a) and (`wb`, theta_b). Its axis is `wa` rotated
+ *  toward `wb` in their plane. */
+static void union_cone(const vec3& wa, Float cos_a, const vec3& wb, Float cos_b, vec3& w, Float& cos_o) {
+    const Float theta_a = safe_acos(cos_a), theta_b = safe_acos(cos_b);
+    const Float theta_d = safe_acos(dot(wa, wb));
+    if(std::min(theta_d + theta_b, pi) <= theta_a) {
+        w = wa; cos_o = cos_a;
+        return;
+    }
+    if(std::min(theta_d + theta_a, pi) <= theta_b) {
+        w = wb; cos_o = cos_b;
+        return;
+    }
+    const Float theta_o = (theta_a + theta_d + theta_b) / 2;
+    vec3 axis = cross(wa, wb);
+    if(theta_o >= pi || axis.length_squared() == 0) {
+        w = wa; cos_o = -1;
+        return;
+    }
+    // Rodrigues' rotation of `wa` around `axis`
+    const Float theta_r = theta_o - theta_a;
+    axis = normalize(axis);
+    w = normalize(wa * std::cos(theta_r) + cross(axis, wa) * std::sin(theta_r)
+                + axis * dot(axis, wa) * (1 - std::cos(theta_r)));
+    cos_o = std::cos(theta_o);
+}
+
+LightBounds union_bounds(const LightBounds& a, const LightBounds& b) {
+    if(a.phi == 0) return b;
+    if(b.phi == 0) return a;
+    LightBounds u;
+    u.bounds = surrounding(a.bounds, b.bounds);
+    u.phi = a.phi + b.phi;
+    union_cone(a.w, a.cos_theta_o, b.w, b.cos_theta_o, u.w, u.cos_theta_o);
+    u.cos_theta_e = std::min(a.cos_theta_e, b.cos_theta_e);
+    u.two_sided = a.two_sided || b.two_sided;
+    return u;
+}
+
+// Cost of a node in the split heuristic: power times the measure of its emission directions and its area.
+static Float node_cost(const LightBounds& b) {
+    const Float theta_o = safe_acos(b.cos_theta_o), theta_e = safe_acos(b.cos_theta_e);
+    const Float theta_w = std::min(theta_o + theta_e, pi);
+    const Float sin_theta_o = safe_sqrt(1 - b.cos_theta_o * b.cos_theta_o);
+    const Float m_omega = 2 * pi * (1 - b.cos_theta_o)
+        + pi / 2 * (2 * theta_w * sin_theta_o - std::cos(theta_o - 2 * theta_w)
+                    - 2 * theta_o * sin_theta_o + b.cos_theta_o);
+    return b.phi * m_omega * b.bounds.surface_area();
+}
+
+// ----------------------------------------------------------------------------
+LightBVH::LightBVH(const std::vector<std::shared_ptr<Primitive>>& lights) : lights(lights) {
+    if(lights.empty())
+        return;
+    // Lights without power are never chosen, so they are left out.
+    std::vector<std::pair<int, LightBounds>> items;
+    for(size_t i=0; i<lights.size(); i++) {
+        LightBounds lb;
+        if(!lights[i]->light_bounds(lb))
+            Throw("Light '"+lights[i]->to_string()+"' cannot be sampled\n");
+        if(lb.phi > 0)
+            items.emplace_back(static_cast<int>(i), lb);
+    }
+    if(items.empty())
+        return;
+    nodes.reserve(2 * items.size() - 1);
+    build(items, 0, static_cast<int>(items.size()), -1, 0);
+    for(size_t i=0; i<nodes.size(); i++) {
+        if(nodes[i].light >= 0)
+            leaves[lights[nodes[i].light].get()] = static_cast<int>(i);
+    }
+}
+
+/** Lights are split at the bucket boundary of the least cost (Conty Estevez and Kulla 2018), whose cost is
+ *  scaled up for thin axes of the bounds. Deep nodes are split at the median to bound the depth. */
+void LightBVH::build(std::vector<std::pair<int, LightBounds>>& items, int start, int end, int parent, int depth) {
+    const int index = static_cast<int>(nodes.size());
+    nodes.emplace_back();
+    nodes[index].parent = parent;
+    if(end - start == 1) {
+        nodes[index].bounds = items[start].second;
+        nodes[index].second_child = -1;
+        nodes[index].light = items[start].first;
+        return;
+    }
+
+    LightBounds all;
+    AABB centroids(items[start].second.bounds.centroid(), items[start].second.bounds.centroid());
+    for(int i=start; i<end; i++) {
+        all = union_bounds(all, items[i].second);
+        centroids = surrounding(centroids, items[i].second.bounds.centroid());
+    }
+    const vec3 extent = all.bounds.max() - all.bounds.min();
+    const vec3 centroid_extent = centroids.max() - centroids.min();
+
+    constexpr int n_buckets = 12;
+    int best_axis = -1, best_split = 0;
+    if(depth < max_depth / 2) {
+        Float best_cost = infinity;
+        const Float max_extent = std::max({ extent.x, extent.y, extent.z });
+        for(int axis=0; axis<3; axis++) {
+            if(centroid_extent[axis] <= 0)
+                continue;
+            LightBounds buckets[n_buckets];
+            for(int i=start; i<end; i++) {
+                const Float offset = (items[i].second.bounds.centroid()[axis] - centroids.min()[axis]) / centroid_extent[axis];
+                const int b = std::min(static_cast<int>(n_buckets * offset), n_buckets - 1);
+                buckets[b] = union_bounds(buckets[b], items[i].second);
+            }
+            const Float kr = max_extent / extent[axis];
+            for(int split=1; split<n_buckets; split++) {
+                LightBounds below, above;
+                for(int b=0; b<split; b++)          below = union_bounds(below, buckets[b]);
+                for(int b=split; b<n_buckets; b++)  above = union_bounds(above, buckets[b]);
+                const Float cost = kr * (node_cost(below) + node_cost(above));
+                if(cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_split = split;
+                }
+            }
+        }
+    }
+
+    int mid = start;
+    if(best_axis >= 0) {
+        auto it = std::partition(items.begin() + start, items.begin() + end, [&](const std::pair<int, LightBounds>& item) {
+            const Float offset = (item.second.bounds.centroid()[best_axis] - centroids.min()[best_axis]) / centroid_extent[best_axis];
+            return std::min(static_cast<int>(n_buckets * offset), n_buckets - 1) < best_split;
+        });
+        mid = static_cast<int>(it - items.begin());
+    }
+    if(mid == start || mid == end) {
+        const int axis = centroid_extent.x > centroid_extent.y
+            ? (centroid_extent.x > centroid_extent.z ? 0 : 2) : (centroid_extent.y > centroid_extent.z ? 1 : 2);
+        mid = (start + end) / 2;
+        std::nth_element(items.begin() + start, items.begin() + mid, items.begin() + end,
+            [axis](const std::pair<int, LightBounds>& a, const std::pair<int, LightBounds>& b) {
+                return a.second.bounds.centroid()[axis] < b.second.bounds.centroid()[axis];
+            });
+    }
+
+    build(items, start, mid, index, depth + 1);
+    nodes[index].second_child = static_cast<int>(nodes.size());
+    build(items, mid, end, index, depth + 1);
+    nodes[index].bounds = union_bounds(nodes[index + 1].bounds, nodes[nodes[index].second_child].bounds);
+    nodes[index].light = -1;
+}
+
+// ----------------------------------------------------------------------------
+const Primitive* LightBVH::sample(const vec3& p, const vec3& n, Float& pmf) const {
+    pmf = 1;
+    if(nodes.empty())
+        return nullptr;
+    int index = 0;
+    while(nodes[index].light < 0) {
+        const int c0 = index + 1, c1 = nodes[index].second_child;
+        const Float i0 = nodes[c0].bounds.importance(p, n);
+        const Float i1 = nodes[c1].bounds.importance(p, n);
+        if(i0 + i1 <= 0)
+            return nullptr;
+        const Float p0 = i0 / (i0 + i1);
+        if(random_float() < p0) {
+            index = c0;
+            pmf *= p0;
+        }
+        else {
+            index = c1;
+            pmf *= 1 - p0;
+        }
+    }
+    return lights[nodes[index].light].get();
+}
+
+// The same importances as in `sample()` are evaluated on the path from the root to the leaf.
+Float LightBVH::pmf(const vec3& p, const vec3& n, const Primitive* light) const {
+    auto it = leaves.find(light);
+    if(it == leaves.end())
+        return 0;
+    Float pmf = 1;
+    for(int index = it->second; nodes[index].parent >= 0; index = nodes[index].parent) {
+        const int parent = nodes[index].parent;
+        const int sibling = index == parent + 1 ? nodes[parent].second_child : parent + 1;
+        const Float i0 = nodes[index].bounds.importance(p, n);
+        const Float i1 = nodes[sibling].bounds.importance(p, n);
+        if(i0 <= 0)
+            return 0;
+        pmf *= i0 / (i0 + i1);
+    }
+    return pmf;
+}
+
+}
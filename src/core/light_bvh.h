@@ -0,0 +1,71 @@
+#pragma once
+
+#include "primitive.h"
+#include <unordered_map>
+
+namespace mypt {
+
+/** \brief Bounds of the power emitted by a light, or a group of lights, in space and direction.
+ *  Surface normals lie within angle theta_o around `w`, and each surface emits within angle
+ *  theta_e around its normal. Two-sided lights also emit around the opposite normals. */
+struct LightBounds {
+    AABB bounds;
+    vec3 w = vec3(0, 0, 1);
+    Float phi = 0;                  // Emitted power
+    Float cos_theta_o = -1;         // cos(theta_o), -1 when normals point in every direction
+    Float cos_theta_e = 0;          // cos(theta_e), 0 for diffuse emission
+    bool two_sided = false;
+
+    /** Upper bound of the power received at `p` on a surface of normal `n` (Conty Estevez and Kulla 2018).
+     *  `n` is zero for points without a surface (e.g. in media). */
+    Float importance(const vec3& p, const vec3& n) const;
+};
+
+LightBounds union_bounds(const LightBounds& a, const LightBounds& b);
+
+/**
+ * \brief Hierarchy of lights for many-light sampling. Each node bounds the power, position
+ * and emission directions of its lights, so that a light is chosen in O(log N) by descending
+ * to either child with probability proportional to its importance at the shading point.
+ * Nodes are stored depth first, the first child of an interior node follows it.
+ */
+class LightBVH {
+public:
+    LightBVH() = default;
+    /// \brief All `lights` must provide `light_bounds()`.
+    explicit LightBVH(const std::vector<std::shared_ptr<Primitive>>& lights);
+
+    /** Choose a light for the point `p` of normal `n` and return it with its probability `pmf`.
+     *  Returns null when no light can illuminate `p`. */
+    const Primitive* sample(const vec3& p, const vec3& n, Float& pmf) const;
+    /** Probability that `sample()` chooses `light` for the point `p` of normal `n`, which is found by
+     *  walking up from its leaf. It is 0 for primitives which are not in the hierarchy. */
+    Float pmf(const vec3& p, const vec3& n, const Primitive* light) const;
+
+    // True when no light has power to be chosen.
+    bool empty() const { return nodes.empty(); }
+    // Total power of the lights, which is the power of the root.
+    Float power() const { return nodes.empty() ? 0 : nodes[0].bounds.phi; }
+    size_t size() const { return lights.size(); }
+    size_t num_nodes() const { return nodes.size(); }
+
+private:
+    struct Node {
+        LightBounds bounds;
+        int second_child;           // Interior node
+        int light;                  // Index into `lights` for leaf, -1 for interior node
+        int parent;                 // -1 for the root
+    };
+
+    // Build the subtree over `items[start, end)` at `nodes.size()`.
+    void build(std::vector<std::pair<int, LightBounds>>& items, int start, int end, int parent, int depth);
+
+    // Nodes deeper than half of this are split at the median, which bounds the cost of `sample()` and `pmf()`.
+    static constexpr int max_depth = 64;
+
+    std::vector<Node> nodes;
+    std::vector<std::shared_ptr<Primitive>> lights;
+    std::unordered_map<const Primitive*, int> leaves;   // Leaf node of each light
+};
+
+}
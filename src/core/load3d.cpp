@@ -0,0 +1,692 @@
+#include "load3d.h"
+#include "mapped_file.h"
+#include "../ext/happly/happly.h"
+#include <algorithm>
+#include <cstring>
+#include <sstream>
+#include <unordered_map>
+#include <omp.h>
+
+namespace mypt {
+
+// ----------------------------------------------------------------------------
+// Hand-written number parsers, which never allocate nor depend on the locale.
+static inline bool is_space(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+static inline bool is_digit(char c) { return c >= '0' && c <= '9'; }
+
+static inline const char* skip_space(const char* p, const char* end) {
+    while(p < end && is_space(*p)) p++;
+    return p;
+}
+
+static inline const char* skip_line(const char* p, const char* end) {
+    while(p < end && *p != '\n') p++;
+    return p < end ? p + 1 : end;
+}
+
+static const char* parse_int(const char* p, const char* end, int& value) {
+    bool negative = false;
+    if(p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+    const char* digits = p;
+    int v = 0;
+    while(p < end && is_digit(*p)) v = v * 10 + (*p++ - '0');
+    value = negative ? -v : v;
+    return p == digits ? nullptr : p;
+}
+
+template <typename Real>
+static const char* parse_float(const char* p, const char* end, Real& value) {
+    static const double powers[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    bool negative = false;
+    if(p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+    const char* digits = p;
+    double mantissa = 0;
+    int exponent = 0;
+    while(p < end && is_digit(*p)) mantissa = mantissa * 10 + (*p++ - '0');
+    if(p < end && *p == '.') {
+        p++;
+        while(p < end && is_digit(*p)) {
+            mantissa = mantissa * 10 + (*p++ - '0');
+            exponent--;
+        }
+    }
+    if(p == digits) return nullptr;
+    if(p < end && (*p == 'e' || *p == 'E')) {
+        int e;
+        const char* q = parse_int(p + 1, end, e);
+        if(q) { exponent += e; p = q; }
+    }
+    double v = mantissa;
+    if(exponent < 0) v = exponent >= -22 ? v / powers[-exponent] : v * std::pow(10.0, exponent);
+    else if(exponent > 0) v = exponent <= 22 ? v * powers[exponent] : v * std::pow(10.0, exponent);
+    value = static_cast<Real>(negative ? -v : v);
+    return p;
+}
+
+// ----------------------------------------------------------------------------
+/** Elements of one chunk of OBJ lines. Corners hold (position, texcoord, normal) indices
+ *  per triangle corner, -1 when missing. Negative (relative) indices are resolved to
+ *  chunk-local ones and listed in `relative`, to be offset once previous chunks are known. */
+struct ObjChunk {
+    std::vector<float3> positions;
+    std::vector<float3> normals;
+    std::vector<float2> texcoords;
+    std::vector<int3> corners;
+    std::vector<std::pair<size_t, int>> relative;  // (corner, component)
+};
+
+struct ObjCorner {
+    int3 index = int3(-1, -1, -1);
+    int relative = 0;   // Bit mask of components given as relative indices
+};
+
+// Messages are only built on failure, as this runs for every line.
+static void parse_obj_chunk(const char* p, const char* end, ObjChunk& chunk, const std::string& filename) {
+    std::vector<ObjCorner> polygon;
+    while(p < end) {
+        p = skip_space(p, end);
+        if(p + 1 >= end || *p == '\n' || *p == '#') {
+            p = skip_line(p, end);
+            continue;
+        }
+
+        if(p[0] == 'v' && is_space(p[1])) {
+            float3 v;
+            const char* q = p + 1;
+            for(int i=0; i<3 && q; i++) q = parse_float(skip_space(q, end), end, v[i]);
+            if(!q) Throw("Invalid vertex in OBJ file '"+filename+"'\n");
+            chunk.positions.push_back(v);
+        }
+        else if(p[0] == 'v' && p[1] == 'n' && p + 2 < end && is_space(p[2])) {
+            float3 n;
+            const char* q = p + 2;
+            for(int i=0; i<3 && q; i++) q = parse_float(skip_space(q, end), end, n[i]);
+            if(!q) Throw("Invalid normal in OBJ file '"+filename+"'\n");
+            chunk.normals.push_back(n);
+        }
+        else if(p[0] == 'v' && p[1] == 't' && p + 2 < end && is_space(p[2])) {
+            // The optional third coordinate is ignored.
+            float2 t;
+            const char* q = p + 2;
+            for(int i=0; i<2 && q; i++) q = parse_float(skip_space(q, end), end, t[i]);
+            if(!q) Throw("Invalid texcoord in OBJ file '"+filename+"'\n");
+            chunk.texcoords.push_back(t);
+        }
+        else if(p[0] == 'f' && is_space(p[1])) {
+            // Tokens are `v`, `v/t`, `v//n` or `v/t/n`.
+            polygon.clear();
+            const int counts[3] = { static_cast<int>(chunk.positions.size()),
+                                    static_cast<int>(chunk.texcoords.size()),
+                                    static_cast<int>(chunk.normals.size()) };
+            const char* q = skip_space(p + 1, end);
+            while(q < end && *q != '\n' && *q != '#') {
+                ObjCorner corner;
+                for(int c=0; c<3; c++) {
+                    if(c > 0) {
+                        if(q >= end || *q != '/') break;
+                        // Empty index, as the texcoord of `v//n`
+                        if(++q < end && *q == '/') continue;
+                    }
+                    int index;
+                    q = parse_int(q, end, index);
+                    if(!q || index == 0) Throw("Invalid face in OBJ file '"+filename+"'\n");
+                    // 1-based, or relative to the elements read so far when negative.
+                    if(index > 0) {
+                        corner.index[c] = index - 1;
+                    } else {
+                        corner.index[c] = counts[c] + index;
+                        corner.relative |= 1 << c;
+                    }
+                }
+                polygon.push_back(corner);
+                q = skip_space(q, end);
+            }
+            if(polygon.size() < 3) Throw("A face of OBJ file '"+filename+"' has less than 3 vertices\n");
+
+            auto push_corner = [&chunk](const ObjCorner& corner) {
+                for(int c=0; c<3; c++)
+                    if(corner.relative & (1 << c)) chunk.relative.emplace_back(chunk.corners.size(), c);
+                chunk.corners.push_back(corner.index);
+            };
+            // Triangulate as a fan, which is exact for convex polygons.
+            for(size_t i=1; i+1<polygon.size(); i++) {
+                push_corner(polygon[0]);
+                push_corner(polygon[i]);
+                push_corner(polygon[i+1]);
+            }
+            p = q;
+        }
+        p = skip_line(p, end);
+    }
+}
+
+// ----------------------------------------------------------------------------
+void loadObj(
+    const std::string& filename,
+    std::vector<float3>& vertices, 
+    std::vector<float3>& normals, 
+    std::vector<int3>& faces,
+    std::vector<float2>& texcoords) 
+{
+    const double start = omp_get_wtime();
+    MappedFile file(filename);
+
+    // Split into chunks of whole lines, a few per thread to balance the load.
+    constexpr size_t min_chunk_size = 1 << 16;
+    const size_t num_threads = static_cast<size_t>(omp_get_max_threads());
+    const size_t num_chunks = std::max<size_t>(1, std::min(num_threads * 8, file.size() / min_chunk_size));
+    std::vector<const char*> bounds(num_chunks + 1, file.end());
+    bounds[0] = file.begin();
+    for(size_t i=1; i<num_chunks; i++) {
+        const char* p = std::max(bounds[i-1], file.begin() + file.size() * i / num_chunks);
+        bounds[i] = p > file.begin() ? skip_line(p - 1, file.end()) : p;
+    }
+
+    // Exceptions must not leave the parallel region, so the first error is rethrown after it.
+    std::vector<ObjChunk> chunks(num_chunks);
+    std::string error;
+    #pragma omp parallel for schedule(dynamic, 1)
+    for(size_t i=0; i<num_chunks; i++) {
+        try {
+            parse_obj_chunk(bounds[i], bounds[i+1], chunks[i], filename);
+        } catch(const std::exception& e) {
+            #pragma omp critical
+            if(error.empty()) error = e.what();
+        }
+    }
+    if(!error.empty())
+        Throw(error);
+
+    // Offsets of each chunk into the concatenated positions/texcoords/normals and corners.
+    std::vector<int3> offsets(num_chunks + 1, int3(0, 0, 0));
+    std::vector<size_t> corner_offsets(num_chunks + 1, 0);
+    for(size_t i=0; i<num_chunks; i++) {
+        offsets[i+1] = int3(offsets[i][0] + static_cast<int>(chunks[i].positions.size()),
+                            offsets[i][1] + static_cast<int>(chunks[i].texcoords.size()),
+                            offsets[i][2] + static_cast<int>(chunks[i].normals.size()));
+        corner_offsets[i+1] = corner_offsets[i] + chunks[i].corners.size();
+    }
+    const int3 counts = offsets[num_chunks];
+    const size_t num_corners = corner_offsets[num_chunks];
+
+    // Gather elements and resolve relative indices against the preceding chunks.
+    std::vector<float3> obj_positions(counts[0]);
+    std::vector<float2> obj_texcoords(counts[1]);
+    std::vector<float3> obj_normals(counts[2]);
+    std::vector<int3> corners(num_corners);
+    bool valid = true, same_texcoord = true, same_normal = true;
+    bool all_texcoords = true, all_normals = true;
+    #pragma omp parallel for schedule(dynamic, 1) \
+        reduction(&&: valid, same_texcoord, same_normal, all_texcoords, all_normals)
+    for(size_t i=0; i<num_chunks; i++) {
+        ObjChunk& chunk = chunks[i];
+        for(const auto& [corner, c] : chunk.relative) {
+            chunk.corners[corner][c] += offsets[i][c];
+            // Relative indices must refer to an element before them, never to a missing one.
+            valid = valid && chunk.corners[corner][c] >= 0;
+        }
+        std::copy(chunk.positions.begin(), chunk.positions.end(), obj_positions.begin() + offsets[i][0]);
+        std::copy(chunk.texcoords.begin(), chunk.texcoords.end(), obj_texcoords.begin() + offsets[i][1]);
+        std::copy(chunk.normals.begin(), chunk.normals.end(), obj_normals.begin() + offsets[i][2]);
+        std::copy(chunk.corners.begin(), chunk.corners.end(), corners.begin() + corner_offsets[i]);
+        for(const int3& corner : chunk.corners) {
+            for(int c=0; c<3; c++)
+                valid = valid && corner[c] >= -1 && corner[c] < counts[c] && (c > 0 || corner[c] >= 0);
+            same_texcoord = same_texcoord && (corner[1] < 0 || corner[1] == corner[0]);
+            same_normal = same_normal && (corner[2] < 0 || corner[2] == corner[0]);
+            all_texcoords = all_texcoords && corner[1] >= 0;
+            all_normals = all_normals && corner[2] >= 0;
+        }
+        chunk = ObjChunk();
+    }
+    Assert(valid, "An index of OBJ file '"+filename+"' is out of range\n");
+    Assert(num_corners > 0, "The OBJ file '"+filename+"' has no faces\n");
+
+    vertices.clear(); normals.clear(); faces.clear(); texcoords.clear();
+    faces.resize(num_corners / 3);
+    if(same_texcoord && same_normal) {
+        // Attributes are indexed like positions, as in most exported meshes.
+        vertices = std::move(obj_positions);
+        if(all_texcoords && obj_texcoords.size() == vertices.size()) texcoords = std::move(obj_texcoords);
+        if(all_normals && obj_normals.size() == vertices.size()) normals = std::move(obj_normals);
+        #pragma omp parallel for
+        for(size_t f=0; f<faces.size(); f++)
+            faces[f] = int3(corners[3*f][0], corners[3*f+1][0], corners[3*f+2][0]);
+    } else {
+        // A vertex for each distinct (position, texcoord, normal) tuple.
+        struct CornerHash {
+            size_t operator()(const int3& c) const {
+                return (static_cast<size_t>(c[0]) * 73856093) ^ (static_cast<size_t>(c[1]) * 19349663)
+                     ^ (static_cast<size_t>(c[2]) * 83492791);
+            }
+        };
+        // Without normals in the file, they are averaged around positions before splitting,
+        // so that vertices split by texcoords at the same position share one normal.
+        std::vector<float3> position_normals;
+        if(!all_normals) {
+            std::vector<int3> position_faces(faces.size());
+            #pragma omp parallel for
+            for(size_t f=0; f<faces.size(); f++)
+                position_faces[f] = int3(corners[3*f][0], corners[3*f+1][0], corners[3*f+2][0]);
+            computeSmoothNormals(obj_positions, position_faces, position_normals);
+        }
+
+        std::unordered_map<int3, int, CornerHash> unique;
+        unique.reserve(counts[0]);
+        vertices.reserve(counts[0]);
+        for(size_t i=0; i<num_corners; i++) {
+            int3 key = corners[i];
+            if(!all_texcoords) key[1] = -1;
+            if(!all_normals) key[2] = -1;
+            auto [it, inserted] = unique.try_emplace(key, static_cast<int>(vertices.size()));
+            if(inserted) {
+                vertices.push_back(obj_positions[key[0]]);
+                if(all_texcoords) texcoords.push_back(obj_texcoords[key[1]]);
+                normals.push_back(all_normals ? obj_normals[key[2]] : position_normals[key[0]]);
+            }
+            faces[i / 3][i % 3] = it->second;
+        }
+    }
+
+    const double seconds = omp_get_wtime() - start;
+    Message("OBJ '", filename, "': ", vertices.size(), " vertices, ", faces.size(), " triangles in ",
+            seconds, " s (", file.size() / (seconds * 1e6), " MB/s, ", num_chunks, " chunks)");
+}
+
+// ----------------------------------------------------------------------------
+void computeSmoothNormals(
+    const std::vector<float3>& vertices,
+    const std::vector<int3>& faces,
+    std::vector<float3>& normals)
+{
+    normals.assign(vertices.size(), float3(0.0f));
+    auto counts = std::vector<int>(vertices.size(), 0);
+    for(auto &face : faces)
+    {
+        vec3 p0 = vertices[face[0]];
+        vec3 p1 = vertices[face[1]];
+        vec3 p2 = vertices[face[2]];
+        float3 N = normalize(cross(p2-p0, p1-p0));
+        for(int k=0; k<3; k++) {
+            normals[face[k]] += N;
+            counts[face[k]]++;
+        }
+    }
+    for (auto i = 0; i < (int)vertices.size(); i++)
+    {
+        if(counts[i] == 0) continue;   // Not referred to by any face
+        normals[i] /= counts[i];
+        normals[i] = normalize(vec3(normals[i]));
+    }
+}
+
+// ----------------------------------------------------------------------------
+enum class PlyFormat { Ascii, BinaryLittleEndian, BinaryBigEndian };
+enum class PlyType { Int8, UInt8, Int16, UInt16, Int32, UInt32, Float32, Float64 };
+
+struct PlyProperty {
+    std::string name;
+    PlyType type;
+    bool is_list = false;
+    PlyType count_type = PlyType::UInt8;    // Type of the item count of a list
+};
+
+struct PlyElement {
+    std::string name;
+    size_t count = 0;
+    std::vector<PlyProperty> properties;
+};
+
+static PlyType ply_type(const std::string& name, const std::string& filename) {
+    if(name == "char" || name == "int8") return PlyType::Int8;
+    if(name == "uchar" || name == "uint8") return PlyType::UInt8;
+    if(name == "short" || name == "int16") return PlyType::Int16;
+    if(name == "ushort" || name == "uint16") return PlyType::UInt16;
+    if(name == "int" || name == "int32") return PlyType::Int32;
+    if(name == "uint" || name == "uint32") return PlyType::UInt32;
+    if(name == "float" || name == "float32") return PlyType::Float32;
+    if(name == "double" || name == "float64") return PlyType::Float64;
+    Throw("Unknown property type '"+name+"' in PLY file '"+filename+"'\n");
+    return PlyType::Float32;
+}
+
+template <typename T>
+static inline T load_binary(const char* p, bool swap) {
+    char bytes[sizeof(T)];
+    if(swap) std::reverse_copy(p, p + sizeof(T), bytes);
+    else     std::copy(p, p + sizeof(T), bytes);
+    T value;
+    std::memcpy(&value, bytes, sizeof(T));
+    return value;
+}
+
+static inline size_t ply_type_size(PlyType type) {
+    static const size_t sizes[] = { 1, 1, 2, 2, 4, 4, 4, 8 };
+    return sizes[static_cast<int>(type)];
+}
+
+static inline double load_ply_binary(const char* p, PlyType type, bool swap) {
+    switch(type) {
+        case PlyType::Int8:    return load_binary<int8_t>(p, swap);
+        case PlyType::UInt8:   return load_binary<uint8_t>(p, swap);
+        case PlyType::Int16:   return load_binary<int16_t>(p, swap);
+        case PlyType::UInt16:  return load_binary<uint16_t>(p, swap);
+        case PlyType::Int32:   return load_binary<int32_t>(p, swap);
+        case PlyType::UInt32:  return load_binary<uint32_t>(p, swap);
+        case PlyType::Float32: return load_binary<float>(p, swap);
+        case PlyType::Float64: return load_binary<double>(p, swap);
+    }
+    return 0.0;
+}
+
+static inline bool needs_swap(PlyFormat format) {
+    constexpr bool little_endian_host = __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__;
+    return format != PlyFormat::Ascii && (format == PlyFormat::BinaryLittleEndian) != little_endian_host;
+}
+
+/** Reads a number of `type` at `p` and returns the position after it, or nullptr when
+ *  the data ends or is not a number. ASCII values are separated by any white space. */
+static inline const char* read_ply_value(const char* p, const char* end, PlyType type, PlyFormat format, double& value) {
+    if(format == PlyFormat::Ascii) {
+        while(p < end && (is_space(*p) || *p == '\n')) p++;
+        return parse_float(p, end, value);
+    }
+    const size_t size = ply_type_size(type);
+    if(static_cast<size_t>(end - p) < size) return nullptr;
+    value = load_ply_binary(p, type, needs_swap(format));
+    return p + size;
+}
+
+/** Parses the header up to `end_header`, and returns the position of the first element. */
+static const char* read_ply_header(const MappedFile& file, PlyFormat& format, std::vector<PlyElement>& elements,
+                                   const std::string& filename)
+{
+    const std::string end_header = "end_header";
+    const char* header_end = std::search(file.begin(), file.end(), end_header.begin(), end_header.end());
+    Assert(file.size() >= 3 && std::equal(file.begin(), file.begin() + 3, "ply") && header_end != file.end(),
+           "The PLY file '"+filename+"' has no valid header\n");
+
+    std::istringstream header(std::string(file.begin(), header_end));
+    bool has_format = false;
+    for(std::string line; std::getline(header, line);) {
+        std::istringstream iss(line);
+        std::string keyword;
+        iss >> keyword;
+        if(keyword == "format") {
+            std::string name;
+            iss >> name;
+            if(name == "ascii") format = PlyFormat::Ascii;
+            else if(name == "binary_little_endian") format = PlyFormat::BinaryLittleEndian;
+            else if(name == "binary_big_endian") format = PlyFormat::BinaryBigEndian;
+            else Throw("Unknown format '"+name+"' of PLY file '"+filename+"'\n");
+            has_format = true;
+        }
+        else if(keyword == "element") {
+            PlyElement element;
+            iss >> element.name >> element.count;
+            Assert(!iss.fail(), "Invalid element in PLY file '"+filename+"'\n");
+            elements.push_back(element);
+        }
+        else if(keyword == "property") {
+            Assert(!elements.empty(), "A property before any element in PLY file '"+filename+"'\n");
+            PlyProperty property;
+            std::string type;
+            iss >> type;
+            if(type == "list") {
+                std::string count_type;
+                iss >> count_type >> type;
+                property.is_list = true;
+                property.count_type = ply_type(count_type, filename);
+            }
+            property.type = ply_type(type, filename);
+            iss >> property.name;
+            elements.back().properties.push_back(property);
+        }
+    }
+    Assert(has_format, "The PLY file '"+filename+"' has no format\n");
+    return skip_line(header_end, file.end());
+}
+
+// ----------------------------------------------------------------------------
+void loadPly(
+    const std::string& filename,
+    std::vector<float3>& vertices,
+    std::vector<float3>& normals, 
+    std::vector<int3>& faces, 
+    std::vector<float2>& texcoords
+)
+{
+    const double start = omp_get_wtime();
+    MappedFile file(filename);
+    PlyFormat format = PlyFormat::Ascii;
+    std::vector<PlyElement> elements;
+    const char* p = read_ply_header(file, format, elements, filename);
+    const char* end = file.end();
+
+    vertices.clear(); normals.clear(); faces.clear(); texcoords.clear();
+    const std::string truncated = "The PLY file '"+filename+"' is truncated or invalid\n";
+    double value;
+    // Skips a property, which is not used, of the current element.
+    auto skip_property = [&](const PlyProperty& property) {
+        if(!(p = read_ply_value(p, end, property.is_list ? property.count_type : property.type, format, value)))
+            Throw(truncated);
+        for(int i=0, n=property.is_list ? static_cast<int>(value) : 0; i<n; i++)
+            if(!(p = read_ply_value(p, end, property.type, format, value)))
+                Throw(truncated);
+    };
+
+    // Elements are streamed into the output buffers in the order of the file.
+    for(const PlyElement& element : elements) {
+        if(element.name == "vertex") {
+            // Position, normal and texcoord components a property is stored to, or -1.
+            static const std::vector<std::vector<std::string>> names = {
+                {"x"}, {"y"}, {"z"}, {"nx"}, {"ny"}, {"nz"},
+                {"u", "s", "texture_u", "texture_s"}, {"v", "t", "texture_v", "texture_t"}
+            };
+            std::vector<int> slots(element.properties.size(), -1);
+            int found = 0;
+            for(size_t k=0; k<element.properties.size(); k++) {
+                for(int slot=0; slot<8; slot++) {
+                    const auto& candidates = names[slot];
+                    if(!element.properties[k].is_list &&
+                       std::find(candidates.begin(), candidates.end(), element.properties[k].name) != candidates.end()) {
+                        slots[k] = slot;
+                        found |= 1 << slot;
+                    }
+                }
+            }
+            Assert((found & 0x07) == 0x07, "The vertices of PLY file '"+filename+"' have no positions\n");
+            const bool has_normals = (found & 0x38) == 0x38;
+            const bool has_texcoords = (found & 0xC0) == 0xC0;
+
+            vertices.resize(element.count);
+            if(has_normals) normals.resize(element.count);
+            if(has_texcoords) texcoords.resize(element.count);
+            auto store = [&](size_t i, int slot, double value) {
+                if(slot < 3) vertices[i][slot] = static_cast<float>(value);
+                else if(slot < 6) { if(has_normals) normals[i][slot - 3] = static_cast<float>(value); }
+                else if(has_texcoords) texcoords[i][slot - 6] = static_cast<float>(value);
+            };
+
+            // Binary vertices without lists have a fixed stride, so only used properties are read.
+            const bool fixed = format != PlyFormat::Ascii &&
+                std::none_of(element.properties.begin(), element.properties.end(),
+                             [](const PlyProperty& property) { return property.is_list; });
+            if(fixed) {
+                size_t stride = 0;
+                std::vector<std::pair<size_t, int>> used;  // (offset, property)
+                for(size_t k=0; k<element.properties.size(); k++) {
+                    if(slots[k] >= 0) used.emplace_back(stride, static_cast<int>(k));
+                    stride += ply_type_size(element.properties[k].type);
+                }
+                if(static_cast<size_t>(end - p) / stride < element.count)
+                    Throw(truncated);
+                const bool swap = needs_swap(format);
+                for(size_t i=0; i<element.count; i++, p += stride)
+                    for(const auto& [offset, k] : used)
+                        store(i, slots[k], load_ply_binary(p + offset, element.properties[k].type, swap));
+                continue;
+            }
+            for(size_t i=0; i<element.count; i++) {
+                for(size_t k=0; k<element.properties.size(); k++) {
+                    const int slot = slots[k];
+                    if(slot < 0) {
+                        skip_property(element.properties[k]);
+                        continue;
+                    }
+                    if(!(p = read_ply_value(p, end, element.properties[k].type, format, value)))
+                        Throw(truncated);
+                    store(i, slot, value);
+                }
+            }
+        }
+        else if(element.name == "face") {
+            int indices_property = -1;
+            for(size_t k=0; k<element.properties.size(); k++) {
+                const PlyProperty& property = element.properties[k];
+                if(property.is_list && (property.name == "vertex_indices" || property.name == "vertex_index"))
+                    indices_property = static_cast<int>(k);
+            }
+            Assert(indices_property >= 0, "The faces of PLY file '"+filename+"' have no vertex indices\n");
+
+            faces.reserve(element.count);
+            std::vector<int> polygon;
+            auto add_polygon = [&]() {
+                if(polygon.size() < 3)
+                    Throw("A face of PLY file '"+filename+"' has less than 3 vertices\n");
+                // Triangulate as a fan, which is exact for convex polygons.
+                for(size_t j=1; j+1<polygon.size(); j++)
+                    faces.emplace_back(polygon[0], polygon[j], polygon[j+1]);
+            };
+
+            // Binary faces whose other properties are scalars only vary in the length of the index list.
+            const bool fixed = format != PlyFormat::Ascii &&
+                std::all_of(element.properties.begin(), element.properties.end(), [&](const PlyProperty& property) {
+                    return !property.is_list || &property == &element.properties[indices_property];
+                });
+            if(fixed) {
+                size_t before = 0, after = 0;
+                for(int k=0; k<static_cast<int>(element.properties.size()); k++)
+                    if(k != indices_property)
+                        (k < indices_property ? before : after) += ply_type_size(element.properties[k].type);
+                const PlyType count_type = element.properties[indices_property].count_type;
+                const PlyType index_type = element.properties[indices_property].type;
+                const size_t count_size = ply_type_size(count_type);
+                const size_t index_size = ply_type_size(index_type);
+                const bool swap = needs_swap(format);
+                for(size_t i=0; i<element.count; i++) {
+                    if(static_cast<size_t>(end - p) < before + count_size)
+                        Throw(truncated);
+                    p += before;
+                    const double count = load_ply_binary(p, count_type, swap);
+                    p += count_size;
+                    polygon.resize(static_cast<size_t>(std::max(count, 0.0)));
+                    if(static_cast<size_t>(end - p) < polygon.size() * index_size + after)
+                        Throw(truncated);
+                    for(int& index : polygon) {
+                        index = static_cast<int>(load_ply_binary(p, index_type, swap));
+                        p += index_size;
+                    }
+                    p += after;
+                    add_polygon();
+                }
+                continue;
+            }
+            for(size_t i=0; i<element.count; i++) {
+                for(int k=0; k<static_cast<int>(element.properties.size()); k++) {
+                    const PlyProperty& property = element.properties[k];
+                    if(k != indices_property) {
+                        skip_property(property);
+                        continue;
+                    }
+                    if(!(p = read_ply_value(p, end, property.count_type, format, value)))
+                        Throw(truncated);
+                    polygon.resize(static_cast<size_t>(std::max(value, 0.0)));
+                    for(int& index : polygon) {
+                        if(!(p = read_ply_value(p, end, property.type, format, value)))
+                            Throw(truncated);
+                        index = static_cast<int>(value);
+                    }
+                    add_polygon();
+                }
+            }
+        }
+        else {
+            for(size_t i=0; i<element.count; i++)
+                for(const PlyProperty& property : element.properties)
+                    skip_property(property);
+        }
+    }
+
+    const int num_vertices = static_cast<int>(vertices.size());
+    for(const int3& face : faces)
+        for(int j=0; j<3; j++)
+            if(face[j] < 0 || face[j] >= num_vertices)
+                Throw("An index of PLY file '"+filename+"' is out of range\n");
+    Assert(!faces.empty(), "The PLY file '"+filename+"' has no faces\n");
+
+    const double seconds = omp_get_wtime() - start;
+    Message("PLY '", filename, "': ", vertices.size(), " vertices, ", faces.size(), " triangles in ",
+            seconds, " s (", file.size() / (seconds * 1e6), " MB/s)");
+}
+
+// ----------------------------------------------------------------------------
+void loadPlyHapply(
+    const std::string& filename,
+    std::vector<float3>& vertices,
+    std::vector<int3>& faces
+)
+{
+    happly::PLYData plyIn(filename);
+    try {
+        plyIn.validate();
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        Throw("The error occured while loading the PLY file");
+    }
+
+    // Load vertices from happly
+    std::vector<std::array<double, 3>> src_vertices = plyIn.getVertexPositions();
+    std::transform(src_vertices.begin(), src_vertices.end(), std::back_inserter(vertices),
+        [](const std::array<double, 3>& v) { return float3(v[0], v[1], v[2]); });
+    
+    // Load faces from happly
+    std::vector<std::vector<size_t>> src_faces = plyIn.getFaceIndices();
+    std::transform(src_faces.begin(), src_faces.end(), std::back_inserter(faces),
+        [](const std::vector<size_t>& f) { return int3(f[0], f[1], f[2]); });
+}
+
+// ----------------------------------------------------------------------------
+void benchmarkPly(const std::string& filename, int n_runs) {
+    std::vector<float3> vertices, normals, ref_vertices;
+    std::vector<int3> faces, ref_faces;
+    std::vector<float2> texcoords;
+    double best = infinity, best_ref = infinity;
+    for(int i=0; i<n_runs; i++) {
+        vertices.clear(); normals.clear(); faces.clear(); texcoords.clear();
+        double start = omp_get_wtime();
+        loadPly(filename, vertices, normals, faces, texcoords);
+        best = std::min(best, omp_get_wtime() - start);
+
+        ref_vertices.clear(); ref_faces.clear();
+        start = omp_get_wtime();
+        loadPlyHapply(filename, ref_vertices, ref_faces);
+        best_ref = std::min(best_ref, omp_get_wtime() - start);
+    }
+
+    // Only triangle meshes are compared, since happly leaves polygons untriangulated.
+    bool same = vertices.size() == ref_vertices.size() && faces.size() == ref_faces.size();
+    for(size_t i=0; same && i<vertices.size(); i++)
+        same = vertices[i].x == ref_vertices[i].x && vertices[i].y == ref_vertices[i].y && vertices[i].z == ref_vertices[i].z;
+    for(size_t i=0; same && i<faces.size(); i++)
+        same = faces[i][0] == ref_faces[i][0] && faces[i][1] == ref_faces[i][1] && faces[i][2] == ref_faces[i][2];
+
+    Message("PLY benchmark '", filename, "' (best of ", n_runs, "): streaming ", best * 1e3, " ms, happly ",
+            best_ref * 1e3, " ms (", best_ref / best, "x), normals: ", normals.size(), ", texcoords: ", texcoords.size(),
+            ", same mesh: ", same ? "yes" : "no");
+}
+
+}
@@ -1,148 +1,60 @@
 #pragma once 
 
 #include "vec.h"
-#include "../ext/happly/happly.h"
-#include <algorithm>
+#include <vector>
 
 namespace mypt {
 
 /** 
  * \brief Loading OBJ file.
+ * The file is memory-mapped and split into chunks on line boundaries, which are parsed 
+ * in parallel and concatenated. Corners whose texcoord/normal indices differ from the 
+ * position index get vertices of their own, and polygons are triangulated as fans.
+ * Without normals in the file, such vertices get the normal averaged around their position,
+ * so that smooth shading has no seams along texture seams.
  */
 void loadObj(
     const std::string& filename,
-    std::vector<vec3>& vertices, 
-    std::vector<vec3>& normals, 
+    std::vector<float3>& vertices, 
+    std::vector<float3>& normals, 
     std::vector<int3>& faces,
-    std::vector<vec2>& texcoords) 
-{
-    std::ifstream ifs(filename, std::ios::in);
-    Assert(ifs.is_open(), "The OBJ file '"+filename+"' is not found");
-    while (!ifs.eof()) {
-        std::string line;
-        if (!std::getline(ifs, line))
-            break;
+    std::vector<float2>& texcoords);
 
-        // creae string stream
-        std::istringstream iss(line);
-        std::string header;
-        iss >> header;
-
-        // vertex --------------------------------------
-        if (header == "v")
-        {
-            float x, y, z;
-            iss >> x >> y >> z;
-            vertices.emplace_back(x, y, z);
-        }
-        else if (header == "f")
-        {
-            // temporal vector to store face information
-            std::vector<int> temp_vert_faces;
-            std::vector<int> temp_norm_faces;
-
-            // Future work -----------------------------------
-            /*std::vector<int> temp_tex_faces;
-            std::vector<int> temp_norm_faces;*/
-            // ------------------------------------------------ 
-            for (std::string buffer; iss >> buffer;)
-            {
-                int vert_idx, tex_idx, norm_idx;
-                if (sscanf(buffer.c_str(), "%d/%d/%d", &vert_idx, &tex_idx, &norm_idx) == 3)
-                {
-                    // Input - index(vertex)/index(texture)/index(normal)
-                    temp_vert_faces.emplace_back(vert_idx - 1);
-                    // temp_tex_faces.emplace_back(tex_idx - 1);
-                    temp_norm_faces.emplace_back(norm_idx - 1);
-                }
-                else if (sscanf(buffer.c_str(), "%d//%d", &vert_idx, &norm_idx) == 2)
-                {
-                    // Input - index(vertex)//index(normal)
-                    temp_vert_faces.emplace_back(vert_idx - 1);
-                    temp_norm_faces.emplace_back(norm_idx - 1);
-                }
-                else if (sscanf(buffer.c_str(), "%d/%d", &vert_idx, &tex_idx) == 2)
-                {
-                    // Input - index(vertex)/index(texture)
-                    temp_vert_faces.emplace_back(vert_idx - 1);
-                    //temp_tex_faces.emplace_back(tex_idx - 1);
-                }
-                else if (sscanf(buffer.c_str(), "%d", &vert_idx) == 1)
-                {
-                    // Input - index(vertex)
-                    temp_vert_faces.emplace_back(vert_idx - 1);
-                }
-                else
-                    Throw("Invalid format in face information input.\n");
-            }
-
-            Assert(temp_vert_faces.size() >= 3, "The number of faces is less than 3.\n");
-
-            if (temp_vert_faces.size() == 3) {
-                int3 face;
-                face[0] = temp_vert_faces[0];
-                face[1] = temp_vert_faces[1];
-                face[2] = temp_vert_faces[2];
-                faces.emplace_back(face);
-            }
-
-            /** NOTE: Get more then 4 inputs.
-             * This case is implemented under the assumption that mesh are configurd 
-             * by quad and inputs are partitioned with 4 stride when face input are 
-             * more than 4. */
-            else
-            {
-                for (int i = 0; i<int(temp_vert_faces.size() / 4); i++)
-                {
-                    // The index value of 0th vertex in quad
-                    auto base_idx = i * 4;
-                    int3 face1;
-                    face1[0] = temp_vert_faces[base_idx + 0];
-                    face1[1] = temp_vert_faces[base_idx + 1];
-                    face1[2] = temp_vert_faces[base_idx + 2];
-                    faces.emplace_back(face1);
-                    int3 face2;
-                    face2[0] = temp_vert_faces[base_idx + 2];
-                    face2[1] = temp_vert_faces[base_idx + 3];
-                    face2[2] = temp_vert_faces[base_idx + 0];
-                    faces.emplace_back(face2);
-                }
-            }
-        }
-    }
-    ifs.close();
-}
+/** 
+ * \brief Normals of `vertices` averaged from the normals of the faces around them, 
+ * for smooth shading of meshes without normals. Vertices of no face get zero normals.
+ */
+void computeSmoothNormals(
+    const std::vector<float3>& vertices,
+    const std::vector<int3>& faces,
+    std::vector<float3>& normals);
 
 /** 
  * \brief Loading PLY file.
+ * ASCII and binary (little/big endian) elements are streamed from the memory-mapped file 
+ * into the output buffers. Vertex normals (nx, ny, nz) and texcoords (u, v or s, t) are 
+ * loaded when present, and polygons are triangulated as fans.
  */
 void loadPly(
     const std::string& filename,
-    std::vector<vec3>& vertices,
-    std::vector<vec3>& normals, 
+    std::vector<float3>& vertices,
+    std::vector<float3>& normals, 
     std::vector<int3>& faces, 
-    std::vector<vec2>& texcoords
-)
-{
-    happly::PLYData plyIn(filename);
-    try {
-        plyIn.validate();
-    } catch (const std::exception& e) {
-        std::cerr << e.what() << std::endl;
-        Throw("The error occured while loading the PLY file");
-    }
+    std::vector<float2>& texcoords
+);
 
-    // Load vertices from happly
-    std::vector<std::array<double, 3>> src_vertices = plyIn.getVertexPositions();
-    std::transform(src_vertices.begin(), src_vertices.end(), std::back_inserter(vertices),
-        [](const std::array<double, 3>& v) { return vec3(v[0], v[1], v[2]); });
-    
-    // Load faces from happly
-    std::vector<std::vector<size_t>> src_faces = plyIn.getFaceIndices();
-    std::transform(src_faces.begin(), src_faces.end(), std::back_inserter(faces),
-        [](const std::vector<size_t>& f) { return int3(f[0], f[1], f[2]); });
+/** 
+ * \brief Loading PLY file through happly, as before `loadPly` streamed the file.
+ * Only positions and triangles are loaded. It is kept as the reference for `benchmarkPly`.
+ */
+void loadPlyHapply(
+    const std::string& filename,
+    std::vector<float3>& vertices,
+    std::vector<int3>& faces
+);
 
-    
-}
+/** \brief Compare load times of `loadPly` and `loadPlyHapply` (best of `n_runs`), 
+ *  and check that both give the same positions and triangles (`mypt --bench-ply`). */
+void benchmarkPly(const std::string& filename, int n_runs = 5);
 
 }
\ No newline at end of file
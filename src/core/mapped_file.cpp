@@ -0,0 +1,37 @@
+#include "mapped_file.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace mypt {
+
+MappedFile::MappedFile(const std::string& filename) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    Assert(fd >= 0, "The file '"+filename+"' is not found\n");
+
+    struct stat st;
+    if(fstat(fd, &st) != 0) {
+        close(fd);
+        Throw("Failed to stat the file '"+filename+"'\n");
+    }
+    length = static_cast<size_t>(st.st_size);
+    if(length > 0) {
+        void* p = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(p == MAP_FAILED) {
+            close(fd);
+            Throw("Failed to map the file '"+filename+"'\n");
+        }
+        madvise(p, length, MADV_WILLNEED);
+        ptr = static_cast<const char*>(p);
+    }
+    // The mapping stays valid after the descriptor is closed.
+    close(fd);
+}
+
+MappedFile::~MappedFile() {
+    if(ptr)
+        munmap(const_cast<char*>(ptr), length);
+}
+
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "util.h"
+
+namespace mypt {
+
+/** \brief Read-only memory map of a whole file, which is unmapped on destruction.
+ *  Pages are loaded by the OS on first access, so parsers can read the file
+ *  from many threads without copying it into a buffer. */
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& filename);
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data() const { return ptr; }
+    size_t size() const { return length; }
+    const char* begin() const { return ptr; }
+    const char* end() const { return ptr + length; }
+private:
+    const char* ptr = nullptr;
+    size_t length = 0;
+};
+
+}
@@ -7,6 +7,7 @@ namespace mypt {
 
 class Material;
 class PDF;
+class Primitive;
 
 /** MEMO: 
  *  Should SurfaceInteraction store the derivatives on texture coordinates? */
@@ -21,6 +22,8 @@ struct SurfaceInteraction {
     bool front_face;
     std::shared_ptr<Material> mat_ptr;
     std::shared_ptr<PDF> pdf_ptr;
+    const Primitive* prim = nullptr;    // Primitive hit by the ray, which identifies the light found by BSDF sampling
+    int face = -1;                      // Face of a mesh primitive hit by the ray
 
     inline void set_face_normal(const Ray& r, const vec3& outward_normal) {
         front_face = dot(r.direction(), outward_normal) < 0;
@@ -67,6 +70,9 @@ public:
         return vec3(0, 0, 0);
     }
 
+    // Average luminance of `emitted()`, which weights lights in light sampling.
+    virtual Float emitted_luminance() const { return 0.0; }
+
     virtual bool scatter (
         const Ray& /* r_in */, SurfaceInteraction& /* si */
     ) const {
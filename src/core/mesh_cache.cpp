@@ -0,0 +1,165 @@
+#include "mesh_cache.h"
+#include <cstdio>
+#include <cstring>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace mypt {
+
+constexpr char MeshCacheHeader::magic_value[8];
+
+// Arrays are mapped as they are, so their elements must be tightly packed.
+static_assert(sizeof(float3) == 12 && sizeof(float2) == 8 && sizeof(int3) == 12, "Unexpected padding of mesh attributes");
+
+// ----------------------------------------------------------------------------
+static bool stat_source(const std::string& source, uint64_t& size, int64_t& mtime) {
+    struct stat st;
+    if(stat(source.c_str(), &st) != 0)
+        return false;
+    size = static_cast<uint64_t>(st.st_size);
+    mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    return true;
+}
+
+// FNV-1a over 8-byte words, which is enough to tell a copied asset from an edited one.
+static uint64_t hash_source(const std::string& source) {
+    MappedFile file(source);
+    uint64_t hash = 14695981039346656037ull;
+    const size_t num_words = file.size() / sizeof(uint64_t);
+    for(size_t i=0; i<num_words; i++) {
+        uint64_t word;
+        std::memcpy(&word, file.data() + i * sizeof(uint64_t), sizeof(uint64_t));
+        hash = (hash ^ word) * 1099511628211ull;
+    }
+    for(size_t i=num_words * sizeof(uint64_t); i<file.size(); i++)
+        hash = (hash ^ static_cast<unsigned char>(file.data()[i])) * 1099511628211ull;
+    return hash;
+}
+
+static uint64_t align_offset(uint64_t offset) {
+    const uint64_t a = MeshCacheHeader::alignment;
+    return (offset + a - 1) / a * a;
+}
+
+std::string mesh_cache_path(const std::string& source) {
+    return source + ".mptmesh";
+}
+
+// ----------------------------------------------------------------------------
+bool read_mesh_cache(const std::string& source, MeshCacheData& data) {
+    const std::string path = mesh_cache_path(source);
+    uint64_t source_size;
+    int64_t source_mtime;
+    if(access(path.c_str(), R_OK) != 0 || !stat_source(source, source_size, source_mtime))
+        return false;
+
+    auto file = std::make_shared<MappedFile>(path);
+    MeshCacheHeader header;
+    if(file->size() < sizeof(header))
+        return false;
+    std::memcpy(&header, file->data(), sizeof(header));
+    if(std::memcmp(header.magic, MeshCacheHeader::magic_value, sizeof(header.magic)) != 0 ||
+       header.version != MeshCacheHeader::current_version ||
+       header.byte_order != MeshCacheHeader::byte_order_mark)
+        return false;
+
+    // Arrays must lie in the file at aligned offsets.
+    auto in_file = [&](uint64_t offset, uint64_t count, size_t element_size) {
+        return offset % MeshCacheHeader::alignment == 0 && offset <= file->size()
+            && count <= (file->size() - offset) / element_size;
+    };
+    if(!in_file(header.vertices_offset, header.num_vertices, sizeof(float3)) ||
+       !in_file(header.normals_offset, header.num_normals, sizeof(float3)) ||
+       !in_file(header.texcoords_offset, header.num_texcoords, sizeof(float2)) ||
+       !in_file(header.faces_offset, header.num_faces, sizeof(int3)))
+        return false;
+
+    if(header.source_size != source_size)
+        return false;
+    const bool same_mtime = header.source_mtime == source_mtime;
+    if(!same_mtime && header.source_hash != hash_source(source))
+        return false;
+
+    // Faces index vertices, normals and texcoords alike, so a cache whose arrays disagree 
+    // with its counts (e.g. corrupted on copy) is rejected instead of read out of bounds.
+    if((header.num_normals != 0 && header.num_normals != header.num_vertices) ||
+       (header.num_texcoords != 0 && header.num_texcoords != header.num_vertices))
+        return false;
+    const char* base = file->data();
+    const int3* faces = reinterpret_cast<const int3*>(base + header.faces_offset);
+    const int64_t num_faces = static_cast<int64_t>(header.num_faces);
+    const int64_t num_vertices = static_cast<int64_t>(header.num_vertices);
+    bool valid = true;
+    #ifdef _OPENMP
+    #pragma omp parallel for reduction(&&: valid)
+    #endif
+    for(int64_t i=0; i<num_faces; i++) {
+        for(int k=0; k<3; k++)
+            valid = valid && faces[i][k] >= 0 && faces[i][k] < num_vertices;
+    }
+    if(!valid)
+        return false;
+
+    data.vertices = MeshBuffer<float3>(reinterpret_cast<const float3*>(base + header.vertices_offset), header.num_vertices);
+    data.normals = MeshBuffer<float3>(reinterpret_cast<const float3*>(base + header.normals_offset), header.num_normals);
+    data.texcoords = MeshBuffer<float2>(reinterpret_cast<const float2*>(base + header.texcoords_offset), header.num_texcoords);
+    data.faces = MeshBuffer<int3>(faces, header.num_faces);
+    data.file = file;
+
+    // Same contents with a new time, so the new time is recorded to skip hashing on next loads.
+    // The cache is replaced as a whole, since other processes may have it mapped.
+    if(!same_mtime)
+        write_mesh_cache(source, data);
+    return true;
+}
+
+// ----------------------------------------------------------------------------
+bool write_mesh_cache(const std::string& source, const MeshCacheData& data) {
+    MeshCacheHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, MeshCacheHeader::magic_value, sizeof(header.magic));
+    header.version = MeshCacheHeader::current_version;
+    header.byte_order = MeshCacheHeader::byte_order_mark;
+    if(!stat_source(source, header.source_size, header.source_mtime)) {
+        Message("Mesh cache is not written, since '", source, "' is not found");
+        return false;
+    }
+    header.source_hash = hash_source(source);
+    header.num_vertices = data.vertices.size();
+    header.num_normals = data.normals.size();
+    header.num_texcoords = data.texcoords.size();
+    header.num_faces = data.faces.size();
+    header.vertices_offset = align_offset(sizeof(header));
+    header.normals_offset = align_offset(header.vertices_offset + header.num_vertices * sizeof(float3));
+    header.texcoords_offset = align_offset(header.normals_offset + header.num_normals * sizeof(float3));
+    header.faces_offset = align_offset(header.texcoords_offset + header.num_texcoords * sizeof(float2));
+
+    const std::string path = mesh_cache_path(source);
+    const std::string temp_path = path + ".tmp" + std::to_string(getpid());
+    std::ofstream ofs(temp_path, std::ios::binary | std::ios::trunc);
+    if(!ofs.is_open()) {
+        Message("Mesh cache is not written, since '", temp_path, "' cannot be created");
+        return false;
+    }
+    // Pads with zeros up to `offset`.
+    auto write_at = [&ofs](uint64_t offset, const void* bytes, size_t size) {
+        static const char zeros[MeshCacheHeader::alignment] = {};
+        ofs.write(zeros, static_cast<std::streamsize>(offset - static_cast<uint64_t>(ofs.tellp())));
+        ofs.write(static_cast<const char*>(bytes), static_cast<std::streamsize>(size));
+    };
+    ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    write_at(header.vertices_offset, data.vertices.data(), data.vertices.size() * sizeof(float3));
+    write_at(header.normals_offset, data.normals.data(), data.normals.size() * sizeof(float3));
+    write_at(header.texcoords_offset, data.texcoords.data(), data.texcoords.size() * sizeof(float2));
+    write_at(header.faces_offset, data.faces.data(), data.faces.size() * sizeof(int3));
+    ofs.close();
+
+    if(ofs.fail() || std::rename(temp_path.c_str(), path.c_str()) != 0) {
+        std::remove(temp_path.c_str());
+        Message("Failed to write mesh cache '", path, "'");
+        return false;
+    }
+    return true;
+}
+
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include "vec.h"
+#include "mapped_file.h"
+#include <cstdint>
+#include <vector>
+
+namespace mypt {
+
+/** \brief Array of mesh attributes, which either owns its elements or views a memory-mapped
+ *  mesh cache. Views are kept valid by the mapping stored alongside them in the mesh. */
+template <typename T>
+class MeshBuffer {
+public:
+    MeshBuffer() = default;
+    MeshBuffer(std::vector<T>&& values) : owned(std::move(values)), ptr(owned.data()), count(owned.size()) {}
+    MeshBuffer(const T* ptr, size_t count) : ptr(ptr), count(count) {}
+    // Moving the vector keeps its storage, so `ptr` stays valid.
+    MeshBuffer(MeshBuffer&&) = default;
+    MeshBuffer& operator=(MeshBuffer&&) = default;
+    MeshBuffer(const MeshBuffer&) = delete;
+    MeshBuffer& operator=(const MeshBuffer&) = delete;
+
+    const T& operator[](size_t i) const { return ptr[i]; }
+    const T* data() const { return ptr; }
+    const T* begin() const { return ptr; }
+    const T* end() const { return ptr + count; }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+private:
+    std::vector<T> owned;
+    const T* ptr = nullptr;
+    size_t count = 0;
+};
+
+/**
+ * \brief Binary cache of a mesh asset, written next to it as `<asset>.mptmesh`.
+ * Arrays of positions, normals, texcoords and faces are aligned to 64 bytes after the
+ * header, so that the mapped file is used as the buffers of the mesh without copies.
+ * The cache is valid for the asset of the recorded size and modification time, or, when
+ * only the time differs (e.g. after copying assets to another node), of the same hash.
+ */
+struct MeshCacheHeader {
+    static constexpr char magic_value[8] = { 'M', 'Y', 'P', 'T', 'M', 'S', 'H', '\0' };
+    static constexpr uint32_t current_version = 2;
+    static constexpr uint32_t byte_order_mark = 0x01020304;
+    static constexpr uint64_t alignment = 64;
+
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;        // Written as `byte_order_mark` in the native order
+    uint64_t source_size;
+    int64_t source_mtime;       // Nanoseconds since epoch
+    uint64_t source_hash;
+    uint64_t num_vertices, num_normals, num_texcoords, num_faces;
+    uint64_t vertices_offset, normals_offset, texcoords_offset, faces_offset;
+};
+
+/** \brief Whether a mesh is mapped from its cache (written when missing or out of date), always
+ *  parsed from the asset to rewrite the cache, or parsed without touching the cache. */
+enum class MeshCacheMode { Use, Rebuild, Off };
+
+/** \brief Buffers of a mesh as stored in or mapped from a cache. */
+struct MeshCacheData {
+    std::shared_ptr<MappedFile> file;  // Set when the buffers below view a mapped cache
+    MeshBuffer<float3> vertices;
+    MeshBuffer<float3> normals;
+    MeshBuffer<float2> texcoords;
+    MeshBuffer<int3> faces;
+};
+
+std::string mesh_cache_path(const std::string& source);
+
+/** Maps the cache of `source` into `data`, and returns false when it is missing, of another
+ *  version, out of date with the source, or indexes vertices beyond its arrays. */
+bool read_mesh_cache(const std::string& source, MeshCacheData& data);
+
+/** Writes the cache of `source` through a temporary file, which is renamed at last so that
+ *  concurrent readers never see a partial cache. Failures are reported, but not thrown. */
+bool write_mesh_cache(const std::string& source, const MeshCacheData& data);
+
+}
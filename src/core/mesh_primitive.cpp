@@ -0,0 +1,159 @@
+#include "mesh_primitive.h"
+#include "light_bvh.h"
+#include "color.h"
+
+namespace mypt {
+
+MeshPrimitive::MeshPrimitive(
+    std::shared_ptr<TriangleMesh> mesh, std::shared_ptr<Material> material,
+    std::shared_ptr<Transform> transform, const vec3& motion, const BVHBuildParams& params
+) : mesh(mesh), material(material), transform(transform), motion(motion)
+{
+    Assert(mesh->num_triangles() > 0, "Mesh has no triangles\n");
+    bvh = std::make_unique<LinearBVH>(*this, params);
+    bbox = bvh->bounding();
+    if(!motion.is_near_zero())
+        bbox = surrounding(bbox, AABB(bbox.min() + motion, bbox.max() + motion));
+
+    // Emission is estimated at the centroid of each face.
+    if(material->type() == MatType::Emitter) {
+        std::vector<Float> weights(num_triangles());
+        Float sum = 0;
+        for(int face=0; face<num_triangles(); face++) {
+            vec3 p[3];
+            world_vertices(face, p);
+            SurfaceInteraction si;
+            si.p = (p[0] + p[1] + p[2]) / 3;
+            weights[face] = 0.5 * cross(p[1] - p[0], p[2] - p[0]).length()
+                          * luminance(material->emitted(Ray(si.p, vec3(0, 0, 1)), si));
+            sum += weights[face];
+        }
+        if(sum > 0)
+            light_faces = AliasTable(weights);
+    }
+}
+
+// ----------------------------------------------------------------------------
+bool MeshPrimitive::intersect(const Ray& r, Float t_min, Float t_max, SurfaceInteraction& si) const {
+    // Triangles of the BVH are in world space at shutter open.
+    if(motion.is_near_zero())
+        return bvh->intersect(r, t_min, t_max, si);
+    if(!bvh->intersect(ray_at_shutter_open(r, motion), t_min, t_max, si))
+        return false;
+    si.p += r.time() * motion;
+    return true;
+}
+
+bool MeshPrimitive::occluded(const Ray& r, Float t_min, Float t_max) const {
+    return bvh->occluded(motion.is_near_zero() ? r : ray_at_shutter_open(r, motion), t_min, t_max);
+}
+
+void MeshPrimitive::update_bounding() {
+    bvh->update();
+    bbox = bvh->bounding();
+    if(!motion.is_near_zero())
+        bbox = surrounding(bbox, AABB(bbox.min() + motion, bbox.max() + motion));
+}
+
+bool MeshPrimitive::motion_bounding(AABB& b0, AABB& b1) const {
+    if(motion.is_near_zero())
+        return false;
+    b0 = bvh->bounding();
+    b1 = AABB(b0.min() + motion, b0.max() + motion);
+    return true;
+}
+
+// ----------------------------------------------------------------------------
+void MeshPrimitive::world_vertices(int face, vec3 p[3]) const {
+    const mat4& to_world = transform->getMatrix();
+    const int3& f = mesh->faces[face];
+    for(int i=0; i<3; i++)
+        p[i] = mat4::point_mul(to_world, mesh->vertices[f[i]]);
+}
+
+AABB MeshPrimitive::triangle_bounds(int face) const {
+    vec3 p[3];
+    world_vertices(face, p);
+    return surrounding(surrounding(AABB(p[0], p[0]), p[1]), p[2]);
+}
+
+AABB MeshPrimitive::clipped_triangle_bounds(int face, const AABB& box) const {
+    vec3 p[3];
+    world_vertices(face, p);
+    return clip_triangle(p, box);
+}
+
+void MeshPrimitive::set_hit(const Ray& r, int face, Float t, float u, float v, SurfaceInteraction& si) const {
+    si.t = t;
+    si.p = r.at(t);
+    si.set_face_normal(r, normalize(mat4::normal_mul(transform->getInvMatrix(), mesh->normal_at(mesh->faces[face], u, v))));
+    si.uv = mesh->uv_at(mesh->faces[face], u, v);
+    si.mat_ptr = material;
+    si.prim = this;
+    si.face = face;
+}
+
+// ----------------------------------------------------------------------------
+Float MeshPrimitive::pdf_value(const vec3& o, const vec3& v) const {
+    SurfaceInteraction si;
+    if(light_faces.empty() || !intersect(Ray(o, v), eps, infinity, si))
+        return 0;
+    vec3 p[3];
+    world_vertices(si.face, p);
+    // The area density pmf / area is converted into solid angle, where the area is |n| / 2.
+    const vec3 n = cross(p[1] - p[0], p[2] - p[0]);
+    const Float distance_squared = si.t * si.t * v.length_squared();
+    const Float cosine_n = fabs(dot(v, n)) / v.length();
+    return 2 * light_faces.pmf(si.face) * distance_squared / cosine_n;
+}
+
+vec3 MeshPrimitive::random(const vec3& o) const {
+    Float pmf;
+    const int face = light_faces.sample(random_float(), pmf);
+    vec3 p[3];
+    world_vertices(face, p);
+    return random_in_triangle(p) - o;
+}
+
+/** Emission is bounded by the union of the two-sided normal cones of emitting faces. */
+bool MeshPrimitive::light_bounds(LightBounds& lb) const {
+    if(material->type() != MatType::Emitter)
+        return false;
+    lb = LightBounds();
+    for(int face=0; face<static_cast<int>(light_faces.size()); face++) {
+        if(light_faces.pmf(face) <= 0)
+            continue;
+        vec3 p[3];
+        world_vertices(face, p);
+        LightBounds f;
+        f.bounds = triangle_bounds(face);
+        f.w = normalize(cross(p[1] - p[0], p[2] - p[0]));
+        f.phi = 2 * pi * light_faces.total() * light_faces.pmf(face);
+        f.cos_theta_o = 1;
+        f.cos_theta_e = 0;
+        f.two_sided = true;
+        lb = union_bounds(lb, f);
+    }
+    return true;
+}
+
+// ----------------------------------------------------------------------------
+void MeshPrimitive::report_memory(const std::string& name) const {
+    const Float n = num_triangles();
+    const Float mesh_bytes = mesh->memory_bytes() / n;
+    const Float node_bytes = bvh->node_bytes() / n;
+    const Float leaf_bytes = (bvh->block_bytes() + bvh->num_references() * sizeof(int)) / n;
+
+    /** Separate primitives keep vertices and normals in double precision, and per face
+     *  a Triangle and a ShapePrimitive (each with a shared_ptr control block) referred to
+     *  from the shape list, the scene and the BVH. Nodes and blocks are about the same. */
+    const Float per_face = sizeof(Triangle) + sizeof(ShapePrimitive) + 2 * 2 * sizeof(void*)
+                         + 3 * sizeof(std::shared_ptr<Primitive>);
+    const Float separate_mesh_bytes = (mesh->vertices.size() * sizeof(vec3) + mesh->normals.size() * sizeof(vec3)
+                                     + mesh->faces.size() * sizeof(int3)) / n;
+    Message("MESH '", name, "': ", num_triangles(), " triangles, ", mesh_bytes + node_bytes + leaf_bytes,
+            " bytes/triangle (buffers: ", mesh_bytes, ", BVH nodes: ", node_bytes, ", leaf blocks: ", leaf_bytes,
+            "), as separate primitives: ", separate_mesh_bytes + per_face + node_bytes + leaf_bytes, " bytes/triangle");
+}
+
+}
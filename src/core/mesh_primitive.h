@@ -0,0 +1,69 @@
+#pragma once
+
+#include "bvh.h"
+#include "alias_table.h"
+#include "../shape/triangle.h"
+
+namespace mypt {
+
+/** \brief All triangles of a mesh as one primitive.
+ *  Triangles are referred to by face index into the flat buffers of TriangleMesh, and
+ *  are traced with an own LinearBVH over them, instead of a Triangle and a ShapePrimitive
+ *  on the heap for every face. A mesh of an Emitter material is also a single area light,
+ *  which samples its faces by area times emitted luminance from an alias table. */
+class MeshPrimitive final : public Primitive {
+public:
+    /** `motion` is the world-space translation from shutter open to close for motion blur. */
+    MeshPrimitive(std::shared_ptr<TriangleMesh> mesh, std::shared_ptr<Material> material,
+                  std::shared_ptr<Transform> transform, const vec3& motion = vec3(0.0),
+                  const BVHBuildParams& params = BVHBuildParams());
+    // The BVH refers back to this mesh.
+    MeshPrimitive(const MeshPrimitive&) = delete;
+    MeshPrimitive& operator=(const MeshPrimitive&) = delete;
+
+    bool intersect(const Ray& r, Float t_min, Float t_max, SurfaceInteraction& si) const override;
+    bool occluded(const Ray& r, Float t_min, Float t_max) const override;
+    AABB bounding() const override { return bbox; }
+    // Refit (or rebuild) the BVH after the transform has been changed.
+    void update_bounding() override;
+    bool motion_bounding(AABB& b0, AABB& b1) const override;
+
+    // Lights are sampled at shutter open.
+    Float pdf_value(const vec3& o, const vec3& v) const override;
+    vec3 random(const vec3& o) const override;
+    bool light_bounds(LightBounds& lb) const override;
+
+    PrimitiveType type() const override { return PrimitiveType::Mesh; }
+
+    int num_triangles() const { return mesh->num_triangles(); }
+    void world_vertices(int face, vec3 p[3]) const;
+    AABB triangle_bounds(int face) const;
+    AABB clipped_triangle_bounds(int face, const AABB& box) const;
+    // Fill the hit of `face` at distance `t` and barycentric coordinates (u, v) along `r`.
+    void set_hit(const Ray& r, int face, Float t, float u, float v, SurfaceInteraction& si) const;
+
+    const std::shared_ptr<TriangleMesh>& getMesh() const { return mesh; }
+    const LinearBVH& getBVH() const { return *bvh; }
+
+    // Bytes per triangle of mesh buffers and BVH, compared with a Triangle and ShapePrimitive per face.
+    void report_memory(const std::string& name) const;
+
+    std::string to_string() const override {
+        std::ostringstream oss;
+        oss << "MeshPrimitive : {" << std::endl;
+        oss << "\tTriangles : " << num_triangles() << "," << std::endl;
+        oss << "\tMaterial : " << material->to_string() << std::endl;
+        oss << "}";
+        return oss.str();
+    }
+private:
+    std::shared_ptr<TriangleMesh> mesh;
+    std::shared_ptr<Material> material;
+    std::shared_ptr<Transform> transform;
+    vec3 motion;
+    std::unique_ptr<LinearBVH> bvh;
+    AABB bbox;
+    AliasTable light_faces;     // Empty unless the mesh emits
+};
+
+}
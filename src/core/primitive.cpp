@@ -1,4 +1,6 @@
 #include "primitive.h"
+#include "light_bvh.h"
+#include "stats.h"
 
 /** NOTE: 
  * The ray origins must be inside the volume, so we have to carefully
@@ -13,64 +15,152 @@
 namespace mypt {
 
 ShapePrimitive::ShapePrimitive(
-    std::shared_ptr<Shape> shape, std::shared_ptr<Material> material, std::shared_ptr<Transform> transform
-) : shape(shape), material(material), transform(transform)
+    std::shared_ptr<Shape> shape, std::shared_ptr<Material> material, std::shared_ptr<Transform> transform,
+    const vec3& motion
+) : shape(shape), material(material), transform(transform), motion(motion)
 {
-    vec3 min(infinity, infinity, infinity);
-    vec3 max(-infinity, -infinity, -infinity);
-
-    for(int i=0; i<2; i++) {            // 0: min.x, 1: max.x
-        for(int j=0; j<2; j++) {        // 0: min.y, 1: max.y
-            for(int k=0; k<2; k++) {    // 0: min.z, 1: max.z
-                auto x = (1-i)*shape->bounding().min().x + i*shape->bounding().max().x;
-                auto y = (1-j)*shape->bounding().min().y + j*shape->bounding().max().y;
-                auto z = (1-k)*shape->bounding().min().z + k*shape->bounding().max().z;
-                
-                vec3 tr_corner = mat4::point_mul(transform->getMatrix(), vec3(x, y, z));
-                for(int l=0; l<3; l++) {
-                    min[l] = fmin(min[l], tr_corner[l]);
-                    max[l] = fmax(max[l], tr_corner[l]);
-                }
-            } 
-        }
-    }
-
-    bbox = AABB(min, max);
+    AABB b0, b1;
+    is_moving = motion_bounding(b0, b1);
+    update_bounding();
 }
 
 // ShapePrimitive ----------------------------------------------------------------------
 bool ShapePrimitive::intersect(const Ray& r, Float t_min, Float t_max, SurfaceInteraction& si) const {
     // Transform ray from world to local coordinates of shape.
-    Ray tr_ray = *transform * r;
+    Ray tr_ray = *transform * (motion.is_near_zero() ? r : ray_at_shutter_open(r, motion));
+    STAT_ADD(prim_tests, 1);
     if (!shape->intersect(tr_ray, t_min, t_max, si))
         return false;
+    STAT_ADD(hits, 1);
     
     auto p = si.p;
     auto n = si.n;
     
     // Transform intersection information from local to world coordinates.
-    p = mat4::point_mul(transform->getMatrix(), si.p);
+    p = mat4::point_mul(transform->getMatrix(), si.p) + r.time() * motion;
     n = normalize(mat4::normal_mul(transform->getInvMatrix(), si.n));
 
     si.p = p;
     si.n = n;
     si.mat_ptr = material;
+    si.prim = this;
 
     return true;
 }
 
+bool ShapePrimitive::occluded(const Ray& r, Float t_min, Float t_max) const {
+    STAT_ADD(prim_tests, 1);
+    bool hit = shape->occluded(*transform * (motion.is_near_zero() ? r : ray_at_shutter_open(r, motion)), t_min, t_max);
+    STAT_ADD(hits, hit);
+    return hit;
+}
+
 AABB ShapePrimitive::bounding() const {
     return bbox;
 }
 
+void ShapePrimitive::update_bounding() {
+    AABB b0, b1;
+    bbox = motion_bounding(b0, b1) ? surrounding(b0, b1) : transform_bounds(shape->bounding(), transform->getMatrix());
+}
+
+bool ShapePrimitive::motion_bounding(AABB& b0, AABB& b1) const {
+    AABB s0, s1;
+    bool moving_shape = shape->motion_bounding(s0, s1);
+    if(!moving_shape && motion.is_near_zero()) 
+        return false;
+    if(!moving_shape) 
+        s0 = s1 = shape->bounding();
+    b0 = transform_bounds(s0, transform->getMatrix());
+    b1 = transform_bounds(s1, transform->getMatrix());
+    b1 = AABB(b1.min() + motion, b1.max() + motion);
+    return true;
+}
+
 Float ShapePrimitive::pdf_value(const vec3& o, const vec3& v) const {
     vec3 origin = mat4::point_mul(transform->getInvMatrix(), o);
     vec3 vec = mat4::vector_mul(transform->getInvMatrix(), v);
     return shape->pdf_value(origin, vec);
 }
 
+AABB ShapePrimitive::clipped_bounding(const AABB& box) const {
+    if(is_moving)
+        return intersection(bbox, box);
+    return shape->clipped_bounding(box, transform->getMatrix());
+}
+
 vec3 ShapePrimitive::random(const vec3& o) const {
-    return mat4::point_mul(transform->getMatrix(), shape->random(o));
+    vec3 origin = mat4::point_mul(transform->getInvMatrix(), o);
+    return mat4::vector_mul(transform->getMatrix(), shape->random(origin));
+}
+
+// Ratio of volumes scaled by the linear part of `m`.
+static Float linear_determinant(const mat4& m) {
+    const auto& a = m.mat;
+    return a[0][0] * (a[1][1]*a[2][2] - a[1][2]*a[2][1])
+         - a[0][1] * (a[1][0]*a[2][2] - a[1][2]*a[2][0])
+         + a[0][2] * (a[1][0]*a[2][1] - a[1][1]*a[2][0]);
+}
+
+/** Emitters radiate from both faces, so the power is 2 * pi * area * L and flat shapes have a single
+ *  two-sided normal. Areas of curved shapes are scaled as if the transform were uniform. */
+bool ShapePrimitive::light_bounds(LightBounds& lb) const {
+    const Float det = std::abs(linear_determinant(transform->getMatrix()));
+    Float area = shape->area();
+    vec3 n;
+    if(shape->flat_normal(n)) {
+        // Cross products of edges are transformed as normals scaled by the determinant.
+        vec3 n_world = mat4::normal_mul(transform->getInvMatrix(), n);
+        area *= det * n_world.length();
+        lb.w = normalize(n_world);
+        lb.cos_theta_o = 1;
+    }
+    else {
+        area *= std::pow(det, 2.0 / 3.0);
+        lb.w = vec3(0, 0, 1);
+        lb.cos_theta_o = -1;
+    }
+    lb.bounds = bbox;
+    lb.phi = 2 * pi * area * material->emitted_luminance();
+    lb.cos_theta_e = 0;
+    lb.two_sided = true;
+    return true;
+}
+
+// Instance ----------------------------------------------------------------------------
+Instance::Instance(std::shared_ptr<Primitive> object, std::shared_ptr<Transform> transform, const vec3& motion)
+: object(object), transform(transform), motion(motion)
+{
+    update_bounding();
+}
+
+void Instance::update_bounding() {
+    bbox = transform_bounds(object->bounding(), transform->getMatrix());
+    if(!motion.is_near_zero())
+        bbox = surrounding(bbox, AABB(bbox.min() + motion, bbox.max() + motion));
+}
+
+bool Instance::motion_bounding(AABB& b0, AABB& b1) const {
+    if(motion.is_near_zero()) 
+        return false;
+    b0 = transform_bounds(object->bounding(), transform->getMatrix());
+    b1 = AABB(b0.min() + motion, b0.max() + motion);
+    return true;
+}
+
+bool Instance::intersect(const Ray& r, Float t_min, Float t_max, SurfaceInteraction& si) const {
+    // Direction is not normalized by the transform, so `t` is the same in both spaces.
+    Ray tr_ray = *transform * (motion.is_near_zero() ? r : ray_at_shutter_open(r, motion));
+    if (!object->intersect(tr_ray, t_min, t_max, si))
+        return false;
+
+    si.p = mat4::point_mul(transform->getMatrix(), si.p) + r.time() * motion;
+    si.n = normalize(mat4::normal_mul(transform->getInvMatrix(), si.n));
+    return true;
+}
+
+bool Instance::occluded(const Ray& r, Float t_min, Float t_max) const {
+    return object->occluded(*transform * (motion.is_near_zero() ? r : ray_at_shutter_open(r, motion)), t_min, t_max);
 }
 
 // ConstantMedium ----------------------------------------------------------------------
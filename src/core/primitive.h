@@ -10,11 +10,18 @@
 
 namespace mypt {
 
+struct LightBounds;
+
 enum class PrimitiveType {
     None,           // Abstract class
     ShapePrimitive,
     ConstantMedium, 
-    BVHNode
+    BVHNode,
+    LinearBVH,
+    WideBVH,
+    CompressedWideBVH,
+    Instance,
+    Mesh
 };
 
 inline std::ostream& operator<<(std::ostream& out, PrimitiveType type) {
@@ -31,43 +38,101 @@ inline std::ostream& operator<<(std::ostream& out, PrimitiveType type) {
     case PrimitiveType::BVHNode:
         return out << "PrimitiveType::BVHNode";
         break;
+    case PrimitiveType::LinearBVH:
+        return out << "PrimitiveType::LinearBVH";
+        break;
+    case PrimitiveType::WideBVH:
+        return out << "PrimitiveType::WideBVH";
+        break;
+    case PrimitiveType::CompressedWideBVH:
+        return out << "PrimitiveType::CompressedWideBVH";
+        break;
+    case PrimitiveType::Instance:
+        return out << "PrimitiveType::Instance";
+        break;
+    case PrimitiveType::Mesh:
+        return out << "PrimitiveType::Mesh";
+        break;
     default:
         Throw("This PrimitiveType doesn't exist.");
         break;
     }
+    return out;
 }
 
 // -------------------------------------------------------------------------------------
 class Primitive {
 public:
     virtual bool intersect(const Ray& r, Float t_min, Float t_max, SurfaceInteraction& si) const = 0;
+    /** \brief Any-hit query for shadow rays. It may return at the first hit found 
+     *  in [t_min, t_max] and never computes hit attributes. */
+    virtual bool occluded(const Ray& r, Float t_min, Float t_max) const {
+        SurfaceInteraction si;
+        return intersect(r, t_min, t_max, si);
+    }
+    /** \brief Intersect `n_rays` rays at once, `hits[i]` and `si[i]` receive the result of `rays[i]`.
+     *  Acceleration structures may trace coherent rays (e.g. a tile of camera rays) together as packets. */
+    virtual void intersect_batch(const Ray* rays, int n_rays, Float t_min, Float t_max, 
+                                 SurfaceInteraction* si, bool* hits) const {
+        for(int i=0; i<n_rays; i++)
+            hits[i] = intersect(rays[i], t_min, t_max, si[i]);
+    }
     virtual AABB bounding() const = 0;
+    /** \brief Recompute cached bounds after the transform has been changed (e.g. for the next frame). */
+    virtual void update_bounding() {}
+    /** \brief Bounds at shutter open (time 0) and close (time 1), which enclose the primitive 
+     *  at any time in between by linear interpolation. Returns false for static primitives. */
+    virtual bool motion_bounding(AABB& /* b0 */, AABB& /* b1 */) const { return false; }
+    // Bounds of the part of primitive inside `box`, which is used for spatial splits of BVH.
+    virtual AABB clipped_bounding(const AABB& box) const { return intersection(bounding(), box); }
 
     // Compute pdf value of primitive
     virtual Float pdf_value(const vec3& /* o */, const vec3& /* v */) const { return 0.0; }
-    // Compute outward direction at origin o
+    // Vector from origin o to a point sampled on the primitive
     virtual vec3 random(const vec3& /* o */) const { return vec3(1, 0, 0); }
+    /** \brief Bounds of the emitted power in space and direction, which are used to build the light BVH.
+     *  Returns false if the primitive cannot be sampled as a light. */
+    virtual bool light_bounds(LightBounds& /* lb */) const { return false; }
 
     virtual PrimitiveType type() const = 0;
 
     virtual std::string to_string() const = 0;
 };
 
+// -------------------------------------------------------------------------------------
+/** Ray relative to a primitive which moves by `motion` over the shutter, i.e. the ray seen 
+ *  by the primitive at its shutter-open position. Ray time is in [0, 1]. */
+inline Ray ray_at_shutter_open(const Ray& r, const vec3& motion) {
+    return Ray(r.origin() - r.time() * motion, r.direction(), r.time());
+}
+
 // -------------------------------------------------------------------------------------
 /** \brief ShapePrimitive class store a shape, material, and transform informations.
  *  In intersection test, stored transformation is applied to incident rays. */
 class ShapePrimitive final : public Primitive {
 public:
-    ShapePrimitive(std::shared_ptr<Shape> shape, std::shared_ptr<Material> material, std::shared_ptr<Transform> transform);
+    /** `motion` is the world-space translation from shutter open to close for motion blur. */
+    ShapePrimitive(std::shared_ptr<Shape> shape, std::shared_ptr<Material> material, std::shared_ptr<Transform> transform,
+                   const vec3& motion = vec3(0.0));
     
     bool intersect(const Ray& r, Float t_min, Float t_max, SurfaceInteraction& si) const override;
+    bool occluded(const Ray& r, Float t_min, Float t_max) const override;
     AABB bounding() const override;
+    void update_bounding() override;
+    bool motion_bounding(AABB& b0, AABB& b1) const override;
+    AABB clipped_bounding(const AABB& box) const override;
 
     Float pdf_value(const vec3& o, const vec3& v) const override;
     vec3 random(const vec3& o) const override;
+    bool light_bounds(LightBounds& lb) const override;
 
     PrimitiveType type() const override { return PrimitiveType::ShapePrimitive; }
 
+    const std::shared_ptr<Shape>& getShape() const { return shape; }
+    const std::shared_ptr<Material>& getMaterial() const { return material; }
+    const std::shared_ptr<Transform>& getTransform() const { return transform; }
+    bool isMoving() const { return is_moving; }
+
     std::string to_string() const override {
         std::ostringstream oss;
         oss << "ShapePrimitive : {" << std::endl;
@@ -80,6 +145,37 @@ private:
     std::shared_ptr<Shape> shape;
     std::shared_ptr<Material> material;
     std::shared_ptr<Transform> transform;
+    vec3 motion;
+    bool is_moving;
+    AABB bbox;
+};
+
+// -------------------------------------------------------------------------------------
+/** \brief Instance places an object, which is usually a BVH built once in object space, 
+ *  with its own transform. Many instances can share the same object. */
+class Instance final : public Primitive {
+public:
+    Instance(std::shared_ptr<Primitive> object, std::shared_ptr<Transform> transform, const vec3& motion = vec3(0.0));
+
+    bool intersect(const Ray& r, Float t_min, Float t_max, SurfaceInteraction& si) const override;
+    bool occluded(const Ray& r, Float t_min, Float t_max) const override;
+    AABB bounding() const override { return bbox; }
+    void update_bounding() override;
+    bool motion_bounding(AABB& b0, AABB& b1) const override;
+
+    PrimitiveType type() const override { return PrimitiveType::Instance; }
+
+    std::string to_string() const override {
+        std::ostringstream oss;
+        oss << "Instance : {" << std::endl;
+        oss << "\tObject : " << object->type() << std::endl;
+        oss << "}";
+        return oss.str();
+    }
+private:
+    std::shared_ptr<Primitive> object;
+    std::shared_ptr<Transform> transform;
+    vec3 motion;
     AABB bbox;
 };
 
@@ -1,5 +1,6 @@
 #include "scene.h"
 #include "color.h"
+#include "mesh_primitive.h"
 
 #include "../shape/moving_sphere.h"
 #include "../shape/plane.h"
@@ -27,9 +28,15 @@ Scene::Scene(const std::string& filename) {
 
     int image_width = 512, image_height = 512;
     depth = 5;
+    int rr_depth = 3;
     samples_per_pixel = 1;
     bool is_comment = false;
-    background = vec3(0.f);
+    envmap = std::make_shared<ConstantEnvmap>(vec3(0.f));
+    accel_type = AccelType::LINEAR;
+    n_instances = 0;
+    packet_size = 8;
+    split_meshes = false;
+    n_frames = 1;
 
     while(!ifs.eof()) {
         std::string line;
@@ -58,55 +65,38 @@ Scene::Scene(const std::string& filename) {
             iss >> samples_per_pixel;
         else if(header == "depth")
             iss >> depth;
-        else if (header == "background")
+        else if(header == "rr_depth")
+            iss >> rr_depth;
+        else if(header == "frames")
+            iss >> n_frames;
+        else if (header == "background") {
+            vec3 background;
             iss >> background.x >> background.y >> background.z;
+            envmap = std::make_shared<ConstantEnvmap>(background);
+        }
+        else if (header == "envmap")
+            parseEnvmap(iss);
+        else if (header == "accel")
+            parseAccel(iss);
         else if(header == "beginCamera")
             createCamera(ifs, Float(image_width)/image_height);
         else if(header == "beginPrimitive")
             createPrimitive(ifs);
         else if(header == "beginLight")
             createLight(ifs);
-        else if(header == "translate") {
-            float x, y, z;
-            iss >> x >> y >> z;
-            ts.translate(vec3(x, y, z));
-        }
-        else if(header == "rotate") {
-            float angle, x, y, z;
-            iss >> angle >> x >> y >> z;
-            ts.rotate(degrees_to_radians(angle), vec3(x, y, z));
-        }
-        else if(header == "rotate_x") {
-            float angle;
-            iss >> angle;
-            ts.rotateX(degrees_to_radians(angle));
-        }
-        else if(header == "rotate_y") {
-            float angle;
-            iss >> angle;
-            ts.rotateY(degrees_to_radians(angle));
-        }
-        else if(header == "rotate_z") {
-            float angle;
-            iss >> angle;
-            ts.rotateZ(degrees_to_radians(angle));
+        else if(header == "beginObject") {
+            std::string name;
+            iss >> name;
+            createObject(ifs, name);
         }
-        else if(header == "scale") {
-            std::vector<float> scale;
-            while(true) {
-                float s;
-                iss >> s;
-                if(iss.eof()) break;
-
-                scale.push_back(s);
-            }
-
-            if(scale.size() == 1) ts.scale(scale[0]);
-            else if(scale.size() == 3) ts.scale(vec3(scale[0], scale[1], scale[2]));
-            else Throw("Input value for scale was incorrect!\n");
+        else if(header == "beginInstance") {
+            std::string name;
+            iss >> name;
+            createInstance(ifs, name);
         }
+        else parseTransform(header, iss);
     }
-    integrator = Integrator();
+    integrator = Integrator(Integrator::TraceType::PATH, rr_depth);
     image.second.allocate(image_width, image_height);
 }
 
@@ -147,7 +137,8 @@ void Scene::createCamera(std::ifstream& ifs, Float aspect) {
 }
 
 // -----------------------------------------------------------------------------------------
-void Scene::createShapes(std::istringstream& iss, std::vector<std::shared_ptr<Shape>>& shapes) {
+void Scene::createShapes(std::istringstream& iss, std::vector<std::shared_ptr<Shape>>& shapes,
+                         std::vector<std::shared_ptr<TriangleMesh>>* meshes) {
     std::string type, header;
     while(!iss.eof()) {
         iss >> type;
@@ -171,6 +162,21 @@ void Scene::createShapes(std::istringstream& iss, std::vector<std::shared_ptr<Sh
             }
             shapes.emplace_back(createSphereShape(radius));   
         }
+        else if(type == "moving_sphere") {
+            // Center moves linearly from `center0` at shutter open to `center1` at shutter close.
+            Float radius = 1.0;
+            vec3 center0(0.0), center1(0.0);
+            while(!iss.eof()) {
+                iss >> header;
+                if(header == "radius")
+                    iss >> radius;
+                else if(header == "center0")
+                    iss >> center0.x >> center0.y >> center0.z;
+                else if(header == "center1")
+                    iss >> center1.x >> center1.y >> center1.z;
+            }
+            shapes.emplace_back(createMovingSphere(center0, center1, 0.0, 1.0, radius));
+        }
         else if(type == "mesh") {
             std::string filename;
             bool isSmooth = false;
@@ -182,8 +188,12 @@ void Scene::createShapes(std::istringstream& iss, std::vector<std::shared_ptr<Sh
                     isSmooth = true;
                 iss >> header;
             }
-            for(auto &triangle : createTriangleMesh(filename, isSmooth)) 
-                shapes.emplace_back(triangle);
+            auto mesh = std::make_shared<TriangleMesh>(filename, isSmooth);
+            if(meshes) 
+                meshes->emplace_back(mesh);
+            else
+                for(auto &triangle : createTriangleMesh(mesh)) 
+                    shapes.emplace_back(triangle);
         }
     }
 
@@ -274,7 +284,10 @@ auto Scene::createMaterial(std::istringstream& iss) {
 // -----------------------------------------------------------------------------------------
 void Scene::createPrimitive(std::ifstream& ifs) {
     std::vector<std::shared_ptr<Shape>> shapes;
+    std::vector<std::shared_ptr<TriangleMesh>> meshes;
     std::shared_ptr<Material> material;
+    vec3 anim_translate(0.0), anim_rotate(0.0);
+    vec3 motion(0.0);
 
     // Push back transform to independently apply transformation to primitives.
     ts.pushMatrix();
@@ -290,57 +303,36 @@ void Scene::createPrimitive(std::ifstream& ifs) {
         if(header == "endPrimitive") break;
 
         // Shape ------------------------------------
-        else if(header == "shape") this->createShapes(iss, shapes);
+        else if(header == "shape") this->createShapes(iss, shapes, split_meshes ? nullptr : &meshes);
         // Material ---------------------------------
         else if(header == "material") material = this->createMaterial(iss);
+        // Animation --------------------------------
+        else if(header == "animate") parseAnimation(iss, anim_translate, anim_rotate);
+        // Motion blur ------------------------------
+        else if(header == "motion") parseMotion(iss, motion);
         // Transformation ---------------------------
-        else if(header == "translate") {
-            float x, y, z;
-            iss >> x >> y >> z;
-            ts.translate(vec3(x, y, z));
-        }
-        else if(header == "rotate") {
-            float angle, x, y, z;
-            iss >> angle >> x >> y >> z;
-            ts.rotate(degrees_to_radians(angle), vec3(x, y, z));
-        }
-        else if(header == "rotate_x") {
-            float angle;
-            iss >> angle;
-            ts.rotateX(degrees_to_radians(angle));
-        }
-        else if(header == "rotate_y") {
-            float angle;
-            iss >> angle;
-            ts.rotateY(degrees_to_radians(angle));
-        }
-        else if(header == "rotate_z") {
-            float angle;
-            iss >> angle;
-            ts.rotateZ(degrees_to_radians(angle));
-        }
-        else if(header == "scale") {
-            std::vector<float> scale;
-            while(true) {
-                float s;
-                iss >> s;
-                if(iss.eof()) break;
-
-                scale.push_back(s);
-            }
-
-            if(scale.size() == 1) ts.scale(scale[0]);
-            else if(scale.size() == 3) ts.scale(vec3(scale[0], scale[1], scale[2]));
-            else Throw("Input value for scale was incorrect!\n");
-        }
+        else parseTransform(header, iss);
     }
 
-    Assert(!shapes.empty(), "Shape object is required to primitive\n");
+    Assert(!shapes.empty() || !meshes.empty(), "Shape object is required to primitive\n");
     if(!material) material = std::make_shared<Lambertian>(vec3(0.8f));
 
-    for(auto &shape : shapes) {
-        this->primitives.emplace_back(std::make_shared<ShapePrimitive>(
-            shape, material, std::make_shared<Transform>(ts.getCurrentTransform())));
+    // All shapes of a primitive (e.g. triangles of a mesh) share the same transform.
+    auto transform = std::make_shared<Transform>(ts.getCurrentTransform());
+    size_t first = this->primitives.size();
+    for(auto &shape : shapes)
+        this->primitives.emplace_back(std::make_shared<ShapePrimitive>(shape, material, transform, motion));
+    // Triangles of a mesh are kept in its buffers and BVH, without an object per face.
+    for(auto &mesh : meshes) {
+        auto mesh_prim = std::make_shared<MeshPrimitive>(mesh, material, transform, motion, bvh_params);
+        mesh_prim->report_memory(mesh->filename);
+        this->primitives.emplace_back(mesh_prim);
+    }
+
+    if(anim_translate != vec3(0.0) || anim_rotate != vec3(0.0)) {
+        Assert(!in_object, "animate is not supported in objects, animate instances instead\n");
+        animations.push_back({ transform, *transform, anim_translate, anim_rotate, 
+                               std::vector<std::shared_ptr<Primitive>>(this->primitives.begin() + first, this->primitives.end()) });
     }
 
     ts.popMatrix();
@@ -349,9 +341,11 @@ void Scene::createPrimitive(std::ifstream& ifs) {
 // -----------------------------------------------------------------------------------------
 void Scene::createLight(std::ifstream& ifs) {
     std::vector<std::shared_ptr<Shape>> shapes;
+    std::vector<std::shared_ptr<TriangleMesh>> meshes;
     std::shared_ptr<Material> emitter;
     float intensity = 1.0f;
     std::shared_ptr<Texture> texture;
+    vec3 anim_translate(0.0), anim_rotate(0.0);
 
     ts.pushMatrix();
     while(true) {
@@ -366,7 +360,7 @@ void Scene::createLight(std::ifstream& ifs) {
 
         // Shape -----------------------------------
         else if(header == "shape") {
-            this->createShapes(iss, shapes);
+            this->createShapes(iss, shapes, split_meshes ? nullptr : &meshes);
         }
         // Texture ----------------------------------
         else if(header == "color") {
@@ -404,62 +398,333 @@ void Scene::createLight(std::ifstream& ifs) {
         }
         else if(header == "intensity")
             iss >> intensity;
+        // Animation --------------------------------
+        else if(header == "animate") parseAnimation(iss, anim_translate, anim_rotate);
         // Transformation ---------------------------
-        else if(header == "translate") {
-            float x, y, z;
-            iss >> x >> y >> z;
-            ts.translate(vec3(x, y, z));
-        }
-        else if(header == "rotate") {
-            float angle, x, y, z;
-            iss >> angle >> x >> y >> z;
-            ts.rotate(degrees_to_radians(angle), vec3(x, y, z));
-        }
-        else if(header == "rotate_x") {
-            float angle;
-            iss >> angle;
-            ts.rotateX(degrees_to_radians(angle));
-        }
-        else if(header == "rotate_y") {
-            float angle;
-            iss >> angle;
-            ts.rotateY(degrees_to_radians(angle));
-        }
-        else if(header == "rotate_z") {
-            float angle;
-            iss >> angle;
-            ts.rotateZ(degrees_to_radians(angle));
-        }
-        else if(header == "scale") {
-            std::vector<float> scale;
-            while(true) {
-                float s;
-                iss >> s;
-                if(iss.eof()) break;
-
-                scale.push_back(s);
-            }
-
-            if(scale.size() == 1) ts.scale(scale[0]);
-            else if(scale.size() == 3) ts.scale(vec3(scale[0], scale[1], scale[2]));
-            else Throw("Input value for scale was incorrect!\n");
-        }
+        else parseTransform(header, iss);
     }
 
-    Assert(!shapes.empty(), "Shape object is required to primitive\n");
+    Assert(!shapes.empty() || !meshes.empty(), "Shape object is required to primitive\n");
     if(!texture) texture = std::make_shared<ConstantTexture>(vec3(1.0f));
     emitter = std::make_shared<Emitter>(texture, intensity);
 
+    auto transform = std::make_shared<Transform>(ts.getCurrentTransform());
+    size_t first = this->primitives.size();
+    // The same primitive is sampled as a light and intersected in the scene, so that lights hit by rays are found in `light_bvh`.
     for(auto &shape : shapes) {
-        this->lights.emplace_back(std::make_shared<ShapePrimitive>(
-            shape, emitter, std::make_shared<Transform>(ts.getCurrentTransform())));
-        this->primitives.emplace_back(std::make_shared<ShapePrimitive>(
-            shape, emitter, std::make_shared<Transform>(ts.getCurrentTransform())));
+        auto light = std::make_shared<ShapePrimitive>(shape, emitter, transform);
+        this->lights.emplace_back(light);
+        this->primitives.emplace_back(light);
+    }
+    // A mesh is a single light over its faces.
+    for(auto &mesh : meshes) {
+        auto light = std::make_shared<MeshPrimitive>(mesh, emitter, transform, vec3(0.0), bvh_params);
+        this->lights.emplace_back(light);
+        this->primitives.emplace_back(light);
+    }
+
+    if(anim_translate != vec3(0.0) || anim_rotate != vec3(0.0)) {
+        animations.push_back({ transform, *transform, anim_translate, anim_rotate, 
+                               std::vector<std::shared_ptr<Primitive>>(this->primitives.begin() + first, this->primitives.end()) });
+    }
+
+    ts.popMatrix();
+}
+
+// -----------------------------------------------------------------------------------------
+/** Apply a transformation line to the current transform. Return false if `header` is not a transformation. */
+bool Scene::parseTransform(const std::string& header, std::istringstream& iss) {
+    if(header == "translate") {
+        float x, y, z;
+        iss >> x >> y >> z;
+        ts.translate(vec3(x, y, z));
+    }
+    else if(header == "rotate") {
+        float angle, x, y, z;
+        iss >> angle >> x >> y >> z;
+        ts.rotate(degrees_to_radians(angle), vec3(x, y, z));
+    }
+    else if(header == "rotate_x") {
+        float angle;
+        iss >> angle;
+        ts.rotateX(degrees_to_radians(angle));
+    }
+    else if(header == "rotate_y") {
+        float angle;
+        iss >> angle;
+        ts.rotateY(degrees_to_radians(angle));
+    }
+    else if(header == "rotate_z") {
+        float angle;
+        iss >> angle;
+        ts.rotateZ(degrees_to_radians(angle));
+    }
+    else if(header == "scale") {
+        std::vector<float> scale;
+        float s;
+        while(iss >> s)
+            scale.push_back(s);
+
+        if(scale.size() == 1) ts.scale(scale[0]);
+        else if(scale.size() == 3) ts.scale(vec3(scale[0], scale[1], scale[2]));
+        else Throw("Input value for scale was incorrect!\n");
+    }
+    else return false;
+    return true;
+}
+
+// -----------------------------------------------------------------------------------------
+/** Syntax: `animate translate x y z` or `animate <rotate_x|rotate_y|rotate_z> degrees`, 
+ *  which moves the primitive by the given amount per frame. */
+void Scene::parseAnimation(std::istringstream& iss, vec3& translate, vec3& rotate) {
+    std::string type;
+    iss >> type;
+    if(type == "translate") iss >> translate.x >> translate.y >> translate.z;
+    else if(type == "rotate_x") iss >> rotate.x;
+    else if(type == "rotate_y") iss >> rotate.y;
+    else if(type == "rotate_z") iss >> rotate.z;
+    else Throw("Unknown animation '"+type+"'\n");
+}
+
+/** Syntax: `motion translate x y z`, which moves the primitive by the given amount 
+ *  in world space while the shutter is open. */
+void Scene::parseMotion(std::istringstream& iss, vec3& translate) {
+    std::string type;
+    iss >> type;
+    if(type == "translate") iss >> translate.x >> translate.y >> translate.z;
+    else Throw("Unknown motion '"+type+"'\n");
+}
+
+// -----------------------------------------------------------------------------------------
+/** Primitives between `beginObject <name>` and `endObject` are defined in object space 
+ *  and built into one BVH, which is shared by all `beginInstance <name>` blocks.
+ *  Transformations between primitives apply to the following ones, as outside objects. */
+void Scene::createObject(std::ifstream& ifs, const std::string& name) {
+    Assert(!name.empty(), "Object must have a name\n");
+    Assert(objects.find(name) == objects.end(), "Object '"+name+"' is already defined\n");
+
+    // Collect primitives of the object with identity transform, then restore the scene state.
+    std::vector<std::shared_ptr<Primitive>> scene_primitives;
+    std::swap(scene_primitives, this->primitives);
+    TransformSystem scene_ts = ts;
+    ts = TransformSystem();
+    in_object = true;
+
+    while(true) {
+        std::string line;
+        Assert(static_cast<bool>(std::getline(ifs, line)), "endObject is missing for object '"+name+"'\n");
+
+        std::istringstream iss(line);
+        std::string header;
+        iss >> header;
+
+        if(header.empty() || header[0] == '#') continue;
+        else if(header == "endObject") break;
+        else if(header == "beginPrimitive") createPrimitive(ifs);
+        else if(header == "beginLight") Throw("Lights are not supported in objects, define them outside of '"+name+"'\n");
+        else if(!parseTransform(header, iss)) Throw("Unknown line '"+header+"' in object '"+name+"'\n");
+    }
+
+    Assert(!this->primitives.empty(), "Object '"+name+"' has no primitives\n");
+    auto bvh = std::make_shared<LinearBVH>(this->primitives, bvh_params);
+    Message("OBJECT '"+name+"': ", this->primitives.size(), " primitives, BVH nodes: ", bvh->num_nodes());
+    objects.emplace(name, bvh);
+
+    std::swap(scene_primitives, this->primitives);
+    ts = scene_ts;
+    in_object = false;
+}
+
+// -----------------------------------------------------------------------------------------
+/** Syntax: `beginInstance <name>` followed by transformations and `endInstance`. */
+void Scene::createInstance(std::ifstream& ifs, const std::string& name) {
+    auto object = objects.find(name);
+    Assert(object != objects.end(), "Object '"+name+"' is not defined before instancing\n");
+
+    vec3 anim_translate(0.0), anim_rotate(0.0);
+    vec3 motion(0.0);
+    ts.pushMatrix();
+    while(true) {
+        std::string line;
+        Assert(static_cast<bool>(std::getline(ifs, line)), "endInstance is missing for object '"+name+"'\n");
+
+        std::istringstream iss(line);
+        std::string header;
+        iss >> header;
+
+        if(header == "endInstance") break;
+        else if(header == "animate") parseAnimation(iss, anim_translate, anim_rotate);
+        else if(header == "motion") parseMotion(iss, motion);
+        else parseTransform(header, iss);
     }
 
+    auto transform = std::make_shared<Transform>(ts.getCurrentTransform());
+    this->primitives.emplace_back(std::make_shared<Instance>(object->second, transform, motion));
+    n_instances++;
+    if(anim_translate != vec3(0.0) || anim_rotate != vec3(0.0))
+        animations.push_back({ transform, *transform, anim_translate, anim_rotate, { this->primitives.back() } });
+
     ts.popMatrix();
 }
 
+// -----------------------------------------------------------------------------------------
+/** Syntax: `accel <tree|linear|bvh4|bvh8|cbvh4|cbvh8> [split <middle|sah|binned_sah|lbvh|hlbvh|sbvh>] [leaf_size n] [bins n]
+ *                                [traversal_cost c] [intersect_cost c] [morton_bits <30|63>] [sbvh_budget r] [optimize passes]
+ *                                [packet <0|4|8|16>] [rebuild_ratio r] [meshes <compact|split>]` */
+void Scene::parseAccel(std::istringstream& iss) {
+    std::string type, header;
+    iss >> type;
+    if(type == "tree") accel_type = AccelType::TREE;
+    else if(type == "linear") accel_type = AccelType::LINEAR;
+    else if(type == "bvh4") accel_type = AccelType::BVH4;
+    else if(type == "bvh8") accel_type = AccelType::BVH8;
+    else if(type == "cbvh4") accel_type = AccelType::CBVH4;
+    else if(type == "cbvh8") accel_type = AccelType::CBVH8;
+    else Throw("Unknown acceleration structure '"+type+"'\n");
+
+    while(iss >> header) {
+        if(header == "split") {
+            std::string method;
+            iss >> method;
+            if(method == "middle") bvh_params.splitMethod = BVHNode::SplitMethod::MIDDLE;
+            else if(method == "sah") bvh_params.splitMethod = BVHNode::SplitMethod::SAH;
+            else if(method == "binned_sah") bvh_params.splitMethod = BVHNode::SplitMethod::BINNED_SAH;
+            else if(method == "lbvh") bvh_params.splitMethod = BVHNode::SplitMethod::LBVH;
+            else if(method == "hlbvh") bvh_params.splitMethod = BVHNode::SplitMethod::HLBVH;
+            else if(method == "sbvh") bvh_params.splitMethod = BVHNode::SplitMethod::SBVH;
+            else Throw("Unknown split method '"+method+"'\n");
+        }
+        else if(header == "leaf_size")
+            iss >> bvh_params.max_prims_in_node;
+        else if(header == "bins")
+            iss >> bvh_params.n_bins;
+        else if(header == "traversal_cost")
+            iss >> bvh_params.traversal_cost;
+        else if(header == "intersect_cost")
+            iss >> bvh_params.intersect_cost;
+        else if(header == "morton_bits")
+            iss >> bvh_params.morton_bits;
+        else if(header == "sbvh_budget")
+            iss >> bvh_params.sbvh_budget;
+        else if(header == "optimize")
+            iss >> bvh_params.optimize_passes;
+        else if(header == "rebuild_ratio")
+            iss >> bvh_params.rebuild_ratio;
+        else if(header == "packet") {
+            iss >> packet_size;
+            Assert(packet_size == 0 || packet_size == 4 || packet_size == 8 || packet_size == 16, 
+                   "Packet size must be 0 (disabled), 4, 8 or 16\n");
+        }
+        else if(header == "meshes") {
+            std::string mode;
+            iss >> mode;
+            if(mode == "compact") split_meshes = false;
+            else if(mode == "split") split_meshes = true;
+            else Throw("Unknown mesh mode '"+mode+"'\n");
+        }
+        else Throw("Unknown accel parameter '"+header+"'\n");
+    }
+}
+
+// -----------------------------------------------------------------------------------------
+/** Syntax: `envmap <filename> [intensity s] [rotate_y degrees]`, for a lat-long image (e.g. .hdr). */
+void Scene::parseEnvmap(std::istringstream& iss) {
+    std::string filename, header;
+    iss >> filename;
+    Float intensity = 1, rotation = 0;
+    while(iss >> header) {
+        if(header == "intensity")
+            iss >> intensity;
+        else if(header == "rotate_y")
+            iss >> rotation;
+        else Throw("Unknown envmap parameter '"+header+"'\n");
+    }
+    envmap = std::make_shared<ImageEnvmap>(filename, intensity, rotation);
+}
+
+// -----------------------------------------------------------------------------------------
+std::shared_ptr<Primitive> Scene::buildAccel() {
+    Message("Constructing acceleration structure...");
+    auto build_start = std::chrono::steady_clock::now();
+    std::shared_ptr<Primitive> accel;
+    if(accel_type == AccelType::TREE) {
+        auto tree = std::make_shared<BVHNode>(this->primitives, 0, this->primitives.size(), 1, bvh_params.splitMethod);
+        Message("SAH cost: ", tree->sah_cost(bvh_params.traversal_cost, bvh_params.intersect_cost));
+        accel = tree;
+    } else {
+        bvh = std::make_shared<LinearBVH>(this->primitives, bvh_params);
+        bvh->setPacketSize(packet_size);
+        Message("BVH nodes: ", bvh->num_nodes(), ", SAH cost: ", bvh->sah_cost());
+        reportMemory("BVH", bvh->node_bytes());
+        accel = collapseAccel();
+    }
+    std::chrono::duration<double> build_time = std::chrono::steady_clock::now() - build_start;
+    Message("ACCEL: ", accel->type(), ", build time: ", build_time.count(), "s");
+    return accel;
+}
+
+std::shared_ptr<Primitive> Scene::collapseAccel() const {
+    if(accel_type == AccelType::BVH4 || accel_type == AccelType::CBVH4) {
+        auto wide = std::make_shared<WideBVH<4>>(*bvh);
+        Message("BVH4 nodes: ", wide->num_nodes());
+        reportMemory("BVH4", wide->node_bytes());
+        if(accel_type == AccelType::BVH4)
+            return wide;
+        auto compressed = std::make_shared<CompressedWideBVH<4>>(*wide);
+        reportMemory("Compressed BVH4", compressed->node_bytes());
+        return compressed;
+    } else if(accel_type == AccelType::BVH8 || accel_type == AccelType::CBVH8) {
+        #ifndef __AVX__
+        Message("[Warning] AVX is not enabled, BVH8 uses the scalar box test. Configure with -DUSE_AVX2=ON.");
+        #endif
+        auto wide = std::make_shared<WideBVH<8>>(*bvh);
+        Message("BVH8 nodes: ", wide->num_nodes());
+        reportMemory("BVH8", wide->node_bytes());
+        if(accel_type == AccelType::BVH8)
+            return wide;
+        auto compressed = std::make_shared<CompressedWideBVH<8>>(*wide);
+        reportMemory("Compressed BVH8", compressed->node_bytes());
+        return compressed;
+    }
+    return bvh;
+}
+
+// -----------------------------------------------------------------------------------------
+/** Topology is fixed between frames, so LinearBVH only refits its bounds (O(n)) 
+ *  unless the tree has degraded too much. Wide BVHs are collapsed again from it.
+ *  Lights are few, so the light BVH is rebuilt rather than refit. */
+void Scene::setFrame(int frame, std::shared_ptr<Primitive>& accel) {
+    auto start = std::chrono::steady_clock::now();
+    for(auto& anim : animations) {
+        *anim.transform = Transform::translate(anim.translate * static_cast<Float>(frame)) * anim.base 
+                        * Transform::rotateX(degrees_to_radians(anim.rotate.x * frame))
+                        * Transform::rotateY(degrees_to_radians(anim.rotate.y * frame))
+                        * Transform::rotateZ(degrees_to_radians(anim.rotate.z * frame));
+        #ifdef _OPENMP
+        #pragma omp parallel for
+        #endif
+        for(int i=0; i<static_cast<int>(anim.primitives.size()); i++)
+            anim.primitives[i]->update_bounding();
+    }
+
+    if(accel_type == AccelType::TREE) {
+        accel = buildAccel();
+    } else {
+        bvh->update();
+        accel = collapseAccel();
+    }
+    light_bvh = LightBVH(lights);
+    envmap->preprocess(accel->bounding());
+    std::chrono::duration<double> update_time = std::chrono::steady_clock::now() - start;
+    Message("FRAME ", frame, ": update time: ", update_time.count(), "s");
+}
+
+// -----------------------------------------------------------------------------------------
+void Scene::reportMemory(const std::string& name, size_t bytes) const {
+    Message(name, " node memory: ", bytes / (1024.0 * 1024.0), " MB (", 
+            static_cast<Float>(bytes) / std::max<size_t>(primitives.size(), 1), " bytes/primitive)");
+}
+
 // -----------------------------------------------------------------------------------------
 void Scene::streamProgress(int currentLine, int maxLine, Float elapsedTime, int progressLen) {    
     // Display progress bar
@@ -484,10 +749,35 @@ void Scene::render() {
 
     Message("PRIMITIVES: ", this->primitives.size());
     Message("LIGHTS: ", this->lights.size());
+    if(!objects.empty())
+        Message("OBJECTS: ", objects.size(), ", INSTANCES: ", n_instances);
 
-    Message("Constructing acceleration structure...");
-    BVHNode bvh_node(this->primitives, 0, this->primitives.size(), 1, BVHNode::SplitMethod::SAH);
+    std::shared_ptr<Primitive> accel = buildAccel();
+    light_bvh = LightBVH(lights);
+    envmap->preprocess(accel->bounding());
+
+    // Frames of a sequence are written to `<name>_0000.<ext>`, `<name>_0001.<ext>`, ...
+    std::string file_format = split(image.first, '.').back();
+    std::string file_base = image.first.substr(0, image.first.size() - file_format.size() - 1);
+    for(int frame=0; frame<n_frames; frame++) {
+        if(frame > 0) 
+            setFrame(frame, accel);
+
+        std::string name = file_base;
+        if(n_frames > 1) {
+            std::ostringstream oss;
+            oss << file_base << "_" << std::setw(4) << std::setfill('0') << frame;
+            name = oss.str();
+        }
+        renderFrame(*accel, name, file_format);
+    }
+    std::cerr << "Done\n";
+}
 
+// -----------------------------------------------------------------------------------------
+/** Render the image and write it to `<name>.<format>`. 
+ *  With traversal statistics enabled, a heatmap is also written to `<name>_heatmap.<format>`. */
+void Scene::renderFrame(const Primitive& accel, const std::string& name, const std::string& format) {
     struct timespec start_time, end_time;
     clock_gettime(CLOCK_REALTIME, &start_time);
 
@@ -506,35 +796,218 @@ void Scene::render() {
      * Change a method of counting time from the current way to std::chrono.
      */
 
+    // Camera rays of a small pixel tile are coherent, so their first hits are 
+    // traced together as a packet, and the remaining bounces ray by ray.
+    const int tile_w = packet_size >= 8 ? 4 : (packet_size == 4 ? 2 : 1);
+    const int tile_h = packet_size >= 16 ? 4 : (packet_size >= 4 ? 2 : 1);
+    const int n_tiles_x = (width + tile_w - 1) / tile_w;
+
+    #ifdef TRAVERSAL_STATS
+    #ifndef _OPENMP
+    int n_threads = 1;
+    #endif
+    TraversalStats stats(width, height, n_threads);
+    #endif
+
+    // Time spent in primary ray intersection, summed over threads.
+    double intersect_time = 0;
+
     Message("Start rendering...");
-    for(int y=0; y<height; y++) {
+    for(int y0=0; y0<height; y0+=tile_h) {
         clock_gettime(CLOCK_REALTIME, &end_time);
         Float sec = end_time.tv_sec - start_time.tv_sec;
         Float nsec = (Float)(end_time.tv_nsec - start_time.tv_nsec) / 1000000000;
         Float elapsed_time = sec + nsec;
-        this->streamProgress(y, height, elapsed_time, progress_len);
+        this->streamProgress(std::min(y0+tile_h, height)-1, height, elapsed_time, progress_len);
 
         #ifdef _OPENMP
-        #pragma omp parallel for num_threads(n_threads)
+        #pragma omp parallel for num_threads(n_threads) reduction(+: intersect_time)
         #endif
-        for(int x=0; x<width; x++) {
-            vec3 color(0,0,0);
-            
-            for(int s=0; s<samples_per_pixel; s++) {
-                auto u = (x + random_float()) / width;
-                auto v = (y + random_float()) / height;
+        for(int tx=0; tx<n_tiles_x; tx++) {
+            Ray rays[16];
+            SurfaceInteraction si[16];
+            bool hits[16];
+            vec3 color[16];
+            int px[16], py[16];
+            int n = 0;
+            for(int y=y0; y<std::min(y0+tile_h, height); y++) {
+                for(int x=tx*tile_w; x<std::min((tx+1)*tile_w, width); x++) {
+                    px[n] = x; py[n] = y;
+                    color[n++] = vec3(0,0,0);
+                }
+            }
 
-                Ray r = camera.get_ray(u, v);
-                color += integrator.trace(r, bvh_node, lights, background, depth);
+            #ifdef TRAVERSAL_STATS
+            TraversalCounters counters[16];
+            #endif
+
+            for(int s=0; s<samples_per_pixel; s++) {
+                for(int i=0; i<n; i++) {
+                    auto u = (px[i] + random_float()) / width;
+                    auto v = (py[i] + random_float()) / height;
+                    rays[i] = camera.get_ray(u, v);
+                }
+                #ifdef TRAVERSAL_STATS
+                // The cost of a packet is shared evenly by its pixels.
+                TraversalCounters start = thread_counters;
+                STAT_ADD(rays, n);
+                #endif
+                auto intersect_start = std::chrono::steady_clock::now();
+                accel.intersect_batch(rays, n, eps, infinity, si, hits);
+                intersect_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - intersect_start).count();
+                #ifdef TRAVERSAL_STATS
+                TraversalCounters batch = thread_counters - start;
+                #endif
+                for(int i=0; i<n; i++) {
+                    #ifdef TRAVERSAL_STATS
+                    start = thread_counters;
+                    #endif
+                    color[i] += integrator.trace(rays[i], hits[i], si[i], accel, light_bvh, *envmap, depth);
+                    #ifdef TRAVERSAL_STATS
+                    counters[i] += thread_counters - start;
+                    counters[i].rays += (batch.rays + i) / n;
+                    counters[i].nodes += (batch.nodes + i) / n;
+                    counters[i].box_tests += (batch.box_tests + i) / n;
+                    counters[i].prim_tests += (batch.prim_tests + i) / n;
+                    counters[i].hits += (batch.hits + i) / n;
+                    #endif
+                }
+            }
+            for(int i=0; i<n; i++) {
+                RGBA rgb_color = RGBA(vec2color(color[i], 1.0 / samples_per_pixel), 255);
+                image.second.set(px[i], height-(py[i]+1), rgb_color);
+                #ifdef TRAVERSAL_STATS
+                #ifdef _OPENMP
+                stats.add_pixel(px[i], py[i], counters[i], omp_get_thread_num());
+                #else
+                stats.add_pixel(px[i], py[i], counters[i], 0);
+                #endif
+                #endif
             }
-            RGBA rgb_color = RGBA(vec2color(color, 1.0 / samples_per_pixel), 255);
-            image.second.set(x, height-(y+1), rgb_color);
         }
     }
 
-    std::string file_format = split(image.first, '.').back();
-    image.second.write(image.first, file_format);
-    std::cerr << "\nDone\n";
+    clock_gettime(CLOCK_REALTIME, &end_time);
+    Float render_time = (end_time.tv_sec - start_time.tv_sec) 
+                      + (Float)(end_time.tv_nsec - start_time.tv_nsec) / 1000000000;
+    Float n_rays = (Float)width * height * samples_per_pixel;
+    std::cerr << "\nSamples/sec: " << std::fixed << std::setprecision(2) << n_rays / render_time << std::endl;
+    // Only the first hits of camera rays, so that packet sizes can be compared apart from shading.
+    std::cerr << "Primary rays/sec per thread: " << std::fixed << std::setprecision(2) << n_rays / intersect_time << std::endl;
+
+    image.second.write(name + "." + format, format);
+    #ifdef TRAVERSAL_STATS
+    stats.report();
+    if(bvh) TraversalStats::report_bvh(*bvh);
+    stats.write_heatmap(name + "_heatmap." + format, format);
+    #endif
+}
+
+// -----------------------------------------------------------------------------------------
+/** Trace the same ray sets through binary, 4-wide and 8-wide BVHs and report throughput.
+ *  Primary rays (one per pixel) are coherent, diffuse bounces from their hit points are not. */
+void Scene::benchmark() {
+    Message("PRIMITIVES: ", this->primitives.size());
+
+    LinearBVH bvh(this->primitives, bvh_params);
+    WideBVH<4> bvh4(bvh);
+    WideBVH<8> bvh8(bvh);
+    CompressedWideBVH<4> cbvh4(bvh4);
+    CompressedWideBVH<8> cbvh8(bvh8);
+    Message("BVH nodes: ", bvh.num_nodes(), ", BVH4 nodes: ", bvh4.num_nodes(), ", BVH8 nodes: ", bvh8.num_nodes());
+    reportMemory("binary", bvh.node_bytes());
+    reportMemory("bvh4", bvh4.node_bytes());
+    reportMemory("bvh8", bvh8.node_bytes());
+    reportMemory("cbvh4", cbvh4.node_bytes());
+    reportMemory("cbvh8", cbvh8.node_bytes());
+    #ifndef __AVX__
+    Message("[Warning] AVX is not enabled, BVH8 uses the scalar box test.");
+    #endif
+
+    // Rays are generated once so that every structure traces exactly the same set.
+    auto width = image.second.getWidth();
+    auto height = image.second.getHeight();
+    std::vector<Ray> primary_rays, secondary_rays, shadow_rays;
+    primary_rays.reserve(width * height);
+    for(int y=0; y<height; y++) {
+        for(int x=0; x<width; x++)
+            primary_rays.emplace_back(camera.get_ray((x + 0.5) / width, (y + 0.5) / height));
+    }
+    for(size_t i=0; i<primary_rays.size(); i++) {
+        SurfaceInteraction si;
+        if(!bvh.intersect(primary_rays[i], 0.001, infinity, si)) continue;
+        secondary_rays.emplace_back(si.p, random_in_hemisphere(si.n));
+        // Shadow rays toward the center of lights, which end just before the light (t < 1).
+        if(!lights.empty())
+            shadow_rays.emplace_back(si.p, lights[i % lights.size()]->bounding().centroid() - si.p);
+    }
+
+    auto run = [](const Primitive& accel, const std::vector<Ray>& rays, Float t_max, bool any_hit, const std::string& name) {
+        int n_hits = 0;
+        auto start = std::chrono::steady_clock::now();
+        #ifdef _OPENMP
+        #pragma omp parallel for schedule(dynamic, 256) reduction(+:n_hits)
+        #endif
+        for(int i=0; i<static_cast<int>(rays.size()); i++) {
+            if(any_hit) {
+                n_hits += accel.occluded(rays[i], 0.001, t_max);
+            } else {
+                SurfaceInteraction si;
+                n_hits += accel.intersect(rays[i], 0.001, t_max, si);
+            }
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cerr << "  " << std::left << std::setw(18) << name 
+                  << std::fixed << std::setprecision(3) << rays.size() / elapsed.count() / 1e6 << " Mrays/s"
+                  << " (hits: " << n_hits << ")" << std::endl;
+    };
+
+    // Rays are in scanline order, so consecutive rays form coherent packets.
+    auto run_packet = [](LinearBVH& accel, const std::vector<Ray>& rays, int packet_size) {
+        int n_hits = 0;
+        accel.setPacketSize(packet_size);
+        auto start = std::chrono::steady_clock::now();
+        #ifdef _OPENMP
+        #pragma omp parallel for schedule(dynamic, 16) reduction(+:n_hits)
+        #endif
+        for(int i=0; i<static_cast<int>(rays.size()); i+=packet_size) {
+            int n = std::min(packet_size, static_cast<int>(rays.size()) - i);
+            SurfaceInteraction si[16];
+            bool hits[16];
+            accel.intersect_batch(&rays[i], n, 0.001, infinity, si, hits);
+            for(int j=0; j<n; j++) n_hits += hits[j];
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cerr << "  " << std::left << std::setw(18) << "packet " + std::to_string(packet_size)
+                  << std::fixed << std::setprecision(3) << rays.size() / elapsed.count() / 1e6 << " Mrays/s"
+                  << " (hits: " << n_hits << ")" << std::endl;
+    };
+
+    const std::pair<std::string, const std::vector<Ray>*> ray_sets[] = {
+        { "Primary", &primary_rays }, { "Diffuse", &secondary_rays }
+    };
+    for(const auto& set : ray_sets) {
+        std::cerr << set.first << " rays: " << set.second->size() << std::endl;
+        run(bvh, *set.second, infinity, false, "binary");
+        run(bvh4, *set.second, infinity, false, "bvh4");
+        run(bvh8, *set.second, infinity, false, "bvh8");
+        run(cbvh4, *set.second, infinity, false, "cbvh4");
+        run(cbvh8, *set.second, infinity, false, "cbvh8");
+    }
+    std::cerr << "Primary packets:" << std::endl;
+    for(int packet_size : { 4, 8, 16 })
+        run_packet(bvh, primary_rays, packet_size);
+
+    if(!shadow_rays.empty()) {
+        const Float t_max = 1 - 0.001;
+        std::cerr << "Shadow rays: " << shadow_rays.size() << std::endl;
+        run(bvh, shadow_rays, t_max, false, "binary (closest)");
+        run(bvh, shadow_rays, t_max, true, "binary");
+        run(bvh4, shadow_rays, t_max, true, "bvh4");
+        run(bvh8, shadow_rays, t_max, true, "bvh8");
+        run(cbvh4, shadow_rays, t_max, true, "cbvh4");
+        run(cbvh8, shadow_rays, t_max, true, "cbvh8");
+    }
 }
 
 }
\ No newline at end of file
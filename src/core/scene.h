@@ -2,10 +2,15 @@
 
 #include "util.h"
 #include "primitive.h"
+#include "bvh.h"
+#include "wide_bvh.h"
+#include "../shape/triangle.h"
+#include "stats.h"
 #include "material.h"
 #include "../render/camera.h"
 #include "../render/integrator.h"
 #include "../core/image.h"
+#include "../core/envmap.h"
 #include <omp.h>
 
 namespace mypt {
@@ -14,25 +19,76 @@ class Scene {
 public:
     explicit Scene(const std::string& filename);
     void render();
+    // Measure traversal throughput of binary and wide BVHs for coherent and incoherent rays.
+    void benchmark();
+
+    // Acceleration structure built in `render()`. 
+    // TREE is the original pointer-based BVHNode kept for comparison.
+    // BVH4/BVH8 are collapsed from LINEAR and test all children of a node at once.
+    enum class AccelType { TREE, LINEAR, BVH4, BVH8, CBVH4, CBVH8 };
 
 private:
     // Parse scene configuration and create objects.
     void createCamera(std::ifstream&, Float aspect);
-    void createShapes(std::istringstream&, std::vector<std::shared_ptr<Shape>>&);
+    // Meshes are returned as a whole in `meshes` if given, otherwise split into triangles.
+    void createShapes(std::istringstream&, std::vector<std::shared_ptr<Shape>>&, 
+                      std::vector<std::shared_ptr<TriangleMesh>>* meshes = nullptr);
     auto createMaterial(std::istringstream&);
     void createPrimitive(std::ifstream&);
     void createLight(std::ifstream&);
+    void createObject(std::ifstream&, const std::string& name);
+    void createInstance(std::ifstream&, const std::string& name);
+    bool parseTransform(const std::string& header, std::istringstream&);
+    void parseAnimation(std::istringstream&, vec3& translate, vec3& rotate);
+    void parseMotion(std::istringstream&, vec3& translate);
+    void parseAccel(std::istringstream&);
+    void parseEnvmap(std::istringstream&);
+    std::shared_ptr<Primitive> buildAccel();
+    // Wrap `bvh` into the acceleration structure selected by `accel_type`.
+    std::shared_ptr<Primitive> collapseAccel() const;
+    // Move animated primitives to `frame`, then refit (or rebuild) the acceleration structure.
+    void setFrame(int frame, std::shared_ptr<Primitive>& accel);
+    void renderFrame(const Primitive& accel, const std::string& name, const std::string& format);
+    // Print the node memory of an acceleration structure in total and per primitive.
+    void reportMemory(const std::string& name, size_t bytes) const;
     // Stream rendering progress to standard out stream.
     void streamProgress(int currentLine, int maxLine, Float elapsedTime, int progressLen=20);
 
+    /** Per-frame motion of a primitive block or an instance, given by `animate` lines. 
+     *  The transform at frame f is `translate(f * translate) * base * rotate(f * rotate)`. */
+    struct Animation {
+        std::shared_ptr<Transform> transform;
+        Transform base;
+        vec3 translate;                 // World-space translation per frame
+        vec3 rotate;                    // Rotation around local x, y, z axes per frame [degrees]
+        std::vector<std::shared_ptr<Primitive>> primitives;
+    };
+
     std::vector<std::shared_ptr<Primitive>> primitives;
     std::vector<std::shared_ptr<Primitive>> lights;
+    // Hierarchy over `lights` built in `render()`, which chooses lights for next event estimation.
+    LightBVH light_bvh;
+    // Bottom-level BVHs of objects, which are shared by instances.
+    std::map<std::string, std::shared_ptr<Primitive>> objects;
+    int n_instances;
+    bool in_object = false;
+    std::vector<Animation> animations;
+    int n_frames;
     Camera camera;
     Integrator integrator;
     std::pair<std::string, Image<RGBA>> image;
     int samples_per_pixel, depth;
-    vec3 background;
+    // Radiance of rays escaping the scene, given by `background` or `envmap`.
+    std::shared_ptr<Envmap> envmap;
     TransformSystem ts;
+    AccelType accel_type;
+    BVHBuildParams bvh_params;
+    // Binary BVH kept for refitting between frames (null for TREE).
+    std::shared_ptr<LinearBVH> bvh;
+    // Camera rays per packet for the first bounce (0 : single-ray traversal).
+    int packet_size;
+    // Make every mesh triangle a separate ShapePrimitive instead of one MeshPrimitive per mesh.
+    bool split_meshes;
 };
 
 }
\ No newline at end of file
@@ -10,11 +10,29 @@ namespace mypt {
 class Shape {
 public:
     virtual bool intersect(const Ray& r, Float t_min, Float t_max, SurfaceInteraction& si) const = 0;
+    // Only check if the ray hits the shape in [t_min, t_max], without computing hit attributes.
+    virtual bool occluded(const Ray& r, Float t_min, Float t_max) const {
+        SurfaceInteraction si;
+        return intersect(r, t_min, t_max, si);
+    }
     virtual AABB bounding() const = 0;
+    // Bounds at shutter open (time 0) and close (time 1) for moving shapes. Returns false for static shapes.
+    virtual bool motion_bounding(AABB& /* b0 */, AABB& /* b1 */) const { return false; }
+    // Bounds of the part of shape inside `box`, after the shape is transformed by `to_world`.
+    virtual AABB clipped_bounding(const AABB& box, const mat4& to_world) const {
+        return intersection(transform_bounds(bounding(), to_world), box);
+    }
     
     virtual Float pdf_value(const vec3& /* o */, const vec3& /* v */) const { return 0.0; }
     virtual vec3 random(const vec3& /* o */) const { return vec3(1, 0, 0); }
 
+    // Surface area in the local space, which weights emitters in light sampling. Shapes which
+    // `random()` cannot sample (e.g. MovingSphere, whose samples would depend on the ray time)
+    // keep 0, so that they are never chosen as lights and their emission is found by BSDF sampling.
+    virtual Float area() const { return 0.0; }
+    // Normal of a flat shape in the local space. Returns false for curved shapes.
+    virtual bool flat_normal(vec3& /* n */) const { return false; }
+
     virtual std::string to_string() const = 0;
 };
 
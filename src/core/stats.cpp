@@ -0,0 +1,114 @@
+#include "stats.h"
+#include "bvh.h"
+#include "image.h"
+
+namespace mypt {
+
+#ifdef TRAVERSAL_STATS
+thread_local TraversalCounters thread_counters;
+#endif
+
+// ----------------------------------------------------------------------------
+TraversalStats::TraversalStats(int width, int height, int n_threads)
+: width(width), height(height), pixels(width * height), threads(n_threads) {}
+
+void TraversalStats::add_pixel(int x, int y, const TraversalCounters& c, int thread) {
+    pixels[y * width + x] += c;
+    threads[thread] += c;
+}
+
+Float TraversalStats::nodes_per_ray(int i) const {
+    return pixels[i].rays > 0 ? static_cast<Float>(pixels[i].nodes) / pixels[i].rays : 0;
+}
+
+// ----------------------------------------------------------------------------
+/** Nodes visited per ray, normalized by the 99th percentile over the image 
+ *  and mapped blue -> cyan -> green -> yellow -> red. */
+void TraversalStats::write_heatmap(const std::string& filename, const std::string& format) const {
+    std::vector<Float> values(pixels.size());
+    for(size_t i=0; i<pixels.size(); i++) 
+        values[i] = nodes_per_ray(i);
+    std::vector<Float> sorted = values;
+    std::sort(sorted.begin(), sorted.end());
+    Float scale = sorted.empty() ? 0 : sorted[(sorted.size() - 1) * 99 / 100];
+    if(scale <= 0) scale = 1;
+
+    static const Float ramp[5][3] = { {0,0,1}, {0,1,1}, {0,1,0}, {1,1,0}, {1,0,0} };
+    Image<RGBA> heatmap(width, height);
+    for(int y=0; y<height; y++) {
+        for(int x=0; x<width; x++) {
+            Float v = clamp(values[y * width + x] / scale, 0.0, 1.0) * 4;
+            int k = std::min(static_cast<int>(v), 3);
+            Float f = v - k;
+            unsigned char c[3];
+            for(int a=0; a<3; a++)
+                c[a] = static_cast<unsigned char>(255 * ((1 - f) * ramp[k][a] + f * ramp[k+1][a]));
+            heatmap.set(x, height-(y+1), RGBA(c[0], c[1], c[2], 255));
+        }
+    }
+    heatmap.write(filename, format);
+    Message("Heatmap of nodes per ray (red: ", scale, ") was written to '", filename, "'");
+}
+
+// ----------------------------------------------------------------------------
+void TraversalStats::report() const {
+    TraversalCounters total;
+    for(const auto& c : threads) total += c;
+    if(total.rays == 0) return;
+
+    auto per_ray = [&total](uint64_t n) { return static_cast<Float>(n) / total.rays; };
+    std::cerr << "Traversal statistics (" << total.rays << " rays)" << std::endl;
+    std::cerr << std::fixed << std::setprecision(2)
+              << "  per ray : nodes " << per_ray(total.nodes) << ", box tests " << per_ray(total.box_tests) 
+              << ", primitive tests " << per_ray(total.prim_tests) << ", hits " << per_ray(total.hits) << std::endl;
+
+    std::vector<Float> sorted;
+    sorted.reserve(pixels.size());
+    for(size_t i=0; i<pixels.size(); i++) 
+        if(pixels[i].rays > 0) sorted.push_back(nodes_per_ray(i));
+    std::sort(sorted.begin(), sorted.end());
+    if(!sorted.empty()) {
+        auto percentile = [&sorted](int p) { return sorted[(sorted.size() - 1) * p / 100]; };
+        std::cerr << "  nodes per ray over pixels : p50 " << percentile(50) << ", p90 " << percentile(90) 
+                  << ", p99 " << percentile(99) << ", max " << sorted.back() << std::endl;
+    }
+
+    std::cerr << "  rays per thread :";
+    for(const auto& c : threads) std::cerr << " " << c.rays;
+    std::cerr << std::endl;
+}
+
+// ----------------------------------------------------------------------------
+void TraversalStats::report_bvh(const LinearBVH& bvh) {
+    const auto& nodes = bvh.getNodes();
+    if(nodes.empty()) return;
+
+    std::vector<int> depths, sizes;
+    std::vector<std::pair<int, int>> stack = { { 0, 0 } };
+    while(!stack.empty()) {
+        auto [index, depth] = stack.back();
+        stack.pop_back();
+        const LinearBVHNode& node = nodes[index];
+        if(node.n_primitives > 0) {
+            if(static_cast<int>(depths.size()) <= depth) depths.resize(depth + 1);
+            if(static_cast<int>(sizes.size()) <= node.n_primitives) sizes.resize(node.n_primitives + 1);
+            depths[depth]++;
+            sizes[node.n_primitives]++;
+        } else {
+            stack.push_back({ index + 1, depth + 1 });
+            stack.push_back({ node.second_child_offset, depth + 1 });
+        }
+    }
+
+    auto print = [](const std::string& name, const std::vector<int>& histogram) {
+        std::cerr << "  " << name << " :";
+        for(size_t i=0; i<histogram.size(); i++)
+            if(histogram[i] > 0) std::cerr << " " << i << ":" << histogram[i];
+        std::cerr << std::endl;
+    };
+    std::cerr << "BVH histograms (value:leaves)" << std::endl;
+    print("leaf depth", depths);
+    print("leaf size", sizes);
+}
+
+}
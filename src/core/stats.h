@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "util.h"
+
+namespace mypt {
+
+class LinearBVH;
+
+/** \brief Counters of acceleration structure traversal.
+ *  They are only collected when configured with -DUSE_TRAVERSAL_STATS=ON,
+ *  otherwise `STAT_ADD` compiles to nothing. */
+struct TraversalCounters {
+    uint64_t rays = 0;          // Queries to the acceleration structure of the scene
+    uint64_t nodes = 0;         // Nodes visited
+    uint64_t box_tests = 0;     // Ray-box tests (one per child slot for wide BVHs)
+    uint64_t prim_tests = 0;    // Ray-primitive tests
+    uint64_t hits = 0;          // Primitive tests which found a hit
+
+    TraversalCounters& operator+=(const TraversalCounters& c) {
+        rays += c.rays; nodes += c.nodes; box_tests += c.box_tests;
+        prim_tests += c.prim_tests; hits += c.hits;
+        return *this;
+    }
+    TraversalCounters operator-(const TraversalCounters& c) const {
+        TraversalCounters d;
+        d.rays = rays - c.rays; d.nodes = nodes - c.nodes; d.box_tests = box_tests - c.box_tests;
+        d.prim_tests = prim_tests - c.prim_tests; d.hits = hits - c.hits;
+        return d;
+    }
+};
+
+#ifdef TRAVERSAL_STATS
+// Counters of the calling thread, accumulated over all of its rays.
+extern thread_local TraversalCounters thread_counters;
+#define STAT_ADD(counter, n) (::mypt::thread_counters.counter += (n))
+#else
+#define STAT_ADD(counter, n) ((void)0)
+#endif
+
+/** \brief Counters of every pixel and thread in a frame.
+ *  Writes a false-colour heatmap of visited nodes per ray and prints summary statistics. */
+class TraversalStats {
+public:
+    TraversalStats(int width, int height, int n_threads);
+
+    // `y` is the row from the bottom, as in the render loop.
+    void add_pixel(int x, int y, const TraversalCounters& c, int thread);
+
+    void write_heatmap(const std::string& filename, const std::string& format) const;
+    void report() const;
+    // Histograms of leaf depths and leaf sizes.
+    static void report_bvh(const LinearBVH& bvh);
+private:
+    Float nodes_per_ray(int i) const;
+
+    int width, height;
+    std::vector<TraversalCounters> pixels;
+    std::vector<TraversalCounters> threads;
+};
+
+}
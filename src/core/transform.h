@@ -37,7 +37,7 @@ inline Transform operator*(Transform t1, Transform t2) {
 inline Ray operator*(Transform t, Ray r) {
     vec3 ro = mat4::point_mul(t.getInvMatrix(), r.origin());
     vec3 rd = mat4::vector_mul(t.getInvMatrix(), r.direction());
-    return Ray(ro, rd);
+    return Ray(ro, rd, r.time());
 }
 
 class TransformSystem {
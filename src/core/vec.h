@@ -14,7 +14,7 @@ public:
     type2(Type c) : x(c), y(c) {}
 
     template <typename OtherType>
-    operator type2<OtherType>() { return type2<OtherType>(x, y); }
+    operator type2<OtherType>() const { return type2<OtherType>(x, y); }
 
     Type operator[](int i) const { 
         return (&x)[i];
@@ -63,6 +63,7 @@ public:
 using vec2 = type2<Float>;
 using uint2 = type2<unsigned int>;
 using int2 = type2<int>;
+using float2 = type2<float>;
 
 // Utility functions of type2
 template <typename Type>
@@ -104,7 +105,7 @@ public:
 
     // Define cast to other type3
     template <typename OtherType>
-    operator type3<OtherType>() { return type3<OtherType>(x, y, z); }
+    operator type3<OtherType>() const { return type3<OtherType>(x, y, z); }
     
     type3 operator-() const { return type3(-x, -y, -z); }
     Type operator[](int i) const {
@@ -224,6 +225,7 @@ inline type3<Type> cross(const type3<Type> &u, const type3<Type> &v) {
 using vec3 = type3<Float>;
 using uint3 = type3<unsigned int>;
 using int3 = type3<int>;
+using float3 = type3<float>;
 using RGB = type3<unsigned char>;
 
 inline vec3 normalize(vec3 v) {
@@ -294,7 +296,7 @@ public:
     type4(type3<Type> v, Type w) : x(v.x), y(v.y), z(v.z), w(w) {}
 
     template <typename OtherType>
-    operator type4<OtherType>() { return type4<OtherType>(x, y, z, w); }
+    operator type4<OtherType>() const { return type4<OtherType>(x, y, z, w); }
     
     type4 operator-() const { return type4(-x, -y, -z); }
     Type operator[](int i) const { 
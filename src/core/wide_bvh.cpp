@@ -0,0 +1,482 @@
+#include "wide_bvh.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+namespace mypt {
+
+/** Single-precision ray data shared by every node test during one traversal. */
+struct WideRay {
+    float o[3];
+    float inv_dir[3];
+    int dir_is_neg[3];
+};
+
+// Node bounds are rounded outward, but the ray is rounded to single precision here,
+// so the distance interval is slightly widened to stay conservative.
+static constexpr float t_far_scale = 1.0f + 1e-5f;
+
+// ----------------------------------------------------------------------------
+/** Test all children of a node and return the bit mask of the children hit by the ray, 
+ *  with their entry distances in `t_entry`. `bounds` is laid out as WideBVHNode::bounds. */
+template <int N>
+static inline int intersect_children(const float (&bounds)[2][3][N], const WideRay& r, float t_min, float t_max,
+                                     float (&t_entry)[N]) {
+    int mask = 0;
+    for(int i=0; i<N; i++) {
+        float t0 = t_min, t1 = t_max;
+        for(int a=0; a<3; a++) {
+            float t_near = (bounds[r.dir_is_neg[a]][a][i] - r.o[a]) * r.inv_dir[a];
+            float t_far  = (bounds[1-r.dir_is_neg[a]][a][i] - r.o[a]) * r.inv_dir[a];
+            t0 = t_near > t0 ? t_near : t0;
+            t1 = t_far < t1 ? t_far : t1;
+        }
+        t_entry[i] = t0;
+        mask |= (t0 <= t1) << i;
+    }
+    return mask;
+}
+
+#if defined(__SSE2__)
+template <>
+inline int intersect_children<4>(const float (&bounds)[2][3][4], const WideRay& r, float t_min, float t_max,
+                                 float (&t_entry)[4]) {
+    __m128 t0 = _mm_set1_ps(t_min);
+    __m128 t1 = _mm_set1_ps(t_max);
+    for(int a=0; a<3; a++) {
+        const __m128 o = _mm_set1_ps(r.o[a]);
+        const __m128 inv_dir = _mm_set1_ps(r.inv_dir[a]);
+        __m128 t_near = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(bounds[r.dir_is_neg[a]][a]), o), inv_dir);
+        __m128 t_far  = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(bounds[1-r.dir_is_neg[a]][a]), o), inv_dir);
+        t0 = _mm_max_ps(t0, t_near);
+        t1 = _mm_min_ps(t1, t_far);
+    }
+    _mm_storeu_ps(t_entry, t0);
+    return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+}
+#endif
+
+#if defined(__AVX__)
+template <>
+inline int intersect_children<8>(const float (&bounds)[2][3][8], const WideRay& r, float t_min, float t_max,
+                                 float (&t_entry)[8]) {
+    __m256 t0 = _mm256_set1_ps(t_min);
+    __m256 t1 = _mm256_set1_ps(t_max);
+    for(int a=0; a<3; a++) {
+        const __m256 o = _mm256_set1_ps(r.o[a]);
+        const __m256 inv_dir = _mm256_set1_ps(r.inv_dir[a]);
+        __m256 t_near = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(bounds[r.dir_is_neg[a]][a]), o), inv_dir);
+        __m256 t_far  = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(bounds[1-r.dir_is_neg[a]][a]), o), inv_dir);
+        t0 = _mm256_max_ps(t0, t_near);
+        t1 = _mm256_min_ps(t1, t_far);
+    }
+    _mm256_storeu_ps(t_entry, t0);
+    return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ));
+}
+#endif
+
+// ----------------------------------------------------------------------------
+static Float node_area(const LinearBVHNode& node) {
+    Float dx = node.bounds[1].x - node.bounds[0].x;
+    Float dy = node.bounds[1].y - node.bounds[0].y;
+    Float dz = node.bounds[1].z - node.bounds[0].z;
+    return 2 * (dx*dy + dy*dz + dz*dx);
+}
+
+/** Traversal stack entry of a child, which is a node or a leaf with `count` primitives. Entries 
+ *  are skipped when popped if a hit closer than `t_entry` was found since they were pushed. */
+struct WideStackEntry {
+    int index, count;
+    float t_entry;
+};
+
+/** Push the children of `mask` far to near, so that the nearest one is visited next. */
+template <int N>
+static inline void push_children(int mask, const float (&t_entry)[N], const int (&index)[N], const uint8_t (&counts)[N],
+                                 WideStackEntry* to_visit, int& to_visit_offset) {
+    int order[N], n = 0;
+    for(int i=0; i<N; i++) {
+        if(!(mask & (1 << i))) continue;
+        int j = n++;
+        for(; j > 0 && t_entry[order[j-1]] < t_entry[i]; j--)
+            order[j] = order[j-1];
+        order[j] = i;
+    }
+    for(int k=0; k<n; k++)
+        to_visit[to_visit_offset++] = { index[order[k]], counts[order[k]], t_entry[order[k]] };
+}
+
+// ----------------------------------------------------------------------------
+/** Gather up to N descendants of a binary interior node by repeatedly
+ *  opening the interior child with the largest surface area. */
+template <int N>
+static std::vector<int> expand(const std::vector<LinearBVHNode>& bin_nodes, int index) {
+    std::vector<int> children = { index + 1, bin_nodes[index].second_child_offset };
+    while(static_cast<int>(children.size()) < N) {
+        int best = -1;
+        Float best_area = -1;
+        for(int i=0; i<static_cast<int>(children.size()); i++) {
+            const LinearBVHNode& child = bin_nodes[children[i]];
+            if(child.n_primitives == 0 && node_area(child) > best_area) {
+                best = i;
+                best_area = node_area(child);
+            }
+        }
+        if(best < 0) break;
+
+        int c = children[best];
+        children[best] = c + 1;
+        children.push_back(bin_nodes[c].second_child_offset);
+    }
+    return children;
+}
+
+// ----------------------------------------------------------------------------
+template <int N>
+WideBVH<N>::WideBVH(const LinearBVH& bvh)
+: bvh(&bvh), box(bvh.bounding())
+{
+    Assert(!bvh.is_mesh(), "WideBVH cannot be collapsed from the BVH of a mesh\n");
+    const std::vector<LinearBVHNode>& bin_nodes = bvh.getNodes();
+    if(bin_nodes.empty()) return;
+
+    nodes.reserve(bin_nodes.size() / (N / 2) + 1);
+    if(bin_nodes[0].n_primitives > 0)
+        collapse(bin_nodes, { 0 });
+    else
+        collapse(bin_nodes, expand<N>(bin_nodes, 0));
+}
+
+// ----------------------------------------------------------------------------
+template <int N>
+int WideBVH<N>::collapse(const std::vector<LinearBVHNode>& bin_nodes, const std::vector<int>& bin_children) {
+    int node_index = static_cast<int>(nodes.size());
+    nodes.emplace_back();
+
+    // Empty slots get inverted boxes, so that they are never hit.
+    for(int i=0; i<N; i++) {
+        for(int a=0; a<3; a++) {
+            nodes[node_index].bounds[0][a][i] = 1e30f;
+            nodes[node_index].bounds[1][a][i] = -1e30f;
+        }
+        nodes[node_index].children[i] = -1;
+        nodes[node_index].counts[i] = 0;
+    }
+
+    for(int i=0; i<static_cast<int>(bin_children.size()); i++) {
+        const LinearBVHNode& child = bin_nodes[bin_children[i]];
+        for(int a=0; a<3; a++) {
+            nodes[node_index].bounds[0][a][i] = child.bounds[0][a];
+            nodes[node_index].bounds[1][a][i] = child.bounds[1][a];
+        }
+
+        if(child.n_primitives > 0) {
+            Assert(child.n_primitives <= 255, "The number of primitives in a leaf must be less than 256 for WideBVH.");
+            nodes[node_index].children[i] = bin_children[i];
+            nodes[node_index].counts[i] = static_cast<uint8_t>(child.n_primitives);
+        } else {
+            int child_index = collapse(bin_nodes, expand<N>(bin_nodes, bin_children[i]));
+            nodes[node_index].children[i] = child_index;
+        }
+    }
+    return node_index;
+}
+
+// ----------------------------------------------------------------------------
+template <int N>
+bool WideBVH<N>::intersect(const Ray& r, Float t_min, Float t_max, SurfaceInteraction& si) const {
+    if(nodes.empty())
+        return false;
+
+    WideRay wr;
+    for(int a=0; a<3; a++) {
+        wr.o[a] = static_cast<float>(r.origin()[a]);
+        wr.inv_dir[a] = static_cast<float>(1.0 / r.direction()[a]);
+        wr.dir_is_neg[a] = wr.inv_dir[a] < 0;
+    }
+
+    const float t_min_f = static_cast<float>(t_min);
+    float t_max_f = static_cast<float>(t_max) * t_far_scale;
+
+    WideStackEntry to_visit[LinearBVH::max_depth * (N - 1) + 1];
+    int to_visit_offset = 0;
+    to_visit[to_visit_offset++] = { 0, 0, t_min_f };
+    bool hit = false;
+    // Closest hit in triangle blocks, whose SurfaceInteraction is filled after traversal.
+    int hit_prim = -1;
+    float hit_u = 0, hit_v = 0;
+
+    alignas(N * sizeof(float)) float t_entry[N];
+    while(to_visit_offset > 0) {
+        const WideStackEntry entry = to_visit[--to_visit_offset];
+        if(entry.t_entry > t_max_f) continue;
+
+        if(entry.count > 0) {
+            if(bvh->intersect_leaf(entry.index, r, t_min, t_max, si, hit_prim, hit_u, hit_v)) {
+                hit = true;
+                t_max_f = static_cast<float>(t_max) * t_far_scale;
+            }
+            continue;
+        }
+        const WideBVHNode<N>& node = nodes[entry.index];
+        STAT_ADD(nodes, 1);
+        STAT_ADD(box_tests, N);
+        int mask = intersect_children<N>(node.bounds, wr, t_min_f, t_max_f, t_entry);
+        push_children<N>(mask, t_entry, node.children, node.counts, to_visit, to_visit_offset);
+    }
+    bvh->set_leaf_hit(r, hit_prim, t_max, hit_u, hit_v, si);
+    return hit;
+}
+template <int N>
+bool WideBVH<N>::occluded(const Ray& r, Float t_min, Float t_max) const {
+    if(nodes.empty())
+        return false;
+
+    WideRay wr;
+    for(int a=0; a<3; a++) {
+        wr.o[a] = static_cast<float>(r.origin()[a]);
+        wr.inv_dir[a] = static_cast<float>(1.0 / r.direction()[a]);
+        wr.dir_is_neg[a] = wr.inv_dir[a] < 0;
+    }
+    const float t_min_f = static_cast<float>(t_min);
+    const float t_max_f = static_cast<float>(t_max) * t_far_scale;
+
+    int to_visit[LinearBVH::max_depth * (N - 1) + 1];
+    int to_visit_offset = 0;
+    to_visit[to_visit_offset++] = 0;
+
+    // Any hit terminates the traversal, so children need no ordering.
+    alignas(N * sizeof(float)) float t_entry[N];
+    while(to_visit_offset > 0) {
+        const WideBVHNode<N>& node = nodes[to_visit[--to_visit_offset]];
+        STAT_ADD(nodes, 1);
+        STAT_ADD(box_tests, N);
+        int mask = intersect_children<N>(node.bounds, wr, t_min_f, t_max_f, t_entry);
+        for(int i=N-1; i>=0; i--) {
+            if(!(mask & (1 << i))) continue;
+
+            if(node.counts[i] > 0) {
+                if(bvh->occluded_leaf(node.children[i], r, t_min, t_max))
+                    return true;
+            } else if(node.children[i] >= 0) {
+                to_visit[to_visit_offset++] = node.children[i];
+            }
+        }
+    }
+    return false;
+}
+
+template class WideBVH<4>;
+template class WideBVH<8>;
+
+// ----------------------------------------------------------------------------
+// Decoding is `origin + q * scale`, where `q * scale` is exact since scale is a power of two.
+static inline float dequantize(float origin, float scale, uint8_t q) {
+    return origin + static_cast<float>(q) * scale;
+}
+// 2^e for normal floats (-126 <= e <= 127), built from the exponent bits.
+static inline float exp2_int(int e) {
+    uint32_t bits = static_cast<uint32_t>(e + 127) << 23;
+    float f;
+    std::memcpy(&f, &bits, sizeof(float));
+    return f;
+}
+
+template <int N>
+CompressedWideBVH<N>::CompressedWideBVH(const WideBVH<N>& bvh)
+: bvh(&bvh.getBVH()), box(bvh.bounding())
+{
+    const std::vector<WideBVHNode<N>>& src_nodes = bvh.getNodes();
+    if(src_nodes.empty()) return;
+
+    nodes.reserve(src_nodes.size());
+    nodes.emplace_back();
+    compress(src_nodes, 0, 0);
+}
+
+/** Quantize children of `src_nodes[src]` into `nodes[dst]`, relative to the box enclosing all the children.
+ *  Interior children are allocated in a contiguous block, then compressed recursively. */
+template <int N>
+void CompressedWideBVH<N>::compress(const std::vector<WideBVHNode<N>>& src_nodes, int src, int dst)
+{
+    const WideBVHNode<N>& s = src_nodes[src];
+    CompressedWideBVHNode<N> node;
+    float lo[3], hi[3];
+    for(int a=0; a<3; a++) {
+        lo[a] = std::numeric_limits<float>::infinity();
+        hi[a] = -std::numeric_limits<float>::infinity();
+    }
+    int n_interior = 0;
+    for(int i=0; i<N; i++) {
+        if(s.counts[i] == 0 && s.children[i] < 0) {
+            node.counts[i] = CompressedWideBVHNode<N>::empty_slot;
+            continue;
+        }
+        Assert(s.counts[i] < CompressedWideBVHNode<N>::empty_slot, 
+               "The number of primitives in a leaf must be less than 255 for CompressedWideBVH.");
+        node.counts[i] = s.counts[i];
+        n_interior += s.counts[i] == 0;
+        for(int a=0; a<3; a++) {
+            lo[a] = std::min(lo[a], s.bounds[0][a][i]);
+            hi[a] = std::max(hi[a], s.bounds[1][a][i]);
+        }
+    }
+
+    for(int a=0; a<3; a++) {
+        // The smallest power of two, with which 255 steps from the origin cover the box.
+        node.origin[a] = lo[a];
+        int e = hi[a] > lo[a] ? static_cast<int>(std::ceil(std::log2((hi[a] - lo[a]) / 255.0f))) : -126;
+        e = std::max(e, -126);
+        while(e < 127 && dequantize(lo[a], exp2_int(e), 255) < hi[a]) e++;
+        node.exponent[a] = static_cast<int8_t>(e);
+        const float scale = exp2_int(e);
+
+        for(int i=0; i<N; i++) {
+            if(node.counts[i] == CompressedWideBVHNode<N>::empty_slot) {
+                node.q[0][a][i] = node.q[1][a][i] = 0;
+                continue;
+            }
+            // Round outward, and fix up the cases where float rounding of the decoded value moves it inward.
+            int q0 = std::clamp(static_cast<int>(std::floor((s.bounds[0][a][i] - lo[a]) / scale)), 0, 255);
+            int q1 = std::clamp(static_cast<int>(std::ceil((s.bounds[1][a][i] - lo[a]) / scale)), 0, 255);
+            while(q0 > 0 && dequantize(lo[a], scale, q0) > s.bounds[0][a][i]) q0--;
+            while(q1 < 255 && dequantize(lo[a], scale, q1) < s.bounds[1][a][i]) q1++;
+            node.q[0][a][i] = static_cast<uint8_t>(q0);
+            node.q[1][a][i] = static_cast<uint8_t>(q1);
+        }
+    }
+
+    node.child_base = static_cast<int>(nodes.size());
+    node.leaf_base = static_cast<int>(leaves.size());
+    for(int i=0; i<N; i++) {
+        if(node.counts[i] == 0 || node.counts[i] == CompressedWideBVHNode<N>::empty_slot) continue;
+        leaves.push_back(s.children[i]);
+    }
+    nodes.resize(nodes.size() + n_interior);
+    nodes[dst] = node;
+
+    int child = node.child_base;
+    for(int i=0; i<N; i++) {
+        if(node.counts[i] == 0)
+            compress(src_nodes, s.children[i], child++);
+    }
+}
+
+// ----------------------------------------------------------------------------
+/** Decode child boxes of a node, and compute the node index or the index into `leaves` of each child. 
+ *  Returns the mask of non-empty children. */
+template <int N>
+static inline int decode(const CompressedWideBVHNode<N>& node, float (&bounds)[2][3][N], int (&index)[N]) {
+    for(int a=0; a<3; a++) {
+        const float scale = exp2_int(node.exponent[a]);
+        for(int i=0; i<N; i++) {
+            bounds[0][a][i] = dequantize(node.origin[a], scale, node.q[0][a][i]);
+            bounds[1][a][i] = dequantize(node.origin[a], scale, node.q[1][a][i]);
+        }
+    }
+    int valid = 0;
+    int child = node.child_base, leaf = node.leaf_base;
+    for(int i=0; i<N; i++) {
+        index[i] = -1;
+        if(node.counts[i] == CompressedWideBVHNode<N>::empty_slot) continue;
+        valid |= 1 << i;
+        index[i] = node.counts[i] == 0 ? child++ : leaf++;
+    }
+    return valid;
+}
+
+template <int N>
+bool CompressedWideBVH<N>::intersect(const Ray& r, Float t_min, Float t_max, SurfaceInteraction& si) const {
+    if(nodes.empty())
+        return false;
+
+    WideRay wr;
+    for(int a=0; a<3; a++) {
+        wr.o[a] = static_cast<float>(r.origin()[a]);
+        wr.inv_dir[a] = static_cast<float>(1.0 / r.direction()[a]);
+        wr.dir_is_neg[a] = wr.inv_dir[a] < 0;
+    }
+
+    const float t_min_f = static_cast<float>(t_min);
+    float t_max_f = static_cast<float>(t_max) * t_far_scale;
+
+    WideStackEntry to_visit[LinearBVH::max_depth * (N - 1) + 1];
+    int to_visit_offset = 0;
+    to_visit[to_visit_offset++] = { 0, 0, t_min_f };
+    bool hit = false;
+    // Closest hit in triangle blocks, whose SurfaceInteraction is filled after traversal.
+    int hit_prim = -1;
+    float hit_u = 0, hit_v = 0;
+
+    alignas(N * sizeof(float)) float bounds[2][3][N];
+    alignas(N * sizeof(float)) float t_entry[N];
+    int index[N];
+    while(to_visit_offset > 0) {
+        const WideStackEntry entry = to_visit[--to_visit_offset];
+        if(entry.t_entry > t_max_f) continue;
+
+        if(entry.count > 0) {
+            if(bvh->intersect_leaf(leaves[entry.index], r, t_min, t_max, si, hit_prim, hit_u, hit_v)) {
+                hit = true;
+                t_max_f = static_cast<float>(t_max) * t_far_scale;
+            }
+            continue;
+        }
+        const CompressedWideBVHNode<N>& node = nodes[entry.index];
+        STAT_ADD(nodes, 1);
+        STAT_ADD(box_tests, N);
+        int mask = decode(node, bounds, index) & intersect_children<N>(bounds, wr, t_min_f, t_max_f, t_entry);
+        push_children<N>(mask, t_entry, index, node.counts, to_visit, to_visit_offset);
+    }
+    bvh->set_leaf_hit(r, hit_prim, t_max, hit_u, hit_v, si);
+    return hit;
+}
+template <int N>
+bool CompressedWideBVH<N>::occluded(const Ray& r, Float t_min, Float t_max) const {
+    if(nodes.empty())
+        return false;
+
+    WideRay wr;
+    for(int a=0; a<3; a++) {
+        wr.o[a] = static_cast<float>(r.origin()[a]);
+        wr.inv_dir[a] = static_cast<float>(1.0 / r.direction()[a]);
+        wr.dir_is_neg[a] = wr.inv_dir[a] < 0;
+    }
+    const float t_min_f = static_cast<float>(t_min);
+    const float t_max_f = static_cast<float>(t_max) * t_far_scale;
+
+    int to_visit[LinearBVH::max_depth * (N - 1) + 1];
+    int to_visit_offset = 0;
+    to_visit[to_visit_offset++] = 0;
+
+    alignas(N * sizeof(float)) float bounds[2][3][N];
+    alignas(N * sizeof(float)) float t_entry[N];
+    int index[N];
+    while(to_visit_offset > 0) {
+        const CompressedWideBVHNode<N>& node = nodes[to_visit[--to_visit_offset]];
+        STAT_ADD(nodes, 1);
+        STAT_ADD(box_tests, N);
+        int mask = decode(node, bounds, index) & intersect_children<N>(bounds, wr, t_min_f, t_max_f, t_entry);
+        for(int i=N-1; i>=0; i--) {
+            if(!(mask & (1 << i))) continue;
+
+            if(node.counts[i] > 0) {
+                if(bvh->occluded_leaf(leaves[index[i]], r, t_min, t_max))
+                    return true;
+            } else {
+                to_visit[to_visit_offset++] = index[i];
+            }
+        }
+    }
+    return false;
+}
+
+template class CompressedWideBVH<4>;
+template class CompressedWideBVH<8>;
+
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include "bvh.h"
+
+namespace mypt {
+
+/** \brief Node of WideBVH with N children.
+ *  Child bounds are stored as structure of arrays, so that all children
+ *  are tested against a ray at once with SSE (N=4) or AVX (N=8).
+ *  `counts[i] > 0` means the i-th child is a leaf of `counts[i]` primitives, and `children[i]` is
+ *  the leaf node in the binary LinearBVH, otherwise the index of a child node or -1 for an empty slot. */
+template <int N>
+struct alignas(N * sizeof(float)) WideBVHNode {
+    float bounds[2][3][N];      // [min/max][axis][child]
+    int children[N];
+    uint8_t counts[N];
+};
+
+/** \brief N-wide BVH built by collapsing a binary LinearBVH.
+ *  N is 4 (SSE) or 8 (AVX, scalar fallback when AVX is not enabled).
+ *  Leaves are traced by the LinearBVH with its triangle blocks, so it must outlive this BVH.
+ *  Child boxes are the bounds over the whole shutter interval, as motion bounds of LinearBVH 
+ *  interpolated by ray time are not carried over. */
+template <int N>
+class WideBVH final : public Primitive {
+public:
+    explicit WideBVH(const LinearBVH& bvh);
+
+    bool intersect(const Ray& r, Float t_min, Float t_max, SurfaceInteraction& si) const override;
+    bool occluded(const Ray& r, Float t_min, Float t_max) const override;
+    AABB bounding() const override { return box; }
+
+    PrimitiveType type() const override { return PrimitiveType::WideBVH; }
+
+    size_t num_nodes() const { return nodes.size(); }
+    size_t node_bytes() const { return nodes.size() * sizeof(WideBVHNode<N>); }
+    const std::vector<WideBVHNode<N>>& getNodes() const { return nodes; }
+    const LinearBVH& getBVH() const { return *bvh; }
+
+    std::string to_string() const override {
+        std::ostringstream oss;
+        oss << "WideBVH<" << N << "> : {" << std::endl;
+        oss << "\tPrimitives : " << bvh->getPrimitives().size() << "," << std::endl;
+        oss << "\tNodes : " << nodes.size() << std::endl;
+        oss << "}";
+        return oss.str();
+    }
+private:
+    int collapse(const std::vector<LinearBVHNode>& bin_nodes, const std::vector<int>& bin_children);
+
+    const LinearBVH* bvh;
+    std::vector<WideBVHNode<N>> nodes;
+    AABB box;
+};
+
+// ----------------------------------------------------------------------------
+/** \brief Node of CompressedWideBVH.
+ *  Child bounds are quantized to 8 bits on the grid `origin + q * 2^exponent` of each axis
+ *  and rounded outward, so that the decoded box always contains the child.
+ *  Interior children are stored contiguously from `child_base` and binary leaf nodes of leaf 
+ *  children from `leaf_base`, so that no index is needed per child. */
+template <int N>
+struct CompressedWideBVHNode {
+    static constexpr uint8_t empty_slot = 255;
+
+    float origin[3];
+    int8_t exponent[3];
+    uint8_t pad[1];
+    int child_base;
+    int leaf_base;
+    uint8_t q[2][3][N];         // [min/max][axis][child]
+    uint8_t counts[N];          // 0 -> interior, empty_slot -> unused, otherwise size of leaf
+};
+
+/** \brief WideBVH with quantized child bounds, which takes 52 (N=4) or 80 (N=8) bytes per node
+ *  instead of 128 or 256 bytes. Boxes are decoded during traversal and tested as in WideBVH. */
+template <int N>
+class CompressedWideBVH final : public Primitive {
+public:
+    explicit CompressedWideBVH(const WideBVH<N>& bvh);
+
+    bool intersect(const Ray& r, Float t_min, Float t_max, SurfaceInteraction& si) const override;
+    bool occluded(const Ray& r, Float t_min, Float t_max) const override;
+    AABB bounding() const override { return box; }
+
+    PrimitiveType type() const override { return PrimitiveType::CompressedWideBVH; }
+
+    size_t num_nodes() const { return nodes.size(); }
+    size_t node_bytes() const { return nodes.size() * sizeof(CompressedWideBVHNode<N>); }
+
+    std::string to_string() const override {
+        std::ostringstream oss;
+        oss << "CompressedWideBVH<" << N << "> : {" << std::endl;
+        oss << "\tPrimitives : " << bvh->getPrimitives().size() << "," << std::endl;
+        oss << "\tNodes : " << nodes.size() << std::endl;
+        oss << "}";
+        return oss.str();
+    }
+private:
+    void compress(const std::vector<WideBVHNode<N>>& src_nodes, int src, int dst);
+
+    const LinearBVH* bvh;
+    std::vector<int> leaves;    // Leaf node in the binary LinearBVH of each leaf child
+    std::vector<CompressedWideBVHNode<N>> nodes;
+    AABB box;
+};
+
+}
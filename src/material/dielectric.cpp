@@ -27,9 +27,9 @@ bool Dielectric::scatter(
 
     Float reflect_prob = fr(cosine, ni, nt);
     if (cannot_refract || reflect_prob > random_float())
-        si.scattered = Ray(si.p, reflect(wi, outward_normal));
+        si.scattered = Ray(si.p, reflect(wi, outward_normal), r_in.time());
     else
-        si.scattered = Ray(si.p, refract(wi, outward_normal, cosine, ni, nt));
+        si.scattered = Ray(si.p, refract(wi, outward_normal, cosine, ni, nt), r_in.time());
     return true;
 }
 
@@ -1,4 +1,5 @@
 #include "emitter.h"
+#include "../core/color.h"
 
 namespace mypt {
 
@@ -11,4 +12,8 @@ vec3 Emitter::emitted(const Ray& /* r_in */, const SurfaceInteraction& si) const
     return albedo->value(si.uv, si.p) * intensity;
 }
 
+Float Emitter::emitted_luminance() const {
+    return luminance(albedo->value(vec2(0.5, 0.5), vec3(0.0))) * intensity;
+}
+
 }
\ No newline at end of file
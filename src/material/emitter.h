@@ -16,6 +16,8 @@ public:
     : albedo(std::make_shared<ConstantTexture>(a)), intensity(intensity) {}
 
     vec3 emitted(const Ray& r_in, const SurfaceInteraction& si) const override;
+    // Textures are estimated at their center.
+    Float emitted_luminance() const override;
     bool scatter(const Ray& r_in, SurfaceInteraction& si) const override;
 
     std::string to_string() const override {
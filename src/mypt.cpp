@@ -1,11 +1,43 @@
 #include "core/mypt.h"
+#include "core/load3d.h"
 
 using namespace mypt;
 
-int main(int /* argc */, const char * argv[]) {
+int main(int argc, const char * argv[]) {
+    if(argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " [--bench] <scene file>" << std::endl;
+        std::cerr << "       " << argv[0] << " --bake-mesh-cache <mesh files...>" << std::endl;
+        std::cerr << "       " << argv[0] << " --bench-ply <ply files...>" << std::endl;
+        return 1;
+    }
+
     // Change seed of randaom value
     srand((unsigned)time(NULL));
 
+    // `--bench` only measures traversal throughput of the acceleration structures.
+    if(std::string(argv[1]) == "--bench") {
+        Assert(argc >= 3, "Scene file is required for --bench\n");
+        Scene scene(argv[2]);
+        scene.benchmark();
+        return 0;
+    }
+
+    // `--bake-mesh-cache` parses meshes and writes their caches, e.g. before distributing assets.
+    if(std::string(argv[1]) == "--bake-mesh-cache") {
+        Assert(argc >= 3, "Mesh files are required for --bake-mesh-cache\n");
+        for(int i=2; i<argc; i++)
+            TriangleMesh mesh(argv[i], true, MeshCacheMode::Rebuild);
+        return 0;
+    }
+
+    // `--bench-ply` compares the streaming PLY loader with the happly one.
+    if(std::string(argv[1]) == "--bench-ply") {
+        Assert(argc >= 3, "PLY files are required for --bench-ply\n");
+        for(int i=2; i<argc; i++)
+            benchmarkPly(argv[i]);
+        return 0;
+    }
+
     std::string filename = argv[1];
     Scene scene(filename);
     scene.render();
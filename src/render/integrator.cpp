@@ -1,97 +1,158 @@
 #include "integrator.h"
 #include "../core/pdf.h"
+#include "../core/color.h"
 
 namespace mypt {
 
-/** 
- * \todo 
- * - Recursive tracing is not good at implementaion of next event estimation.
- * 
- * - Terminating ray tracing when ray intersect with an emitter will result in incorrect result
- *   because the contribution from background color will be not reflected.
- */
-
 vec3 Integrator::trace(
-    Ray& r, const BVHNode& bvh_node, std::vector<std::shared_ptr<Primitive>>& lights, const vec3& background, int depth
+    Ray& r, const Primitive& accel, const LightBVH& lights, const Envmap& envmap, int depth
 ) const {
     SurfaceInteraction si;
     if(depth <= 0)
         return vec3(0.0, 0.0, 0.0);
 
-    if(!bvh_node.intersect(r, eps, infinity, si))
-        return background;
+    STAT_ADD(rays, 1);
+    bool hit = accel.intersect(r, eps, infinity, si);
+    return trace(r, hit, si, accel, lights, envmap, depth);
+}
 
-    vec3 emitted = si.mat_ptr->emitted(r, si);
-    if(!si.mat_ptr->scatter(r, si))
-        return emitted;
+// Weight of a sample of strategy `a` combined with strategy `b` by the power heuristic (beta = 2).
+static inline Float power_heuristic(Float pdf_a, Float pdf_b) {
+    Float a = pdf_a * pdf_a, b = pdf_b * pdf_b;
+    return a + b > 0 ? a / (a + b) : 0;
+}
 
-    if(si.is_specular) {
-        return si.attenuation
-            * trace(si.scattered, bvh_node, lights, background, depth-1);
-    } 
+// Probability of sampling the environment instead of the lights, in proportion to their power.
+static inline Float envmap_probability(const LightBVH& lights, const Envmap& envmap) {
+    if(envmap.is_black())
+        return 0;
+    if(lights.empty())
+        return 1;
+    const Float envmap_power = envmap.power();
+    return envmap_power > 0 ? envmap_power / (envmap_power + lights.power()) : 0;
+}
 
-    std::shared_ptr<PDF> pdf_ptr;
-    if (lights.size() > 0) {
-        auto light_ptr = std::make_shared<LightPDF>(lights, si.p);
-        pdf_ptr = std::make_shared<MixturePDF>(light_ptr, si.pdf_ptr);
-    } else {
-        pdf_ptr = std::make_shared<CosinePDF>(si.n);
+/**
+ * Paths are traced iteratively, accumulating emission weighted by the throughput
+ * (product of attenuation * BSDF / pdf) of the path so far. From `rr_depth` bounces, a path
+ * survives with probability of its throughput luminance (at most 0.95) and its throughput
+ * is divided by it, so that dark paths end early without bias. `depth` still bounds the
+ * number of bounces.
+ *
+ * At non-specular vertices, a light chosen by the light BVH is sampled directly with a shadow
+ * ray (next event estimation), and the next direction is sampled from the BSDF. Emission found by either
+ * strategy is weighted by the power heuristic against the density of the other, so that
+ * both small lights and glossy reflections of large ones converge quickly.
+ * The environment is sampled as one more light, chosen against the lights of the scene in
+ * proportion to its power.
+ */
+vec3 Integrator::trace(
+    Ray& r, bool hit, SurfaceInteraction& si, const Primitive& accel, 
+    const LightBVH& lights, const Envmap& envmap, int depth
+) const {
+    vec3 radiance(0.0), throughput(1.0);
+    Ray ray = r;
+    // BSDF sampling density of the last bounce, which is 0 after camera or specular bounces
+    // whose emission is not sampled by lights.
+    Float bsdf_pdf = 0;
+    vec3 origin = ray.origin(), origin_n;
+    const Float envmap_prob = envmap_probability(lights, envmap);
+    for(int bounce=0; bounce<depth; bounce++) {
+        if(bounce > 0) {
+            si = SurfaceInteraction();
+            STAT_ADD(rays, 1);
+            hit = accel.intersect(ray, eps, infinity, si);
+        }
+        if(!hit) {
+            vec3 emitted = envmap.eval(ray.direction());
+            if(bsdf_pdf > 0 && envmap_prob > 0)
+                emitted *= power_heuristic(bsdf_pdf, envmap_prob * envmap.pdf(ray.direction()));
+            radiance += throughput * emitted;
+            break;
+        }
+
+        vec3 emitted = si.mat_ptr->emitted(ray, si);
+        if(bsdf_pdf > 0 && !lights.empty() && !emitted.is_near_zero()) {
+            const Float pmf = lights.pmf(origin, origin_n, si.prim);
+            const Float light_pdf = pmf > 0 ? (1 - envmap_prob) * pmf * si.prim->pdf_value(origin, ray.direction()) : 0;
+            emitted *= power_heuristic(bsdf_pdf, light_pdf);
+        }
+        radiance += throughput * emitted;
+        if(!si.mat_ptr->scatter(ray, si))
+            break;
+
+        if(si.is_specular) {
+            throughput = throughput * si.attenuation;
+            bsdf_pdf = 0;
+        }
+        else {
+            // Light reached by the shadow ray counts as the next bounce.
+            if((!lights.empty() || envmap_prob > 0) && bounce + 1 < depth)
+                radiance += throughput * sample_light(ray, si, accel, lights, envmap, envmap_prob);
+
+            si.scattered = Ray(si.p, si.pdf_ptr->generate(), ray.time());
+            bsdf_pdf = si.pdf_ptr->value(si.scattered.direction());
+            if(bsdf_pdf <= 0)
+                break;
+            throughput = throughput * si.attenuation * si.mat_ptr->scattering_pdf(ray, si) / bsdf_pdf;
+            origin = si.p;
+            origin_n = si.n;
+        }
+        ray = si.scattered;
+
+        // Russian roulette
+        if(bounce + 1 >= rr_depth) {
+            Float survival = std::min(luminance(throughput), Float(0.95));
+            if(!(survival > 0) || random_float() >= survival)
+                break;
+            throughput /= survival;
+        }
     }
-    si.scattered = Ray(si.p, pdf_ptr->generate(), r.time());
-    auto pdf = pdf_ptr->value(si.scattered.direction());
-
-    /// \todo NEE: Launch shadow ray from diffuse surface to lights.
+    return radiance;
+}
 
-    if(pdf > 0) {
-        return emitted
-            + si.attenuation * si.mat_ptr->scattering_pdf(r, si)
-                * trace(si.scattered, bvh_node, lights, background, depth-1) / pdf;
-    } else {
-        return emitted;
+vec3 Integrator::sample_light(
+    const Ray& r, SurfaceInteraction& si, const Primitive& accel,
+    const LightBVH& lights, const Envmap& envmap, Float envmap_prob
+) const {
+    if(random_float() < envmap_prob) {
+        Float pdf;
+        Ray shadow(si.p, envmap.sample(pdf), r.time());
+        pdf *= envmap_prob;
+        si.scattered = shadow;
+        const Float scattering_pdf = si.mat_ptr->scattering_pdf(r, si);
+        if(scattering_pdf <= 0 || pdf <= 0 || trace_occlusion(shadow, accel, eps, infinity))
+            return vec3(0.0);
+        const Float weight = power_heuristic(pdf, si.pdf_ptr->value(shadow.direction()));
+        return si.attenuation * envmap.eval(shadow.direction()) * (scattering_pdf * weight / pdf);
     }
+
+    Float pmf;
+    const Primitive* light = lights.sample(si.p, si.n, pmf);
+    if(!light)
+        return vec3(0.0);
+    Ray shadow(si.p, light->random(si.p), r.time());
+    // The sampled point is at t = 1, which is hidden when the light (e.g. a concave mesh) is hit before it.
+    SurfaceInteraction light_si;
+    if(!light->intersect(shadow, eps, infinity, light_si) || light_si.t < 1 - 1e-6)
+        return vec3(0.0);
+
+    si.scattered = shadow;
+    const Float scattering_pdf = si.mat_ptr->scattering_pdf(r, si);
+    const Float pdf = (1 - envmap_prob) * pmf * light->pdf_value(si.p, shadow.direction());
+    if(scattering_pdf <= 0 || pdf <= 0)
+        return vec3(0.0);
+    // The light itself is excluded from the shadow ray.
+    if(trace_occlusion(shadow, accel, eps, light_si.t * (1 - 1e-4)))
+        return vec3(0.0);
+
+    const Float weight = power_heuristic(pdf, si.pdf_ptr->value(shadow.direction()));
+    return si.attenuation * light_si.mat_ptr->emitted(shadow, light_si) * (scattering_pdf * weight / pdf);
 }
 
-/** \todo This implementation still don't release correct result. */
-// vec3 Integrator::trace(
-//     Ray& r, const BVHNode& bvh_node, std::vector<std::shared_ptr<Primitive>>& lights, const vec3& background, int depth
-// ) const {
-//     vec3 result;
-//     for (int i = 0; i < depth; i++) {
-//         SurfaceInteraction si;
-//         vec3 radiance; 
-//         vec3 emission;
-//         si.attenuation = vec3(1.0);
-
-//         if (!bvh_node.intersect(r, eps, infinity, si)) {
-//             result += background * si.attenuation;
-//             break;
-//         }
-
-//         emission = si.mat_ptr->emitted(r, si);
-//         if (!si.mat_ptr->scatter(r, si)) {
-//             break;
-//         }
-
-//         Float pdf = 1.0f;
-//         if (!si.is_specular) {
-//             auto light_ptr = std::make_shared<LightPDF>(lights, si.p);
-//             MixturePDF p(light_ptr, si.pdf_ptr);
-//             si.scattered = Ray(si.p, p.generate(), r.time());
-//             pdf = p.value(si.scattered.direction());
-//         }
-
-//         // rendering equation
-//         result += emission;
-//         result += si.attenuation * si.mat_ptr->scattering_pdf(r, si) * radiance / pdf;
-
-//         r = si.scattered;
-//     }
-//     return result;
-// }
-
-bool Integrator::trace_occlusion(Ray& r, const BVHNode& bvh_node, Float t_min, Float t_max) const {
-    SurfaceInteraction si;
-    return bvh_node.intersect(r, t_min, t_max, si);
+bool Integrator::trace_occlusion(Ray& r, const Primitive& accel, Float t_min, Float t_max) const {
+    STAT_ADD(rays, 1);
+    return accel.occluded(r, t_min, t_max);
 }
 
 }
\ No newline at end of file
@@ -13,6 +13,8 @@
 #include "../core/ray.h"
 #include "../core/bvh.h"
 #include "../core/primitive.h"
+#include "../core/light_bvh.h"
+#include "../core/envmap.h"
 
 namespace mypt {
 
@@ -23,14 +25,31 @@ public:
     enum class TraceType { PATH };
     explicit Integrator() {}
     explicit Integrator(TraceType type) : type(type) {}
+    /// \brief Paths of `rr_depth` or more bounces are terminated by Russian roulette.
+    explicit Integrator(TraceType type, int rr_depth) : type(type), rr_depth(rr_depth) {}
+    /// \brief `accel` is the acceleration structure of the scene (BVHNode or LinearBVH).
     vec3 trace(
-        Ray& r, const BVHNode& bvh_node, std::vector<std::shared_ptr<Primitive>>& lights, const vec3& background, int depth
+        Ray& r, const Primitive& accel, const LightBVH& lights, const Envmap& envmap, int depth
+    ) const;
+    /// \brief Continue tracing from the first hit `si` of `r`, which is already found (e.g. by packet traversal).
+    vec3 trace(
+        Ray& r, bool hit, SurfaceInteraction& si, const Primitive& accel, 
+        const LightBVH& lights, const Envmap& envmap, int depth
     ) const;
 
     /// \brief Check if surface is occluded by the other primitives.
-    bool trace_occlusion(Ray& r, const BVHNode& bvh_node, Float t_min, Float t_max) const;
+    bool trace_occlusion(Ray& r, const Primitive& accel, Float t_min, Float t_max) const;
 private:
+    /// \brief Radiance from a point sampled on a light chosen from `lights`, or from a direction sampled
+    /// on `envmap` with probability `envmap_prob`, and scattered at `si` toward `r`, weighted for MIS
+    /// with BSDF sampling. `si.scattered` is overwritten.
+    vec3 sample_light(
+        const Ray& r, SurfaceInteraction& si, const Primitive& accel,
+        const LightBVH& lights, const Envmap& envmap, Float envmap_prob
+    ) const;
+
     TraceType type;
+    int rr_depth = 3;
 };
 
 }
\ No newline at end of file
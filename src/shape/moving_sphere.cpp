@@ -49,6 +49,13 @@ AABB MovingSphere::bounding() const {
     return surrounding(box0, box1);
 }
 
+// The center moves linearly, so bounds at the shutter times are interpolated exactly.
+bool MovingSphere::motion_bounding(AABB& b0, AABB& b1) const {
+    b0 = AABB(center(0) - vec3(radius, radius, radius), center(0) + vec3(radius, radius, radius));
+    b1 = AABB(center(1) - vec3(radius, radius, radius), center(1) + vec3(radius, radius, radius));
+    return true;
+}
+
 std::shared_ptr<Shape> createMovingSphere(vec3 cen0, vec3 cen1, Float t0, Float t1, Float r) {
     return std::make_shared<MovingSphere>(cen0, cen1, t0, t1, r);
 }
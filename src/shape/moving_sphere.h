@@ -12,14 +12,15 @@ public:
         : center0(cen0), center1(cen1), time0(t0), time1(t1), radius(r)
     {};
 
-    bool intersect(const Ray& r, Float tmin, Float tmax, SurfaceInteraction& si) const;
-    AABB bounding() const;
+    bool intersect(const Ray& r, Float tmin, Float tmax, SurfaceInteraction& si) const override;
+    AABB bounding() const override;
+    bool motion_bounding(AABB& b0, AABB& b1) const override;
 
     vec3 center(Float time) const;
 
     std::string to_string() const override {
         std::ostringstream oss;
-        oss << "FilpFace : {" << std::endl;
+        oss << "MovingSphere : {" << std::endl;
         oss << "\tCenter0 : " << center0 << ", ";
         oss << "\tCenter1 : " << center1 << ", " << std::endl;
         oss << "\tTime0 : " << time0 << ", ";
@@ -14,6 +14,8 @@ public:
 
     Float pdf_value(const vec3&, const vec3&) const override;
     vec3 random(const vec3&) const override;
+    Float area() const override { return (max[0]-min[0]) * (max[1]-min[1]); }
+    bool flat_normal(vec3& n) const override { n = vec3(0, 1, 0); return true; }
 
     std::string to_string() const override {
         std::ostringstream oss;
@@ -58,7 +58,10 @@ vec3 Sphere::random(const vec3& o) const {
     auto distance_squared = direction.length_squared();
     ONB onb;
     onb.build_from_w(direction);
-    return onb.local(random_to_sphere(radius, distance_squared));
+    vec3 v = onb.local(random_to_sphere(radius, distance_squared));
+    // Scaled to reach the sampled point, where the direction first hits the sphere.
+    SurfaceInteraction si;
+    return this->intersect(Ray(o, v), eps, infinity, si) ? si.t * v : v;
 }
 
 // -----------------------------------------------------------------------
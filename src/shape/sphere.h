@@ -13,6 +13,7 @@ public:
     AABB bounding() const;
     Float pdf_value(const vec3& o, const vec3& v) const override;
     vec3 random(const vec3& o) const override;
+    Float area() const override { return 4 * pi * radius * radius; }
 
     std::string to_string() const override {
         std::ostringstream oss;
@@ -1,54 +1,125 @@
 #include "triangle.h"
 #include "../core/load3d.h"
+#include <omp.h>
 
 namespace mypt {
 
 // ---------------------------------------------------------------------------
-TriangleMesh::TriangleMesh(const std::string &filename, bool isSmooth) {
-    if (filename.substr(filename.length() - 4) == ".obj") {
-        Message("Loading OBJ file '", filename, "' ...");
-        loadObj(filename, vertices, normals, faces, texcoords);
+TriangleMesh::TriangleMesh(const std::string &filename, bool isSmooth, MeshCacheMode cache_mode) : filename(filename) {
+    MeshCacheData data;
+    const double start = omp_get_wtime();
+    if(cache_mode == MeshCacheMode::Use && read_mesh_cache(filename, data)) {
+        Message("Mapped mesh cache '", mesh_cache_path(filename), "': ", data.vertices.size(), " vertices, ",
+                data.faces.size(), " triangles in ", omp_get_wtime() - start, " s");
     }
-    else if (filename.substr(filename.length() - 4) == ".ply") {
-        Message("Loading PLY file '", filename, "' ...");
-        loadPly(filename, vertices, normals, faces, texcoords);
-    }
-    
-    if(isSmooth) {
-        normals.resize(vertices.size());
-        auto counts = std::vector<int>(vertices.size(), 0);
-        for(auto &face : faces)
-        {
-            auto p0 = vertices[face[0]];
-            auto p1 = vertices[face[1]];
-            auto p2 = vertices[face[2]];
-            auto N = normalize(cross(p2-p0, p1-p0));
-
-            // Normal smoothing
-            auto idx = face[0];
-            normals[idx] += N;
-            counts[idx]++;
-            idx = face[1];
-            normals[idx] += N;
-            counts[idx]++;
-            idx = face[2];
-            normals[idx] += N;
-            counts[idx]++;
+    else {
+        std::vector<float3> vertices, normals;
+        std::vector<int3> faces;
+        std::vector<float2> texcoords;
+        if (filename.substr(filename.length() - 4) == ".obj") {
+            Message("Loading OBJ file '", filename, "' ...");
+            loadObj(filename, vertices, normals, faces, texcoords);
+        }
+        else if (filename.substr(filename.length() - 4) == ".ply") {
+            Message("Loading PLY file '", filename, "' ...");
+            loadPly(filename, vertices, normals, faces, texcoords);
         }
-        for (auto i = 0; i < (int)vertices.size(); i++)
-        {
-            normals[i] /= counts[i];
-            normals[i] = normalize(normals[i]);
+        else {
+            Throw("Unsupported mesh format of '"+filename+"'\n");
+        }
+
+        // Normals of the file are used for smooth shading, or else averaged from faces.
+        // They are cached in any case, so that the cache serves both shadings.
+        if(normals.size() != vertices.size() && (isSmooth || cache_mode != MeshCacheMode::Off))
+            computeSmoothNormals(vertices, faces, normals);
+        data.vertices = std::move(vertices);
+        data.normals = std::move(normals);
+        data.faces = std::move(faces);
+        data.texcoords = std::move(texcoords);
+        if(cache_mode != MeshCacheMode::Off && write_mesh_cache(filename, data))
+            Message("Wrote mesh cache '", mesh_cache_path(filename), "'");
+    }
+
+    cache_file = data.file;
+    vertices = std::move(data.vertices);
+    faces = std::move(data.faces);
+    texcoords = std::move(data.texcoords);
+    // Flat shading uses the geometric normal.
+    if(isSmooth)
+        normals = std::move(data.normals);
+}
+
+vec3 TriangleMesh::normal_at(const int3& face, float u, float v) const {
+    // ===== Flat shading =====
+    if(normals.empty()) {
+        vec3 e1 = vec3(vertices[face[1]]) - vec3(vertices[face[0]]);
+        vec3 e2 = vec3(vertices[face[2]]) - vec3(vertices[face[0]]);
+        return normalize(cross(e2, e1));
+    }
+    // ===== Smooth shading =====
+    vec3 n0 = normals[face[0]];
+    vec3 n1 = normals[face[1]];
+    vec3 n2 = normals[face[2]];
+    return normalize((1.0f - u - v)*n0 + u*n1 + v*n2);
+}
+
+vec2 TriangleMesh::uv_at(const int3& face, float u, float v) const {
+    if(texcoords.empty())
+        return vec2(u, v);
+    vec2 uv0 = texcoords[face[0]];
+    vec2 uv1 = texcoords[face[1]];
+    vec2 uv2 = texcoords[face[2]];
+    return (1.0f - u - v)*uv0 + u*uv1 + v*uv2;
+}
+
+// ---------------------------------------------------------------------------
+AABB clip_triangle(const vec3 p[3], const AABB& box) {
+    std::vector<vec3> polygon(p, p + 3), clipped;
+
+    for(int a=0; a<3 && !polygon.empty(); a++) {
+        for(int side=0; side<2 && !polygon.empty(); side++) {
+            // Points with d >= 0 are inside the plane.
+            auto d = [&](const vec3& p) { return side == 0 ? p[a] - box.min()[a] : box.max()[a] - p[a]; };
+            clipped.clear();
+            for(size_t i=0; i<polygon.size(); i++) {
+                const vec3& p0 = polygon[i];
+                const vec3& p1 = polygon[(i+1) % polygon.size()];
+                Float d0 = d(p0), d1 = d(p1);
+                if(d0 >= 0) clipped.push_back(p0);
+                if((d0 >= 0) != (d1 >= 0))
+                    clipped.push_back(p0 + (d0 / (d0 - d1)) * (p1 - p0));
+            }
+            std::swap(polygon, clipped);
         }
     }
+
+    if(polygon.empty()) {
+        AABB triangle_box(p[0], p[0]);
+        for(int i=1; i<3; i++)
+            triangle_box = surrounding(triangle_box, p[i]);
+        return intersection(triangle_box, box);
+    }
+
+    AABB clipped_box(polygon[0], polygon[0]);
+    for(size_t i=1; i<polygon.size(); i++)
+        clipped_box = surrounding(clipped_box, polygon[i]);
+    // Snap to the clipping planes, which the interpolated points only reach approximately.
+    return intersection(clipped_box, box);
+}
+
+AABB Triangle::clipped_bounding(const AABB& box, const mat4& to_world) const {
+    vec3 p[3];
+    for(int i=0; i<3; i++)
+        p[i] = mat4::point_mul(to_world, mesh->vertices[face[i]]);
+    return clip_triangle(p, box);
 }
 
 // ---------------------------------------------------------------------------
 // ref: https://pheema.hatenablog.jp/entry/ray-tdriangle-intersection
-bool Triangle::intersect(const Ray& r, Float t_min , Float t_max, SurfaceInteraction& si) const {
-    auto p0 = mesh->vertices[face[0]];
-    auto p1 = mesh->vertices[face[1]];
-    auto p2 = mesh->vertices[face[2]];
+bool Triangle::hit(const Ray& r, Float t_min, Float t_max, float& t, float& u, float& v) const {
+    vec3 p0 = mesh->vertices[face[0]];
+    vec3 p1 = mesh->vertices[face[1]];
+    vec3 p2 = mesh->vertices[face[2]];
 
     vec3 e1 = p1 - p0;
     vec3 e2 = p2 - p0;
@@ -62,43 +133,61 @@ bool Triangle::intersect(const Ray& r, Float t_min , Float t_max, SurfaceInterac
     vec3 ov0 = r.origin() - p0;
 
     // Check if u satisfies 0 <= u <= 1
-    float u = dot(alpha, ov0) * invDet;
+    u = dot(alpha, ov0) * invDet;
     if(u < 0.0f || u > 1.0f) return false;
 
     vec3 beta = cross(ov0, e1);
 
     // Check if v satisfies 0 <= v <= 1 & u + v <= 1
     // This can be interpreted to check if v satisfies 0 <= v <= 1-u
-    float v = dot(r.direction(), beta) * invDet;
+    v = dot(r.direction(), beta) * invDet;
     if(v < 0.0f || u + v > 1.0f) return false;
 
     // Check if Ray are behind polygon
-    float t = dot(e2, beta) * invDet;
+    t = dot(e2, beta) * invDet;
     if (t < t_min || t > t_max) return false;
 
+    return true;
+}
+
+bool Triangle::occluded(const Ray& r, Float t_min, Float t_max) const {
+    float t, u, v;
+    return hit(r, t_min, t_max, t, u, v);
+}
+
+bool Triangle::intersect(const Ray& r, Float t_min , Float t_max, SurfaceInteraction& si) const {
+    float t, u, v;
+    if(!hit(r, t_min, t_max, t, u, v)) return false;
+
     si.t = t;
     si.p = r.at(si.t);
-
-    vec3 normal;
-    // ===== Flat shading =====
-    if(mesh->normals.empty()) {
-        normal = normalize(cross(e2, e1));
-    }
-    // ===== Smooth shading =====
-    else {
-        auto n0 = mesh->normals[face[0]];
-        auto n1 = mesh->normals[face[1]];
-        auto n2 = mesh->normals[face[2]];
-        normal = normalize((1.0f - u - v)*n0 + u*n1 + v*n2);
-    }
-    si.set_face_normal(r, normal);
+    si.set_face_normal(r, normal_at(u, v));
+    si.uv = uv_at(u, v);
     return true;
 }
 
+// ---------------------------------------------------------------------------
+Float Triangle::pdf_value(const vec3& o, const vec3& v) const {
+    float t, u, w;
+    if(!hit(Ray(o, v), eps, infinity, t, u, w))
+        return 0;
+    const auto distance_squared = t * t * v.length_squared();
+    const auto cosine = fabs(dot(v, get_normal()) / v.length());
+    return distance_squared / (cosine * area());
+}
+
+vec3 Triangle::random(const vec3& o) const {
+    const vec3 p[3] = { mesh->vertices[face[0]], mesh->vertices[face[1]], mesh->vertices[face[2]] };
+    return random_in_triangle(p) - o;
+}
+
 // ---------------------------------------------------------------------------
 std::vector<std::shared_ptr<Shape>> createTriangleMesh(const std::string &filename, bool isSmooth) {
+    return createTriangleMesh(std::make_shared<TriangleMesh>(filename, isSmooth));
+}
+
+std::vector<std::shared_ptr<Shape>> createTriangleMesh(std::shared_ptr<TriangleMesh> mesh) {
     std::vector<std::shared_ptr<Shape>> triangles;
-    std::shared_ptr<TriangleMesh> mesh = std::make_shared<TriangleMesh>(filename, isSmooth);
     for(auto &face : mesh->faces) {
         triangles.emplace_back(std::make_shared<Triangle>(mesh, face));
     }
@@ -1,21 +1,47 @@
 #pragma once
 
 #include "../core/shape.h"
+#include "../core/mesh_cache.h"
 
 namespace mypt {
 
+/** \brief Vertex attributes and faces of a mesh in flat single precision buffers.
+ *  Buffers view the mapped mesh cache of the asset when it is up to date. */
 struct TriangleMesh {
-    TriangleMesh(const std::string &filename, bool isSmooth);
+    TriangleMesh(const std::string &filename, bool isSmooth, MeshCacheMode cache_mode = MeshCacheMode::Use);
     /* TriangleMesh(const std::vector<vec3> vertices, 
                  const std::vector<vec3>& normals, 
                  const std::vector<std::vector<int>> faces) {} */
 
-    std::vector<vec3> vertices;
-    std::vector<vec3> normals;
-    std::vector<int3> faces;
-    std::vector<vec2> texcoords;
+    int num_triangles() const { return static_cast<int>(faces.size()); }
+    // Shading normal (interpolated when the mesh has normals) at barycentric coordinates (u, v) of `face`.
+    vec3 normal_at(const int3& face, float u, float v) const;
+    // Texture coordinates (the barycentric ones when the mesh has none) at (u, v) of `face`.
+    vec2 uv_at(const int3& face, float u, float v) const;
+    size_t memory_bytes() const {
+        return vertices.size() * sizeof(float3) + normals.size() * sizeof(float3) 
+             + faces.size() * sizeof(int3) + texcoords.size() * sizeof(float2);
+    }
+
+    std::string filename;
+    MeshBuffer<float3> vertices;
+    MeshBuffer<float3> normals;
+    MeshBuffer<int3> faces;
+    MeshBuffer<float2> texcoords;
+    std::shared_ptr<MappedFile> cache_file;   // Keeps the buffers valid when they are mapped
 };
 
+/** Bounds of triangle `p` clipped by `box` (Sutherland-Hodgman on each slab),
+ *  so that long diagonal triangles get tight bounds in spatial splits of BVH. */
+AABB clip_triangle(const vec3 p[3], const AABB& box);
+
+/** Uniformly distributed point on the triangle `p`, by the square root warping of barycentric coordinates. */
+inline vec3 random_in_triangle(const vec3 p[3]) {
+    const Float su = std::sqrt(random_float());
+    const Float b1 = random_float() * su;
+    return (1 - su) * p[0] + b1 * p[1] + (su - b1) * p[2];
+}
+
 class Triangle final : public Shape {
 public:
     explicit Triangle() {}
@@ -25,9 +51,9 @@ public:
         vec3 p0 = mesh->vertices[face[0]];
         vec3 p1 = mesh->vertices[face[1]];
         vec3 p2 = mesh->vertices[face[2]];
-        min = vec3(); 
-        max = vec3();
-        for(auto p : {p0, p1, p2}) {
+        min = p0; 
+        max = p0;
+        for(auto p : {p1, p2}) {
             for(int i=0; i<3; i++) {
                 if(min[i] > p[i]) min[i] = p[i];
                 if(max[i] < p[i]) max[i] = p[i];
@@ -36,18 +62,32 @@ public:
     }
     
     bool intersect(const Ray& r, Float t_min, Float t_max, SurfaceInteraction& si) const override;
+    bool occluded(const Ray& r, Float t_min, Float t_max) const override;
     AABB bounding() const override { return AABB(min, max); }
+    AABB clipped_bounding(const AABB& box, const mat4& to_world) const override;
+    Float area() const override {
+        vec3 p0 = mesh->vertices[face[0]];
+        return 0.5 * cross(vec3(mesh->vertices[face[1]]) - p0, vec3(mesh->vertices[face[2]]) - p0).length();
+    }
+    bool flat_normal(vec3& n) const override { n = get_normal(); return true; }
+
+    Float pdf_value(const vec3& o, const vec3& v) const override;
+    vec3 random(const vec3& o) const override;
 
     /** TODO: Switch returned normal whether normals are allocated or not. */
     vec3 get_normal() const {
-        auto p0 = mesh->vertices[face[0]];
-        auto p1 = mesh->vertices[face[1]];
-        auto p2 = mesh->vertices[face[2]];
+        vec3 p0 = mesh->vertices[face[0]];
+        vec3 p1 = mesh->vertices[face[1]];
+        vec3 p2 = mesh->vertices[face[2]];
         return normalize(cross(p2-p0, p1-p0));
     }
 
+    // Shading normal (interpolated when the mesh has normals) at barycentric coordinates (u, v).
+    vec3 normal_at(float u, float v) const { return mesh->normal_at(face, u, v); }
+    vec2 uv_at(float u, float v) const { return mesh->uv_at(face, u, v); }
+
     std::vector<vec3> get_vertices() const {
-        return { mesh->vertices[face[0]], mesh->vertices[face[1]], mesh->vertices[face[2]] };
+        return { vec3(mesh->vertices[face[0]]), vec3(mesh->vertices[face[1]]), vec3(mesh->vertices[face[2]]) };
     }
 
     std::string to_string() const override {
@@ -61,11 +101,15 @@ public:
     }
 
 private:
+    // Distance and barycentric coordinates of hit point, which are shared by intersect() and occluded().
+    bool hit(const Ray& r, Float t_min, Float t_max, float& t, float& u, float& v) const;
+
     std::shared_ptr<TriangleMesh> mesh;
     int3 face;
     vec3 min, max; // For AABB
 };
 
 std::vector<std::shared_ptr<Shape>> createTriangleMesh(const std::string & filename, bool isSmooth=true);
+std::vector<std::shared_ptr<Shape>> createTriangleMesh(std::shared_ptr<TriangleMesh> mesh);
 
 }                                                    
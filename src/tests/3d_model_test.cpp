@@ -5,10 +5,10 @@ using namespace mypt;
 
 int main() {
     std::string filename = "../../data/model/Armadillo.ply";
-    std::vector<vec3> vertices;
-    std::vector<vec3> normals;
+    std::vector<float3> vertices;
+    std::vector<float3> normals;
     std::vector<int3> faces; 
-    std::vector<vec2> texcoords;
+    std::vector<float2> texcoords;
     loadPly(filename, vertices, normals, faces, texcoords);
 
     for (auto &v : vertices) Message(v);